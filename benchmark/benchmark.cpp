@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "../source/Config.h"
+#include "../source/FileSystem.h"
+using namespace std;
+
+
+// Microbenchmarks of FileSystem operations, results are written as JSON
+//
+// usage: unixfs-bench [-q] [-o <file>] [-t <dir>]
+//   -q   Quick run with smaller counts
+//   -o   Write results to file instead of standard output
+//   -t   Directory for the images of save and load (default: current directory)
+
+typedef chrono::steady_clock Clock;
+
+struct Result {
+	string name;
+	vector<pair<string, long long>> params;
+	int ops = 0;
+	int errors = 0;
+	double seconds = 0;
+	vector<double> latencies;   // Nanoseconds per operation
+};
+
+// Output of dir_list is dropped while it is measured
+class NullBuffer : public streambuf {
+protected:
+	int overflow(int c) override { return c; }
+	streamsize xsputn(const char*, streamsize n) override { return n; }
+};
+
+static vector<Result> results;
+static bool quick = false;
+
+
+// Run op(i) for i in [0, count) and record the latency of each call, op returns 0 on success
+template<typename Op>
+Result& measure(const string& name, const vector<pair<string, long long>>& params, int count, Op op) {
+	Result result;
+	result.name = name;
+	result.params = params;
+	result.ops = count;
+	result.latencies.reserve(count);
+
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < count; i++) {
+		Clock::time_point op_start = Clock::now();
+		if (op(i) != 0)
+			result.errors++;
+		result.latencies.push_back((double) chrono::duration_cast<chrono::nanoseconds>(Clock::now() - op_start).count());
+	}
+	result.seconds = chrono::duration<double>(Clock::now() - start).count();
+
+	cerr << left << setw(14) << name;
+	for (size_t i = 0; i < params.size(); i++)
+		cerr << " " << params[i].first << "=" << params[i].second;
+	cerr << ": " << count << " ops, " << (long long) (count / max(result.seconds, 1e-9)) << " ops/s";
+	if (result.errors > 0)
+		cerr << ", " << result.errors << " errors";
+	cerr << "\n";
+
+	results.push_back(result);
+	return results.back();
+}
+
+static double percentile(const vector<double>& sorted, double fraction) {
+	if (sorted.empty())
+		return 0;
+	size_t index = min(sorted.size() - 1, (size_t) (fraction * sorted.size()));
+	return sorted[index];
+}
+
+static void write_json(ostream& out) {
+	out << "{\n";
+	out << "  \"software\": \"" << SOFTWARE::VERSION_string() << "\",\n";
+	out << "  \"revision\": " << FileSystem::REV_LEVEL << ",\n";
+	out << "  \"quick\": " << (quick ? "true" : "false") << ",\n";
+	out << "  \"results\": [\n";
+	for (size_t i = 0; i < results.size(); i++) {
+		Result& result = results[i];
+		vector<double> sorted = result.latencies;
+		sort(sorted.begin(), sorted.end());
+
+		out << "    {\"name\": \"" << result.name << "\", \"params\": {";
+		for (size_t j = 0; j < result.params.size(); j++)
+			out << (j > 0 ? ", " : "") << "\"" << result.params[j].first << "\": " << result.params[j].second;
+		out << "}, \"ops\": " << result.ops << ", \"errors\": " << result.errors;
+		out << ", \"seconds\": " << result.seconds;
+		out << ", \"ops_per_sec\": " << (long long) (result.ops / max(result.seconds, 1e-9));
+		out << ", \"latency_ns\": {\"p50\": " << (long long) percentile(sorted, 0.50)
+			<< ", \"p90\": " << (long long) percentile(sorted, 0.90)
+			<< ", \"p99\": " << (long long) percentile(sorted, 0.99)
+			<< ", \"max\": " << (long long) (sorted.empty() ? 0 : sorted.back()) << "}}";
+		out << (i + 1 < results.size() ? ",\n" : "\n");
+	}
+	out << "  ]\n";
+	out << "}\n";
+}
+
+
+static void bench_init() {
+	vector<int> disk_sizes = {16, 64, 256};
+	vector<int> block_sizes = {1024, 4096};
+	int count = quick ? 3 : 10;
+	for (size_t i = 0; i < disk_sizes.size(); i++) {
+		for (size_t j = 0; j < block_sizes.size(); j++) {
+			int disk_size = disk_sizes[i] * 0x100000;
+			int block_size = block_sizes[j];
+			measure("init", {{"disk_mb", disk_sizes[i]}, {"block_size", block_size}}, count, [&](int) {
+				FileSystem fs;
+				return fs.init(disk_size, block_size);
+			});
+		}
+	}
+}
+
+// Creates spread over directories of a fixed width, then removed again
+static void bench_create_remove() {
+	int count = quick ? 2000 : 20000;
+	int width = 1000;
+	FileSystem fs;
+	fs.init(256 * 0x100000, 4096);
+	for (int i = 0; i < count / width; i++)
+		fs.dir_create("/", "d" + to_string(i));
+
+	measure("file_create", {{"files", count}, {"dir_width", width}, {"size", 100}}, count, [&](int i) {
+		return fs.file_create("/d" + to_string(i / width), "f" + to_string(i % width), 100);
+	});
+	measure("dir_create", {{"dirs", count}, {"dir_width", width}}, count, [&](int i) {
+		return fs.dir_create("/d" + to_string(i / width), "s" + to_string(i % width));
+	});
+	measure("file_remove", {{"files", count}, {"dir_width", width}}, count, [&](int i) {
+		return fs.file_remove("/d" + to_string(i / width), "f" + to_string(i % width));
+	});
+}
+
+// Path lookups through the dentry cache, leaves are spread over the deepest directory
+static void bench_lookup() {
+	vector<int> depths = {1, 4, 16};
+	vector<int> widths = {16, 1024};
+	int count = quick ? 20000 : 200000;
+	for (size_t i = 0; i < depths.size(); i++) {
+		for (size_t j = 0; j < widths.size(); j++) {
+			FileSystem fs;
+			fs.init(64 * 0x100000, 4096);
+			string path = "";
+			for (int level = 1; level < depths[i]; level++) {
+				fs.dir_create(path == "" ? "/" : path, "l" + to_string(level));
+				path += "/l" + to_string(level);
+			}
+			for (int k = 0; k < widths[j]; k++)
+				fs.file_create(path == "" ? "/" : path, "f" + to_string(k), 0);
+
+			vector<string> paths(widths[j]);
+			for (int k = 0; k < widths[j]; k++)
+				paths[k] = path + "/f" + to_string(k);
+			mt19937 random(12345);
+			vector<int> order(count);
+			for (int k = 0; k < count; k++)
+				order[k] = random() % widths[j];
+			measure("lookup", {{"depth", depths[i]}, {"dir_width", widths[j]}}, count, [&](int k) {
+				return fs.type_of(paths[order[k]]) == Inode::FILE ? 0 : 1;
+			});
+		}
+	}
+}
+
+static void bench_dir_list() {
+	vector<int> widths = {16, 1024};
+	int count = quick ? 50 : 500;
+	NullBuffer null_buffer;
+	for (size_t i = 0; i < widths.size(); i++) {
+		FileSystem fs;
+		fs.init(64 * 0x100000, 4096);
+		fs.dir_create("/", "d");
+		for (int k = 0; k < widths[i]; k++)
+			fs.file_create("/d", "f" + to_string(k), 0);
+
+		streambuf* cout_buffer = cout.rdbuf(&null_buffer);
+		measure("dir_list", {{"dir_width", widths[i]}}, count, [&](int) {
+			return fs.dir_list("/d");
+		});
+		cout.rdbuf(cout_buffer);
+	}
+}
+
+static void bench_save_load(const string& directory) {
+	vector<int> disk_sizes = {16, 64};
+	int count = quick ? 2 : 5;
+	for (size_t i = 0; i < disk_sizes.size(); i++) {
+		string path = directory + "/unixfs-bench-" + to_string(disk_sizes[i]) + ".img";
+		FileSystem fs;
+		fs.init(disk_sizes[i] * 0x100000, 4096);
+		for (int k = 0; k < 100; k++)
+			fs.file_create("/", "f" + to_string(k), 10000);
+
+		// Alternate between two paths so every save writes the whole image
+		measure("save", {{"disk_mb", disk_sizes[i]}}, count, [&](int k) {
+			return fs.save(path + (k % 2 ? ".1" : ""));
+		});
+		measure("load", {{"disk_mb", disk_sizes[i]}}, count, [&](int) {
+			FileSystem loaded;
+			return loaded.load(path);
+		});
+		remove(path.c_str());
+		remove((path + ".1").c_str());
+	}
+}
+
+
+int main(int argc, char** argv) {
+	string output_file;
+	string directory = ".";
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "-q")
+			quick = true;
+		else if (arg == "-o" && i + 1 < argc)
+			output_file = argv[++i];
+		else if (arg == "-t" && i + 1 < argc)
+			directory = argv[++i];
+		else {
+			cerr << "usage: " << argv[0] << " [-q] [-o <file>] [-t <dir>]\n";
+			return 2;
+		}
+	}
+
+	bench_init();
+	bench_create_remove();
+	bench_lookup();
+	bench_dir_list();
+	bench_save_load(directory);
+
+	if (output_file.empty()) {
+		write_json(cout);
+		return 0;
+	}
+	ofstream out(output_file);
+	if (!out) {
+		cerr << output_file << ": cannot write results\n";
+		return 1;
+	}
+	write_json(out);
+	return 0;
+}
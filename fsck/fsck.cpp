@@ -0,0 +1,64 @@
+#include <iostream>
+#include <string>
+#include "../source/FileSystem.h"
+using namespace std;
+
+
+// Consistency check of a disk image outside the console
+//
+// usage: unixfs-fsck [-r] [-d] <image>
+//   -r   Repair what is found and save the image back in place
+//   -d   Read blocks from the image when first used instead of loading it whole
+//
+// Exit codes follow e2fsck: 0 clean, 1 errors repaired, 4 errors left, 8 the image could
+// not be checked.
+
+int main(int argc, char** argv) {
+	bool repair = false;
+	int flags = 0;
+	string image;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "-r")
+			repair = true;
+		else if (arg == "-d")
+			flags |= FileSystem::LOAD_ON_DEMAND;
+		else if (image.empty() && arg[0] != '-')
+			image = arg;
+		else {
+			image = "";
+			break;
+		}
+	}
+	if (image.empty()) {
+		cerr << "usage: " << argv[0] << " [-r] [-d] <image>\n";
+		return 8;
+	}
+
+	// Compressed images are saved back compressed
+	bool compressed = false;
+	RawFile file;
+	char magic[sizeof(ChunkedHeader)];
+	if (file.open(image) && file.read_at(0, magic, sizeof(magic)))
+		compressed = ChunkedImage::detect(magic, sizeof(magic));
+	file.close();
+
+	FileSystem disk;
+	if (disk.load(image, flags) != FileSystem::SUCCESS) {
+		cerr << image << ": cannot load the image\n";
+		return 8;
+	}
+	// Ranges of the inode table are checked on every hardware thread
+	if (flags & FileSystem::LOAD_ON_DEMAND)
+		disk.set_concurrent(true);
+
+	int problems = 0;
+	int result = disk.check(repair, &problems);
+	if (problems == 0)
+		return 0;
+	if (repair && disk.save(image, compressed) != FileSystem::SUCCESS) {
+		cerr << image << ": cannot save the repaired image\n";
+		return 8;
+	}
+	return result == FileSystem::SUCCESS ? 1 : 4;
+}
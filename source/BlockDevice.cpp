@@ -0,0 +1,259 @@
+#include <cstring>
+#include <vector>
+#include "BlockDevice.h"
+#if defined(__linux__)
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+
+unique_ptr<BlockDevice> BlockDevice::open(string filepath, int flags) {
+#if defined(__linux__)
+	if (!(flags & NO_URING)) {
+		unique_ptr<UringDevice> device = make_unique<UringDevice>();
+		if (device->open(filepath, flags))
+			return device;
+	}
+#endif
+	unique_ptr<FileDevice> device = make_unique<FileDevice>();
+	if (!device->open(filepath, flags))
+		return NULL;
+	return device;
+}
+
+
+bool MemoryDevice::read(const Request* requests, int count) {
+	for (int i = 0; i < count; i++) {
+		if (requests[i].offset < 0 || requests[i].offset + (long long) requests[i].length > buffer_size)
+			return false;
+		memcpy(requests[i].data, buffer.get() + requests[i].offset, requests[i].length);
+	}
+	return true;
+}
+
+bool MemoryDevice::write(const Request* requests, int count) {
+	for (int i = 0; i < count; i++) {
+		if (requests[i].offset < 0 || requests[i].offset + (long long) requests[i].length > buffer_size)
+			return false;
+		memcpy(buffer.get() + requests[i].offset, requests[i].data, requests[i].length);
+	}
+	return true;
+}
+
+ZeroBuffer MemoryDevice::release() {
+	buffer_size = 0;
+	return move(buffer);
+}
+
+
+bool FileDevice::open(string filepath, int flags) {
+	if (!file.open(filepath, (flags & CREATE) != 0))
+		return false;
+	file_size = file.size();
+	// Without support for direct files every request is buffered
+	if (flags & DIRECT)
+		direct_file.open(filepath, false, true);
+	return true;
+}
+
+bool FileDevice::is_direct(long long offset, const char* data, size_t length) {
+	return direct_file.is_open() && offset % direct_align == 0 && length % direct_align == 0
+		&& (uintptr_t) data % direct_align == 0 && offset + (long long) length <= file_size;
+}
+
+bool FileDevice::read(const Request* requests, int count) {
+	for (int i = 0; i < count; i++) {
+		const Request& request = requests[i];
+		RawFile& target = is_direct(request.offset, request.data, request.length) ? direct_file : file;
+		if (!target.read_at(request.offset, request.data, request.length))
+			return false;
+	}
+	return true;
+}
+
+bool FileDevice::write(const Request* requests, int count) {
+	for (int i = 0; i < count; i++) {
+		const Request& request = requests[i];
+		RawFile& target = is_direct(request.offset, request.data, request.length) ? direct_file : file;
+		if (!target.write_at(request.offset, request.data, request.length))
+			return false;
+	}
+	file_size = file.size();
+	return true;
+}
+
+
+#if defined(__linux__)
+
+// Rings shared with the kernel, set up without liburing
+struct UringDevice::Ring {
+	int fd = -1;
+	unsigned entries = 0;
+
+	unsigned* sq_head = NULL;
+	unsigned* sq_tail = NULL;
+	unsigned* sq_mask = NULL;
+	unsigned* sq_array = NULL;
+	io_uring_sqe* sqes = NULL;
+
+	unsigned* cq_head = NULL;
+	unsigned* cq_tail = NULL;
+	unsigned* cq_mask = NULL;
+	io_uring_cqe* cqes = NULL;
+
+	void* sq_map = MAP_FAILED;
+	size_t sq_map_size = 0;
+	void* cq_map = MAP_FAILED;
+	size_t cq_map_size = 0;
+	size_t sqes_size = 0;
+
+	~Ring() {
+		if (sqes != NULL)
+			munmap(sqes, sqes_size);
+		if (cq_map != MAP_FAILED && cq_map != sq_map)
+			munmap(cq_map, cq_map_size);
+		if (sq_map != MAP_FAILED)
+			munmap(sq_map, sq_map_size);
+		if (fd != -1)
+			close(fd);
+	}
+};
+
+UringDevice::~UringDevice() {}
+
+bool UringDevice::open(string filepath, int flags) {
+	unique_ptr<Ring> new_ring = make_unique<Ring>();
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	new_ring->fd = (int) syscall(__NR_io_uring_setup, queue_depth, &params);
+	if (new_ring->fd < 0)
+		return false;
+	new_ring->entries = params.sq_entries;
+
+	new_ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	new_ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_map)
+		new_ring->sq_map_size = new_ring->cq_map_size = max(new_ring->sq_map_size, new_ring->cq_map_size);
+	new_ring->sq_map = mmap(NULL, new_ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, new_ring->fd, IORING_OFF_SQ_RING);
+	if (new_ring->sq_map == MAP_FAILED)
+		return false;
+	new_ring->cq_map = single_map ? new_ring->sq_map
+		: mmap(NULL, new_ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, new_ring->fd, IORING_OFF_CQ_RING);
+	if (new_ring->cq_map == MAP_FAILED)
+		return false;
+	new_ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = mmap(NULL, new_ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, new_ring->fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+		return false;
+	new_ring->sqes = (io_uring_sqe*) sqes;
+
+	char* sq = (char*) new_ring->sq_map;
+	new_ring->sq_head = (unsigned*) (sq + params.sq_off.head);
+	new_ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+	new_ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+	new_ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+	char* cq = (char*) new_ring->cq_map;
+	new_ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+	new_ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+	new_ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+	new_ring->cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+
+	if (!FileDevice::open(filepath, flags))
+		return false;
+	ring = move(new_ring);
+	return true;
+}
+
+bool UringDevice::submit(const Request* requests, int count, bool is_write) {
+	lock_guard<mutex> guard(ring_lock);
+	if (!ring)
+		return is_write ? FileDevice::write(requests, count) : FileDevice::read(requests, count);
+
+	// Large requests are split, so one run of blocks is served by several at once
+	struct Piece {
+		long long offset;
+		char* data;
+		unsigned length;
+		RawFile* file;
+	};
+	vector<Piece> pieces;
+	for (int i = 0; i < count; i++) {
+		for (size_t done = 0; done < requests[i].length; ) {
+			Piece piece;
+			piece.offset = requests[i].offset + (long long) done;
+			piece.data = requests[i].data + done;
+			piece.length = (unsigned) min((size_t) piece_max, requests[i].length - done);
+			piece.file = is_direct(piece.offset, piece.data, piece.length) ? &direct_file : &file;
+			pieces.push_back(piece);
+			done += piece.length;
+		}
+	}
+
+	Ring& r = *ring;
+	size_t next = 0;
+	unsigned in_flight = 0;
+	unsigned unsubmitted = 0;
+	bool failed = false;
+	while (in_flight > 0 || (next < pieces.size() && !failed)) {
+		// Fill the submission queue, the kernel takes the entries in io_uring_enter
+		unsigned tail = *r.sq_tail;
+		while (!failed && next < pieces.size() && in_flight < r.entries) {
+			const Piece& piece = pieces[next];
+			unsigned index = tail & *r.sq_mask;
+			io_uring_sqe* sqe = &r.sqes[index];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = is_write ? IORING_OP_WRITE : IORING_OP_READ;
+			sqe->fd = piece.file->descriptor();
+			sqe->addr = (uint64_t) (uintptr_t) piece.data;
+			sqe->len = piece.length;
+			sqe->off = (uint64_t) piece.offset;
+			sqe->user_data = next;
+			r.sq_array[index] = index;
+			tail++;
+			next++;
+			in_flight++;
+			unsubmitted++;
+		}
+		__atomic_store_n(r.sq_tail, tail, __ATOMIC_RELEASE);
+
+		int entered = (int) syscall(__NR_io_uring_enter, r.fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (entered < 0) {
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+				continue;
+			// Closing the ring waits for the requests in flight, later batches use pread/pwrite
+			ring.reset();
+			return false;
+		}
+		unsubmitted -= min((unsigned) entered, unsubmitted);
+
+		unsigned head = *r.cq_head;
+		unsigned cq_tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != cq_tail; head++) {
+			const io_uring_cqe& cqe = r.cqes[head & *r.cq_mask];
+			const Piece& piece = pieces[(size_t) cqe.user_data];
+			in_flight--;
+			if (cqe.res < 0 || (cqe.res == 0 && piece.length > 0)) {
+				failed = true;
+				continue;
+			}
+			// Short transfers are finished in place
+			unsigned done = (unsigned) cqe.res;
+			if (done < piece.length) {
+				bool finished = is_write ? file.write_at(piece.offset + done, piece.data + done, piece.length - done)
+					: file.read_at(piece.offset + done, piece.data + done, piece.length - done);
+				failed |= !finished;
+			}
+		}
+		__atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+	}
+	if (is_write)
+		file_size = file.size();
+	return !failed;
+}
+
+#endif
@@ -0,0 +1,116 @@
+#pragma once
+#ifndef BLOCK_DEVICE_H
+#define BLOCK_DEVICE_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <cstddef>
+#include "RawFile.h"
+#include "Support.h"
+
+
+// Storage behind a disk. Requests of one batch may be served together and in any order,
+// the batch returns once all of them are done.
+class BlockDevice {
+public:
+	// Flags of open()
+	static const int CREATE = 0x1;   // Create the file if it does not exist
+	static const int DIRECT = 0x2;   // Aligned requests bypass the page cache of the system
+	static const int NO_URING = 0x4;   // pread/pwrite even where io_uring is available
+
+	// Direct requests are aligned to this in offset, length and memory
+	static const int direct_align = 4096;
+
+	struct Request {
+		long long offset;
+		char* data;
+		size_t length;
+	};
+
+	BlockDevice() {}
+	BlockDevice(const BlockDevice&) = delete;
+	BlockDevice& operator=(const BlockDevice&) = delete;
+	virtual ~BlockDevice() {}
+
+	virtual const char* name() const = 0;
+	virtual long long size() = 0;
+	virtual bool read(const Request* requests, int count) = 0;
+	virtual bool write(const Request* requests, int count) = 0;
+	virtual bool sync() = 0;
+
+	// Devices in memory are addressed in place, the others are read into a buffer
+	virtual char* memory() { return NULL; }
+
+	// Image file on io_uring where the system has it, on pread/pwrite otherwise
+	static std::unique_ptr<BlockDevice> open(std::string filepath, int flags = 0);
+};
+
+
+// Disk without an image file, its memory is the disk
+class MemoryDevice : public BlockDevice {
+public:
+	MemoryDevice(ZeroBuffer buffer, long long size) : buffer(std::move(buffer)), buffer_size(size) {}
+
+	const char* name() const override { return "memory"; }
+	long long size() override { return buffer_size; }
+	bool read(const Request* requests, int count) override;
+	bool write(const Request* requests, int count) override;
+	bool sync() override { return true; }
+	char* memory() override { return buffer.get(); }
+
+	// Hands the memory over when the disk is attached to an image file
+	ZeroBuffer release();
+
+private:
+	ZeroBuffer buffer;
+	long long buffer_size = 0;
+};
+
+
+// Image file read and written with pread/pwrite
+class FileDevice : public BlockDevice {
+public:
+	bool open(std::string filepath, int flags);
+
+	const char* name() const override { return direct_file.is_open() ? "pread (direct)" : "pread"; }
+	long long size() override { return file.size(); }
+	bool read(const Request* requests, int count) override;
+	bool write(const Request* requests, int count) override;
+	bool sync() override { return file.sync(); }
+
+protected:
+	// Unaligned requests of a direct device go through the page cache
+	bool is_direct(long long offset, const char* data, size_t length);
+
+	RawFile file;
+	RawFile direct_file;
+	long long file_size = 0;   // Direct requests stay inside, the file does not grow
+};
+
+
+#if defined(__linux__)
+// Image file with every batch submitted to an io_uring at once
+class UringDevice : public FileDevice {
+public:
+	~UringDevice();
+
+	bool open(std::string filepath, int flags);
+
+	const char* name() const override { return direct_file.is_open() ? "io_uring (direct)" : "io_uring"; }
+	bool read(const Request* requests, int count) override { return submit(requests, count, false); }
+	bool write(const Request* requests, int count) override { return submit(requests, count, true); }
+
+private:
+	static const unsigned queue_depth = 64;
+	static const size_t piece_max = 0x1000000;   // Requests are split so they run side by side
+
+	struct Ring;
+	bool submit(const Request* requests, int count, bool is_write);
+
+	std::unique_ptr<Ring> ring;
+	std::mutex ring_lock;   // One batch at a time
+};
+#endif
+
+#endif
@@ -0,0 +1,123 @@
+#include <atomic>
+#include <cstring>
+#include "ChunkedImage.h"
+#include "Compression.h"
+#include "Support.h"
+using namespace std;
+
+
+bool ChunkedImage::detect(const char* data, size_t length) {
+	ChunkedHeader found;
+	if (length < sizeof(ChunkedHeader))
+		return false;
+	memcpy(&found, data, sizeof(ChunkedHeader));
+	return found.magic == ChunkedHeader::MAGIC;
+}
+
+bool ChunkedImage::write(string filepath, const char* data, long long size, ThreadPool& pool, int chunk_size) {
+	ChunkedHeader header;
+	header.chunk_size = chunk_size;
+	header.chunks_count = (int) ((size + chunk_size - 1) / chunk_size);
+	header.disk_size = size;
+
+	// Chunks are compressed in parallel, stored chunks are written from the disk itself
+	vector<ChunkEntry> entries(header.chunks_count);
+	vector<vector<char>> compressed(header.chunks_count);
+	pool.for_each(header.chunks_count, [&](int i) {
+		const char* chunk = data + (long long) i * chunk_size;
+		int length = (int) min<long long>(chunk_size, size - (long long) i * chunk_size);
+		if (is_zeros(chunk, length)) {
+			entries[i].flags = ChunkEntry::ZEROS;
+			return;
+		}
+		compressed[i].resize(lz_bound(length));
+		size_t compressed_size = lz_compress(chunk, length, compressed[i].data(), length - 1);
+		if (compressed_size == 0) {
+			entries[i].flags = ChunkEntry::STORED;
+			entries[i].size = length;
+			compressed[i].clear();
+			compressed[i].shrink_to_fit();
+			return;
+		}
+		compressed[i].resize(compressed_size);
+		compressed[i].shrink_to_fit();
+		entries[i].size = (int) compressed_size;
+	});
+
+	long long offset = sizeof(ChunkedHeader) + (long long) header.chunks_count * sizeof(ChunkEntry);
+	for (int i = 0; i < header.chunks_count; i++) {
+		entries[i].offset = offset;
+		offset += entries[i].size;
+	}
+
+	RawFile file;
+	if (!file.open(filepath, true) || !file.resize(0))
+		return false;
+	if (!file.write_at(0, (const char*) &header, sizeof(header)))
+		return false;
+	if (header.chunks_count > 0 && !file.write_at(sizeof(header), (const char*) entries.data(), entries.size() * sizeof(ChunkEntry)))
+		return false;
+	for (int i = 0; i < header.chunks_count; i++) {
+		const char* chunk = compressed[i].data();
+		if (entries[i].flags & ChunkEntry::STORED)
+			chunk = data + (long long) i * chunk_size;
+		if (entries[i].size > 0 && !file.write_at(entries[i].offset, chunk, entries[i].size))
+			return false;
+	}
+	return file.sync();
+}
+
+bool ChunkedImage::open(string filepath) {
+	entries.clear();
+	header = ChunkedHeader();
+	if (!file.open(filepath))
+		return false;
+	long long file_size = file.size();
+	if (file_size < (long long) sizeof(ChunkedHeader) || !file.read_at(0, (char*) &header, sizeof(header)))
+		return false;
+	if (header.magic != ChunkedHeader::MAGIC || header.version != ChunkedHeader::VERSION || header.chunk_size <= 0
+		|| header.disk_size < 0 || header.chunks_count != (header.disk_size + header.chunk_size - 1) / header.chunk_size)
+		return false;
+
+	long long index_end = sizeof(ChunkedHeader) + (long long) header.chunks_count * sizeof(ChunkEntry);
+	if (index_end > file_size)
+		return false;
+	entries.resize(header.chunks_count);
+	if (header.chunks_count > 0 && !file.read_at(sizeof(ChunkedHeader), (char*) entries.data(), entries.size() * sizeof(ChunkEntry)))
+		return false;
+	for (int i = 0; i < header.chunks_count; i++) {
+		if (entries[i].size < 0 || entries[i].offset < index_end || entries[i].offset + entries[i].size > file_size)
+			return false;
+	}
+	return true;
+}
+
+bool ChunkedImage::read_chunk(int index, char* dest) {
+	if (index < 0 || index >= header.chunks_count)
+		return false;
+	const ChunkEntry& entry = entries[index];
+	int length = (int) min<long long>(header.chunk_size, header.disk_size - (long long) index * header.chunk_size);
+	if (entry.flags & ChunkEntry::ZEROS) {
+		memset(dest, 0, length);
+		return true;
+	}
+	if (entry.flags & ChunkEntry::STORED)
+		return entry.size == length && file.read_at(entry.offset, dest, length);
+
+	vector<char> compressed(entry.size);
+	if (!file.read_at(entry.offset, compressed.data(), entry.size))
+		return false;
+	return lz_decompress(compressed.data(), entry.size, dest, length);
+}
+
+bool ChunkedImage::read_all(char* dest, ThreadPool& pool) {
+	// Zero chunks are skipped, the destination is expected to be zeroed
+	atomic<bool> failed(false);
+	pool.for_each(header.chunks_count, [&](int i) {
+		if (failed || (entries[i].flags & ChunkEntry::ZEROS))
+			return;
+		if (!read_chunk(i, dest + (long long) i * header.chunk_size))
+			failed = true;
+	});
+	return !failed;
+}
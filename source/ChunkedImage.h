@@ -0,0 +1,58 @@
+#pragma once
+#ifndef CHUNKED_IMAGE_H
+#define CHUNKED_IMAGE_H
+
+#include <string>
+#include <cstdint>
+#include <vector>
+#include "RawFile.h"
+#include "ThreadPool.h"
+
+
+// Disk image split into fixed size chunks that are compressed on their own. The
+// header is followed by an index with the place of every chunk, then the chunks.
+struct ChunkedHeader {
+	static const uint32_t MAGIC = 0x5A434655;   // "UFCZ"
+	static const int VERSION = 1;
+
+	uint32_t magic = MAGIC;
+	int version = VERSION;
+	int chunk_size = 0;
+	int chunks_count = 0;
+	long long disk_size = 0;
+};
+
+struct ChunkEntry {
+	static const int ZEROS = 0x1;   // Chunk of zeros, nothing is stored
+	static const int STORED = 0x2;   // Did not compress, stored as is
+
+	long long offset = 0;
+	int size = 0;
+	int flags = 0;
+};
+
+
+class ChunkedImage {
+public:
+	static const int chunk_size_default = 0x40000;
+
+	// True if the file starts with the header of a chunked image
+	static bool detect(const char* data, size_t length);
+
+	static bool write(std::string filepath, const char* data, long long size, ThreadPool& pool, int chunk_size = chunk_size_default);
+
+	// Chunks are read at random through the index, read_chunk() may be called from several threads
+	bool open(std::string filepath);
+	long long disk_size() const { return header.disk_size; }
+	int chunk_size() const { return header.chunk_size; }
+	int chunks_count() const { return header.chunks_count; }
+	bool read_chunk(int index, char* dest);
+	bool read_all(char* dest, ThreadPool& pool);
+
+private:
+	RawFile file;
+	ChunkedHeader header;
+	std::vector<ChunkEntry> entries;
+};
+
+#endif
@@ -0,0 +1,154 @@
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "Compression.h"
+using namespace std;
+
+
+static const size_t MIN_MATCH = 4;
+static const size_t MAX_OFFSET = 0xFFFF;
+static const size_t LAST_LITERALS = 5;   // Input tail that is never part of a match
+static const int HASH_BITS = 14;
+
+static inline uint32_t read32(const uint8_t* data) {
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static inline uint32_t hash32(uint32_t sequence) {
+	return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static inline void length_write(uint8_t*& out, size_t length) {
+	while (length >= 255) {
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = (uint8_t) length;
+}
+
+static inline bool length_read(const uint8_t*& in, const uint8_t* in_end, size_t* length) {
+	uint8_t byte;
+	do {
+		if (in == in_end)
+			return false;
+		byte = *in++;
+		*length += byte;
+	} while (byte == 255);
+	return true;
+}
+
+
+size_t lz_bound(size_t size) {
+	return size + size / 255 + 16;
+}
+
+size_t lz_compress(const char* source, size_t size, char* dest, size_t capacity) {
+	const uint8_t* in = (const uint8_t*) source;
+	uint8_t* out = (uint8_t*) dest;
+	uint8_t* out_end = out + capacity;
+
+	// Positions are stored + 1, 0 is an empty slot
+	vector<uint32_t> table((size_t) 1 << HASH_BITS, 0);
+	size_t anchor = 0;
+	size_t pos = 0;
+	size_t match_limit = size > LAST_LITERALS + MIN_MATCH ? size - LAST_LITERALS : 0;
+	while (pos + MIN_MATCH <= match_limit) {
+		uint32_t sequence = read32(in + pos);
+		uint32_t& slot = table[hash32(sequence)];
+		size_t candidate = slot;
+		slot = (uint32_t) (pos + 1);
+		if (candidate == 0 || pos - (candidate - 1) > MAX_OFFSET || read32(in + candidate - 1) != sequence) {
+			// Step faster through data that does not compress
+			pos += 1 + ((pos - anchor) >> 6);
+			continue;
+		}
+
+		size_t match = candidate - 1;
+		size_t length = MIN_MATCH;
+		while (pos + length < match_limit && in[match + length] == in[pos + length])
+			length++;
+		while (pos > anchor && match > 0 && in[pos - 1] == in[match - 1]) {
+			pos--;
+			match--;
+			length++;
+		}
+
+		size_t literals = pos - anchor;
+		if ((size_t) (out_end - out) < 1 + literals / 255 + 1 + literals + 2 + (length - MIN_MATCH) / 255 + 1)
+			return 0;
+		uint8_t* token = out++;
+		*token = (uint8_t) ((literals < 15 ? literals : 15) << 4);
+		if (literals >= 15)
+			length_write(out, literals - 15);
+		memcpy(out, in + anchor, literals);
+		out += literals;
+
+		size_t offset = pos - match;
+		*out++ = (uint8_t) offset;
+		*out++ = (uint8_t) (offset >> 8);
+		size_t match_length = length - MIN_MATCH;
+		*token |= (uint8_t) (match_length < 15 ? match_length : 15);
+		if (match_length >= 15)
+			length_write(out, match_length - 15);
+
+		pos += length;
+		anchor = pos;
+	}
+
+	// Remaining input is the literals of the last sequence
+	size_t literals = size - anchor;
+	if ((size_t) (out_end - out) < 1 + literals / 255 + 1 + literals)
+		return 0;
+	*out++ = (uint8_t) ((literals < 15 ? literals : 15) << 4);
+	if (literals >= 15)
+		length_write(out, literals - 15);
+	memcpy(out, in + anchor, literals);
+	out += literals;
+	return out - (uint8_t*) dest;
+}
+
+bool lz_decompress(const char* source, size_t size, char* dest, size_t dest_size) {
+	const uint8_t* in = (const uint8_t*) source;
+	const uint8_t* in_end = in + size;
+	uint8_t* out = (uint8_t*) dest;
+	uint8_t* out_start = out;
+	uint8_t* out_end = out + dest_size;
+
+	while (in < in_end) {
+		uint8_t token = *in++;
+		size_t literals = token >> 4;
+		if (literals == 15 && !length_read(in, in_end, &literals))
+			return false;
+		if (literals > (size_t) (in_end - in) || literals > (size_t) (out_end - out))
+			return false;
+		memcpy(out, in, literals);
+		in += literals;
+		out += literals;
+		if (in == in_end)
+			break;
+
+		if (in_end - in < 2)
+			return false;
+		size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+		size_t length = token & 15;
+		if (length == 15 && !length_read(in, in_end, &length))
+			return false;
+		length += MIN_MATCH;
+		if (offset == 0 || offset > (size_t) (out - out_start) || length > (size_t) (out_end - out))
+			return false;
+
+		// Matches may overlap their own output
+		const uint8_t* match = out - offset;
+		if (offset >= length) {
+			memcpy(out, match, length);
+			out += length;
+		} else {
+			for (size_t i = 0; i < length; i++)
+				*out++ = match[i];
+		}
+	}
+	return out == out_end;
+}
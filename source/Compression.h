@@ -0,0 +1,22 @@
+#pragma once
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+
+
+// Fast LZ77 codec in the style of LZ4. A sequence is a token, literals, then a match:
+// the token holds the literal count in the high nibble and the match length - 4 in
+// the low nibble, 15 means more length bytes follow. A match is a 2 byte little
+// endian offset back into the output. The last sequence has literals only.
+
+// Largest output of lz_compress() for size bytes of input
+size_t lz_bound(size_t size);
+
+// Returns the compressed size, 0 if the output does not fit in capacity
+size_t lz_compress(const char* source, size_t size, char* dest, size_t capacity);
+
+// Fails unless the input decodes to exactly dest_size bytes
+bool lz_decompress(const char* source, size_t size, char* dest, size_t dest_size);
+
+#endif
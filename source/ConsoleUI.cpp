@@ -25,31 +25,43 @@ vector<ConsoleUI::Command> ConsoleUI::command_list = {
         "Quits the program"),
         
     Command(&save_vd,
-        "image-save", "[filename]",
-        "Save disk image to file."),
+        "image-save", "[filename] [-z]",
+        "Save disk image to file, -z compresses it in chunks"),
 	Command(&load_vd,
-        "image-load", "",
-        "Load disk image from file"),
+        "image-load", "[filename] [-m] [-d] [-c <cache_size>] [-o] [-p]",
+        "Load disk image from file, -m maps it without the journal, -d reads blocks when first used, -c also keeps at most cache_size KB of them, -o bypasses the system cache, -p avoids io_uring"),
 	Command(&create_vd,
         "image-create", "<filename> <disk_size> <block_size>",
         "Create a new disk image file"),
+	Command(&sync_vd,
+        "sync", "",
+        "Commit pending changes to the journal of the image file, or flush them to a mapped image"),
         
 	Command(&display_usage,
-        "sum", "",
+        "sum", "[-v]",
         "Print properties of the current disk"),
+	Command(&check_disk,
+        "fsck", "[-r]",
+        "Check the disk for lost blocks and inodes, orphans and cross-linked blocks, -r repairs them"),
+	Command(&defrag_disk,
+        "defrag", "[-m] [-i <blocks>]",
+        "Move the blocks of every file into one run and the free space to the end of the disk, -m only prints the fragmentation, -i moves at most blocks after each following command, 0 stops"),
+	Command(&display_stats,
+        "stats", "[-r]",
+        "Print call counts and latencies of file system operations, -r resets them afterwards"),
         
 	Command(&create_file,
         "newfile", "<name> <size>",
         "Create a new file"),
 	Command(&delete_file,
-        "rm", "<name>",
-        "Remove a file"),
+        "rm", "[-r] <name>",
+        "Remove a file, -r removes a directory with everything in it"),
 	Command(&display_file,
         "cat", "<name>",
         "Print contents of a file"),
 	Command(&copy_file,
-        "cp", "<source_file> <destination_file>",
-        "Copy contents of a file"),
+        "cp", "[-r] <source_file> <destination_file>",
+        "Copy contents of a file, -r copies a directory with everything in it"),
 	Command(&list_dir,
         "ls", "[path]",
         "List contents of a directory"),
@@ -58,64 +70,115 @@ vector<ConsoleUI::Command> ConsoleUI::command_list = {
         "Make a new directory"),
 	Command(&delete_dir,
         "rmdir", "<name>",
-        "Remove a directory"),
+        "Remove an empty directory"),
 	Command(&change_working_dir,
         "cd", "<path>",
         "Change current working directory"),
+	Command(&display_tree_usage,
+        "du", "[path]",
+        "Print files, size and blocks used by a directory and everything in it"),
+	Command(&find_in_tree,
+        "find", "[path] [-name <pattern>] [-type f|d]",
+        "Print paths below a directory that match a name with wildcards and a type"),
 };
 
 
 int ConsoleUI::about(int argc, char** argv) {
-	cout << SOFTWARE::NAME << " " << SOFTWARE::VERSION_string() << endl;
+	cout << SOFTWARE::NAME << " " << SOFTWARE::VERSION_string() << "\n";
     
     if (SOFTWARE::AUTHORS.size() > 1) {
-        cout << "(c) 2019 " << endl;
+        cout << "(c) 2019 \n";
         for (size_t i = 0; i < SOFTWARE::AUTHORS.size(); i++)
-            cout << SOFTWARE::AUTHORS[i] << endl;
+            cout << SOFTWARE::AUTHORS[i] << "\n";
         cout << "All rights reserved.\n";
     } else {
         cout << "(c) 2019 " << SOFTWARE::AUTHORS[0] << ". All rights reserved.\n";
     }
-	cout << endl;
+	cout << "\n";
 	cout << SOFTWARE::NAME << " comes with ABSOLUTELY NO WARRANTY, to the\n";
 	cout << "extent permitted by applicable law.\n";
-	cout << endl;
+	cout << "\n";
 	return SUCCESS;
 }
 
-int ConsoleUI::main_loop() {
-	disk_file = DEFAULT_DISK_FILE;
+int ConsoleUI::open_disk(string path) {
 	virtual_disk = FileSystem();
-    if (virtual_disk.load(DEFAULT_DISK_FILE) != SUCCESS) {
-        virtual_disk.init(16 * 0x100000, 1024);
-        disk_file = memory_disk_symbol;
-    }
 	PWD = "/";
+	running = true;
+	defrag_budget = 0;
+
+	// Without a path the default image is used if it exists
+	disk_file = path.empty() ? DEFAULT_DISK_FILE : path;
+	int exit_code = virtual_disk.load(disk_file);
+	if (exit_code != SUCCESS) {
+		// An image named explicitly is never replaced by a blank disk
+		if (!path.empty()) {
+			cerr << path << ": cannot load disk image\n";
+			return exit_code;
+		}
+		virtual_disk.init(16 * 0x100000, 1024);
+		disk_file = memory_disk_symbol;
+	}
+	return SUCCESS;
+}
+
+int ConsoleUI::main_loop(string path) {
+	if (open_disk(path) != SUCCESS)
+		return 2;
     
     about();
-	while (true) {
+	while (running) {
         string user_input;
 		cout << disk_file << ":" << PWD << " $ ";
-        getline(cin, user_input);
+        if (!getline(cin, user_input))
+            break;
         
 		this->exec_cmd(user_input);
-		cout << endl;
+		cout << "\n";
 	};
-	cout << endl;
+	cout << "\n";
+	virtual_disk.sync();
 	return 0;
 }
 
+int ConsoleUI::run_script(istream& script, string path, bool stop_on_error) {
+	if (open_disk(path) != SUCCESS)
+		return 2;
+
+	// No prompts and no flushing until the output buffer fills up
+	cin.tie(NULL);
+	int exit_code = SUCCESS;
+	string user_input;
+	for (int line = 1; running && getline(script, user_input); line++) {
+		if (!user_input.empty() && user_input.back() == '\r')
+			user_input.pop_back();
+		if (user_input.empty() || user_input[0] == '#')
+			continue;
+
+		exit_code = this->exec_cmd(user_input);
+		if (exit_code != SUCCESS && stop_on_error) {
+			cout.flush();
+			cerr << "line " << line << ": " << user_input << "\n";
+			break;
+		}
+		exit_code = SUCCESS;
+	}
+	virtual_disk.sync();
+	cout.flush();
+	return exit_code == SUCCESS ? 0 : 1;
+}
+
 int ConsoleUI::exec_cmd(string user_input) {
 	vector<string> args = str2argv(user_input);
 	if (args.size() == 0)
 		return SUCCESS;
     
-    Command cmd;
-    for (size_t i = 0; i < command_list.size(); i++) {
+    const Command* cmd = NULL;
+    for (size_t i = 0; i < command_list.size() && cmd == NULL; i++) {
         if (args[0] == command_list[i].command)
-            cmd = command_list[i];
+            cmd = &command_list[i];
     }
-    if (cmd.function == NULL) {
+    if (cmd == NULL) {
 		cout << args[0] << ": command not found\n";
 		return INVALID_COMMAND;
 	}
@@ -128,7 +191,7 @@ int ConsoleUI::exec_cmd(string user_input) {
 	if (cstrings.size() > 0)
 		argv_ptr = &cstrings[0];
 
-	int exit_code = (this->*(cmd.function))(cstrings.size(), argv_ptr);
+	int exit_code = (this->*(cmd->function))(cstrings.size(), argv_ptr);
 	switch (exit_code)
 	{
 	case FAILED: cout << "Command failed.\n"; break;
@@ -137,6 +200,8 @@ int ConsoleUI::exec_cmd(string user_input) {
 	case INCOMPATIBLE: cout << "Incompatible feeatures detected.\n"; break;
 	case NOT_FILE: cout << "The path entered is not a file.\n"; break;
 	case NOT_DIR: cout << "The path entered is not a directory.\n"; break;
+	case NOT_EMPTY: cout << "The directory is not empty.\n"; break;
+	case INCONSISTENT: cout << "The file system has errors.\n"; break;
 
 	case INVALID_SYNTAX: cout << "Syntax of comamnd is incorrect.\n"; break;
 	case INVALID_PATH: cout << "Invalid path.\n"; break;
@@ -145,7 +210,11 @@ int ConsoleUI::exec_cmd(string user_input) {
 	default: break;
 	}
     if (exit_code == INVALID_SYNTAX)
-        cout << "usage: " << cmd.command << "   " << cmd.syntax << endl;
+        cout << "usage: " << cmd->command << "   " << cmd->syntax << "\n";
+
+	// Incremental defragmentation runs between commands until nothing is left to move
+	if (defrag_budget > 0 && virtual_disk.defrag_step(defrag_budget) == -1)
+		defrag_budget = 0;
 	return exit_code;
 }
 
@@ -158,17 +227,17 @@ int ConsoleUI::display_help(int argc, char** argv) {
                 cmd = command_list[i];
         }
         if (cmd.function != NULL) {
-            cout << cmd.description << endl;
-            cout << endl;
-            cout << cmd.command << "   " << cmd.syntax << endl;
+            cout << cmd.description << "\n";
+            cout << "\n";
+            cout << cmd.command << "   " << cmd.syntax << "\n";
             return SUCCESS;
         }
     }
     cout << "List of commands:\n";
-    cout << endl;
+    cout << "\n";
     for (size_t i = 0; i < command_list.size(); i++)
         cout << left << setw(16) << command_list[i].command << command_list[i].description << "\n";
-    cout << endl;
+    cout << "\n";
     cout << "For more information on a command: \n";
     cout << "help   <command>\n";
     return SUCCESS;
@@ -176,12 +245,12 @@ int ConsoleUI::display_help(int argc, char** argv) {
 
 int ConsoleUI::display_version(int argc, char** argv) {
     const int width = 24;
-    cout << left << setw(width) << "Software version" << ": " << SOFTWARE::VERSION_string() << endl;
-    cout << left << setw(width) << "File system revision" << ": " << FileSystem::REV_LEVEL << endl;
-    cout << left << setw(width) << "Console UI revision" << ": " << ConsoleUI::REV_LEVEL << endl;
-    cout << endl;
-    cout << left << setw(width) << "Compiler" << ": " << SOFTWARE::COMPILER << endl;
-    cout << left << setw(width) << "Build time" << ": " << SOFTWARE::BUILD_DATE << " " << SOFTWARE::BUILD_TIME << endl;
+    cout << left << setw(width) << "Software version" << ": " << SOFTWARE::VERSION_string() << "\n";
+    cout << left << setw(width) << "File system revision" << ": " << FileSystem::REV_LEVEL << "\n";
+    cout << left << setw(width) << "Console UI revision" << ": " << ConsoleUI::REV_LEVEL << "\n";
+    cout << "\n";
+    cout << left << setw(width) << "Compiler" << ": " << SOFTWARE::COMPILER << "\n";
+    cout << left << setw(width) << "Build time" << ": " << SOFTWARE::BUILD_DATE << " " << SOFTWARE::BUILD_TIME << "\n";
     
     return SUCCESS;
 }
@@ -195,47 +264,168 @@ int ConsoleUI::clear_screen(int argc, char** argv) {
 }
 
 int ConsoleUI::exit_console(int argc, char** argv) {
-    exit(EXIT_SUCCESS);
+    running = false;
     return SUCCESS;
 }
 
  
 int ConsoleUI::display_usage(int argc, char** argv) {
-	int exit_code = virtual_disk.display_properties();
+	if (argc > 1)
+		return INVALID_SYNTAX;
+
+	bool verify = false;
+	if (argc == 1) {
+		if (string(argv[0]) != "-v")
+			return INVALID_SYNTAX;
+		verify = true;
+	}
+
+	int exit_code = virtual_disk.display_properties(verify);
 	return translate_storage_code(exit_code);
 }
 
 int ConsoleUI::save_vd(int argc, char** argv) {
-	if (argc > 1)
+	if (argc > 2)
 		return INVALID_SYNTAX;
+
+	bool compressed = false;
+	string filename = disk_file;
+	for (int i = 0; i < argc; i++) {
+		if (string(argv[i]) == "-z")
+			compressed = true;
+		else if (i == 0)
+			filename = argv[i];
+		else
+			return INVALID_SYNTAX;
+	}
+    disk_file = filename;
     
-    if (argc == 1)
-        disk_file = argv[0];
-    
-	int exit_code = virtual_disk.save(disk_file);
+	int exit_code = virtual_disk.save(disk_file, compressed);
 	return translate_storage_code(exit_code);
 }
 
 int ConsoleUI::load_vd(int argc, char** argv) {
-	if (argc > 1)
+	if (argc > 7)
 		return INVALID_SYNTAX;
 
-    if (argc == 1)
-        disk_file = argv[0];
+	bool mapped = false;
+	int flags = 0;
+	long long cache_size = 0;
+	string filename = disk_file;
+	for (int i = 0; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "-m")
+			mapped = true;
+		else if (arg == "-d")
+			flags |= FileSystem::LOAD_ON_DEMAND;
+		else if (arg == "-c" && i + 1 < argc) {
+			if (!is_int(argv[++i]) || str2long(argv[i]) <= 0)
+				return INVALID_SIZE;
+			cache_size = str2long(argv[i]);
+			flags |= FileSystem::LOAD_ON_DEMAND;
+		}
+		else if (arg == "-o")
+			flags |= FileSystem::LOAD_DIRECT;
+		else if (arg == "-p")
+			flags |= FileSystem::LOAD_NO_URING;
+		else if (i == 0)
+			filename = argv[i];
+		else
+			return INVALID_SYNTAX;
+	}
+	if (mapped && flags != 0)
+		return INVALID_SYNTAX;
+    disk_file = filename;
     
-    int exit_code = virtual_disk.load(disk_file);
+    int exit_code = FileSystem::SUCCESS;
+    if (mapped)
+        exit_code = virtual_disk.map(disk_file);
+    else {
+        virtual_disk.set_cache_limit(cache_size * 1024);
+        exit_code = virtual_disk.load(disk_file, flags);
+    }
     if (exit_code == FileSystem::SUCCESS)
         PWD = "/";
+	else if (exit_code == FileSystem::INCOMPATIBLE) {
+		// The image may be attached already, its layout is not to be trusted
+		virtual_disk = FileSystem();
+		virtual_disk.init(16 * 0x100000, 1024);
+		disk_file = memory_disk_symbol;
+		PWD = "/";
+	}
     
 	return translate_storage_code(exit_code);
 }
 
+int ConsoleUI::display_stats(int argc, char** argv) {
+	if (argc > 1)
+		return INVALID_SYNTAX;
+
+	bool reset = false;
+	if (argc == 1) {
+		if (string(argv[0]) != "-r")
+			return INVALID_SYNTAX;
+		reset = true;
+	}
+
+	int exit_code = virtual_disk.display_stats();
+	if (reset)
+		virtual_disk.reset_stats();
+	return translate_storage_code(exit_code);
+}
+
+int ConsoleUI::check_disk(int argc, char** argv) {
+	if (argc > 1)
+		return INVALID_SYNTAX;
+
+	bool repair = false;
+	if (argc == 1) {
+		if (string(argv[0]) != "-r")
+			return INVALID_SYNTAX;
+		repair = true;
+	}
+
+	int exit_code = virtual_disk.check(repair);
+	return translate_storage_code(exit_code);
+}
+
+int ConsoleUI::defrag_disk(int argc, char** argv) {
+	if (argc > 2)
+		return INVALID_SYNTAX;
+
+	if (argc == 0) {
+		defrag_budget = 0;
+		int exit_code = virtual_disk.defrag();
+		return translate_storage_code(exit_code);
+	}
+	if (argc == 1 && string(argv[0]) == "-m") {
+		int exit_code = virtual_disk.display_fragmentation();
+		return translate_storage_code(exit_code);
+	}
+	if (argc != 2 || string(argv[0]) != "-i")
+		return INVALID_SYNTAX;
+	if (!is_int(argv[1]) || str2long(argv[1]) < 0 || str2long(argv[1]) > INT_MAX)
+		return INVALID_SIZE;
+
+	defrag_budget = str2int(argv[1]);
+	int exit_code = virtual_disk.display_fragmentation();
+	return translate_storage_code(exit_code);
+}
+
+int ConsoleUI::sync_vd(int argc, char** argv) {
+	if (argc > 0)
+		return INVALID_SYNTAX;
+
+	int exit_code = virtual_disk.sync();
+	return translate_storage_code(exit_code);
+}
+
 int ConsoleUI::create_vd(int argc, char** argv) {
 	if (argc != 3)
 		return INVALID_SYNTAX;
 
     disk_file = argv[0];
-    int disk_size = str2int(argv[1]);
+    long long disk_size = str2long(argv[1]);
     int block_size = str2int(argv[2]);
     
     int exit_code = virtual_disk.init(disk_size * 0x400, block_size);
@@ -259,13 +449,16 @@ int ConsoleUI::create_file(int argc, char** argv) {
 	if (name.rfind("/") != string::npos)
 		return INVALID_NAME;
 
-	int exit_code = virtual_disk.file_create(PWD, argv[0], str2int(argv[1]));
+	int exit_code = virtual_disk.file_create(PWD, argv[0], str2long(argv[1]));
 	return translate_storage_code(exit_code);
 }
 
 int ConsoleUI::delete_file(int argc, char** argv) {
-	if (argc != 1)
+	bool recursive = argc == 2 && string(argv[0]) == "-r";
+	if (argc != (recursive ? 2 : 1))
 		return INVALID_SYNTAX;
+	if (recursive)
+		argv++;
 
 	if (!is_unix_path(argv[0]))
 		return INVALID_PATH;
@@ -274,7 +467,11 @@ int ConsoleUI::delete_file(int argc, char** argv) {
 	if (name.rfind("/") != string::npos)
 		return INVALID_NAME;
 
-	int exit_code = virtual_disk.file_remove(PWD, argv[0]);
+	int exit_code = FileSystem::SUCCESS;
+	if (recursive)
+		exit_code = virtual_disk.tree_remove(PWD, argv[0]);
+	else
+		exit_code = virtual_disk.file_remove(PWD, argv[0]);
 	return translate_storage_code(exit_code);
 }
 
@@ -293,8 +490,11 @@ int ConsoleUI::display_file(int argc, char** argv) {
 }
 
 int ConsoleUI::copy_file(int argc, char** argv) {
-	if (argc != 2)
+	bool recursive = argc == 3 && string(argv[0]) == "-r";
+	if (argc != (recursive ? 3 : 2))
 		return INVALID_SYNTAX;
+	if (recursive)
+		argv++;
 
 	int exit_code = SUCCESS;
 	string source_file = argv[0];
@@ -310,7 +510,10 @@ int ConsoleUI::copy_file(int argc, char** argv) {
 	if (exit_code != SUCCESS)
 		return exit_code;
 
-	exit_code = virtual_disk.file_copy(source_file, dest_path, dest_name);
+	if (recursive)
+		exit_code = virtual_disk.tree_copy(source_file, dest_path, dest_name);
+	else
+		exit_code = virtual_disk.file_copy(source_file, dest_path, dest_name);
 	return translate_storage_code(exit_code);
 }
 
@@ -377,6 +580,53 @@ int ConsoleUI::change_working_dir(int argc, char** argv) {
 	return SUCCESS;
 }
 
+int ConsoleUI::display_tree_usage(int argc, char** argv) {
+	if (argc > 1)
+		return INVALID_SYNTAX;
+
+	int exit_code = SUCCESS;
+	string target = "";
+	if (argc == 1)
+		target = argv[0];
+	exit_code = resolve_path(target);
+	if (exit_code != SUCCESS)
+		return exit_code;
+
+	exit_code = virtual_disk.tree_usage(target);
+	return translate_storage_code(exit_code);
+}
+
+int ConsoleUI::find_in_tree(int argc, char** argv) {
+	string target_dir = "";
+	string pattern = "*";
+	int file_type = Inode::UNKNOWN;
+	for (int i = 0; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "-name" && i + 1 < argc) {
+			pattern = argv[++i];
+		} else if (arg == "-type" && i + 1 < argc) {
+			string type = argv[++i];
+			if (type == "f")
+				file_type = Inode::FILE;
+			else if (type == "d")
+				file_type = Inode::DIRECTORY;
+			else
+				return INVALID_SYNTAX;
+		} else if (i == 0 && arg[0] != '-') {
+			target_dir = arg;
+		} else {
+			return INVALID_SYNTAX;
+		}
+	}
+
+	int exit_code = resolve_path(target_dir);
+	if (exit_code != SUCCESS)
+		return exit_code;
+
+	exit_code = virtual_disk.tree_find(target_dir, pattern, file_type);
+	return translate_storage_code(exit_code);
+}
+
 bool ConsoleUI::is_unix_path(string path) {
 	if (path == "")
 		return false;
@@ -413,6 +663,8 @@ int ConsoleUI::translate_storage_code(int exit_code) {
 	case FileSystem::INCOMPATIBLE: return INCOMPATIBLE;
 	case FileSystem::NOT_FILE: return NOT_FILE;
 	case FileSystem::NOT_DIR: return NOT_DIR;
+	case FileSystem::NOT_EMPTY: return NOT_EMPTY;
+	case FileSystem::INCONSISTENT: return INCONSISTENT;
 	default: return FAILED;  break;
 	}
 }
@@ -459,6 +711,13 @@ int ConsoleUI::str2int(string input_string) {
 	return number;
 }
 
+long long ConsoleUI::str2long(string input_string) {
+	long long number = 0;
+	stringstream convert_stream(input_string);
+	convert_stream >> number;
+	return number;
+}
+
 bool ConsoleUI::is_int(const string& input_string) {
 	string::const_iterator it = input_string.begin();
 	while (it != input_string.end() && isdigit(*it)) ++it;
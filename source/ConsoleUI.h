@@ -2,6 +2,7 @@
 #ifndef CONSOLE_UI_H
 #define CONSOLE_UI_H
 
+#include <istream>
 #include <string>
 #include <vector>
 #include "FileSystem.h"
@@ -14,8 +15,9 @@ public:
     static const char* memory_disk_symbol;
 	static const char* DEFAULT_DISK_FILE;
 
-	// Entry point
-	int main_loop();
+	// Entry points
+	int main_loop(std::string path = "");
+	int run_script(std::istream& script, std::string path = "", bool stop_on_error = false);
 	static int about(int argc = 0, char** argv = NULL);
     
 private:
@@ -27,6 +29,8 @@ private:
 	static const int INCOMPATIBLE = 0x4;
 	static const int NOT_FILE = 0x5;
 	static const int NOT_DIR = 0x6;
+	static const int NOT_EMPTY = 0x7;
+	static const int INCONSISTENT = 0x8;
 
 	static const int INVALID_COMMAND = 0x100;
 	static const int INVALID_SYNTAX = 0x200;
@@ -38,13 +42,17 @@ private:
 	FileSystem virtual_disk;
     std::string disk_file;
 	std::string PWD;
+	bool running = true;
+	int defrag_budget = 0;   // Blocks moved after each command, 0 if not defragmenting
 
 	// General functions
 	std::vector<std::string> str2argv(std::string input_string);
 	int str2int(std::string input_string);
+	long long str2long(std::string input_string);
 	bool is_int(const std::string& input_string);
 
 	// Functions
+	int open_disk(std::string path);
 	int exec_cmd(std::string user_input);
     
 	bool is_unix_path(std::string path);
@@ -76,9 +84,13 @@ private:
 	int exit_console(int argc, char** argv);
     
 	int display_usage(int argc, char** argv);
+	int display_stats(int argc, char** argv);
+	int check_disk(int argc, char** argv);
+	int defrag_disk(int argc, char** argv);
 	int save_vd(int argc, char** argv);
 	int load_vd(int argc, char** argv);
 	int create_vd(int argc, char** argv);
+	int sync_vd(int argc, char** argv);
 
 	int create_file(int argc, char** argv);
 	int delete_file(int argc, char** argv);
@@ -89,6 +101,8 @@ private:
 	int delete_dir(int argc, char** argv);
 	int list_dir(int argc, char** argv);
 	int change_working_dir(int argc, char** argv);
+	int display_tree_usage(int argc, char** argv);
+	int find_in_tree(int argc, char** argv);
     
 };
 
@@ -1,17 +1,27 @@
 #include <string>
-#include <fstream>
 #include <iostream>
 #include <iomanip>
 #include <vector>
 #include <cstring>
+#include <cstddef>
+#include <climits>
+#include <algorithm>
 #include "FileSystem.h"
 using namespace std;
 
 
-int FileSystem::init(int disk_size, int block_size) {
+int FileSystem::init(long long disk_size, int block_size, int features) {
+	WriteLock disk_lock = write_lock(locks->disk);
+	if (block_size <= 0 || disk_size / block_size > blocks_max)
+		return FAILED;
     // ! Warning: calculations needs to be verified
-	sb.blocks_count = disk_size/block_size;
+	StatsTimer timer(*stats, Stats::INIT);
+	timer.add(disk_size / block_size, disk_size);
+	Superblock previous = sb;
+	sb.blocks_count = (int) (disk_size / block_size);
 	sb.inodes_count = sb.blocks_count / 2; // ! Estimated value. Closer to blocks_count is better
+	if (sb.inodes_count > inodes_max)
+		sb.inodes_count = inodes_max;
 	sb.block_size = block_size;
 	sb.rev_level = REV_LEVEL;
 	sb.first_inode = inode_first;
@@ -19,28 +29,101 @@ int FileSystem::init(int disk_size, int block_size) {
 	sb.block_bitmap = (sizeof(Superblock)-1) / sb.block_size + 1;
 	sb.inode_bitmap = sb.block_bitmap + (sb.blocks_count-1) / sb.block_size + 1;
 	sb.inode_table = sb.inode_bitmap + (sb.inodes_count-1) / sb.block_size + 1;
+	groups_single();
+
+	if (features & FEATURE_BLOCK_GROUPS) {
+		// A group is what one block of bitmap covers. Inode slices are whole blocks
+		// of the table and whole words of the bitmap.
+		int inodes_align = max(sb.block_size / (int) sizeof(Inode), 64);
+		sb.blocks_per_group = min(sb.block_size * 8, sb.blocks_count);
+		sb.groups_count = (sb.blocks_count - 1) / sb.blocks_per_group + 1;
+		sb.inodes_per_group = (sb.inodes_count / sb.groups_count + inodes_align - 1) / inodes_align * inodes_align;
+		sb.inodes_count = sb.inodes_per_group * sb.groups_count;
+
+		sb.group_table = (sizeof(Superblock)-1) / sb.block_size + 1;
+		sb.block_bitmap = sb.group_table + (sb.groups_count * (int) sizeof(GroupDesc) - 1) / sb.block_size + 1;
+		sb.inode_bitmap = sb.block_bitmap + sb.groups_count;
+		sb.inode_table = sb.inode_bitmap + (sb.inodes_count - 1) / (sb.block_size * 8) + 1;
+	}
 
     sb.disk_size = disk_size;
+	sb.free_blocks_count = sb.blocks_count;
+	sb.free_inodes_count = sb.inodes_count;
+	sb.features = features;
+
+	// Journal follows the inode table
+	sb.journal_block = 0;
+	sb.journal_blocks = 0;
+	sb.journal_sequence = 0;
+	if (features & FEATURE_JOURNAL) {
+		sb.journal_block = sb.inode_table + (sb.inodes_count * sizeof(Inode) - 1) / sb.block_size + 1;
+		sb.journal_blocks = min(max(sb.blocks_count / 64, 8), 4096);
+	}
+	journal_head = 0;
+	journal_next = 0;
+	journal_ops = 0;
+
+	// Reference counts of shared blocks follow the journal
+	sb.refcount_table = 0;
+	sb.refcount_blocks = 0;
+	if (features & FEATURE_REFLINK) {
+		sb.refcount_table = data_block_first();
+		sb.refcount_blocks = (int) ((sb.blocks_count * sizeof(uint16_t) - 1) / sb.block_size + 1);
+	}
+
+	// Disks too small for the journal go without it, the root directory needs a block
+	if (sb.journal_blocks > 0 && data_block_first() >= sb.blocks_count) {
+		sb.features &= ~FEATURE_JOURNAL;
+		if (sb.refcount_blocks > 0)
+			sb.refcount_table -= sb.journal_blocks;
+		sb.journal_block = 0;
+		sb.journal_blocks = 0;
+	}
+	if (data_block_first() >= sb.blocks_count) {
+		sb = previous;
+		return FAILED;
+	}
 
-	int first_data_block = sb.inode_table + (sb.inodes_count * sizeof(Inode) - 1) / sb.block_size + 1;
+	int first_data_block = data_block_first();
+	block_hints.assign(sb.groups_count, 0);
+	inode_hints.assign(sb.groups_count, 0);
+	dentry_clear();
+	defrag_pass = DefragPass();
+	locks_reset();
 
 	// Allocate virtual disk
-	disk = make_unique<char[]>(disk_size);
+	ZeroBuffer buffer = zero_buffer(disk_size);
+	if (!buffer)
+		return FAILED;
+	disk_map.reset();
+	disk_buffer.reset();
+	device = make_unique<MemoryDevice>(move(buffer), disk_size);
+	disk = device->memory();
+	frames_reset(false);
+	image_path = "";
+	dirty_clear();
 	object_write(0, sb);
 
-	// Mark bitmaps
+	// Groups start empty, marking the bitmaps takes the used parts off
+	for (int i = 0; sb.group_table != 0 && i < sb.groups_count; i++) {
+		GroupDesc desc;
+		desc.free_blocks_count = min(sb.blocks_per_group, sb.blocks_count - i * sb.blocks_per_group);
+		desc.free_inodes_count = sb.inodes_per_group;
+		desc.used_dirs_count = 0;
+		desc.flags = 0;
+		object_write(block_offset(sb.group_table) + i * sizeof(GroupDesc), desc);
+	}
+
+	// Mark bitmaps, the rest of the disk is zeros already
 	for (int i = 0; i < first_data_block; i++)
-		bit_write(sb.block_bitmap * sb.block_size, i, USED);
-	for (int i = first_data_block; i < sb.blocks_count; i++)
-		bit_write(sb.block_bitmap * sb.block_size, i, UNUSED);
+		bit_write(block_offset(sb.block_bitmap), i, USED);
 	for (int i = 0; i < sb.first_inode; i++)
-		bit_write(sb.inode_bitmap * sb.block_size, i, USED);
-	for (int i = sb.first_inode; i < sb.inodes_count; i++)
-		bit_write(sb.inode_bitmap * sb.block_size, i, UNUSED);
+		bit_write(block_offset(sb.inode_bitmap), i, USED);
 
     // Initialize root directory
-    bit_write(sb.inode_bitmap, inode_root, USED);
-	object_write(sb.inode_table * sb.block_size + inode_root * sizeof(Inode), Inode(Inode::DIRECTORY));
+    bit_write(block_offset(sb.inode_bitmap), inode_root, USED);
+	group_add(0, offsetof(GroupDesc, used_dirs_count), 1);
+	object_write(inode_offset(inode_root), inode_init(Inode::DIRECTORY));
     dir_entry_add(inode_root, DirEntry(2, "."));
     dir_entry_add(inode_root, DirEntry(2, ".."));
 
@@ -48,416 +131,3779 @@ int FileSystem::init(int disk_size, int block_size) {
 }
 
 
-int FileSystem::display_properties() {
-	int first_data_block = sb.inode_table + (sb.inodes_count * sizeof(Inode) - 1) / sb.block_size + 1;
-
-	int used_inodes_count = 0;
-	for (int i = 0; i < sb.inodes_count; i++)
-		used_inodes_count += bit_read(sb.inode_bitmap * sb.block_size, i);
-
-	int used_blocks_count = 0;
-	for (int i = 0; i < sb.blocks_count; i++)
-		used_blocks_count += bit_read(sb.block_bitmap * sb.block_size, i);
+int FileSystem::display_properties(bool verify) {
+	WriteLock disk_lock = write_lock(locks->disk);
+	int first_data_block = data_block_first();
+
+	if (verify) {
+		int free_inodes_count = sb.inodes_count - bit_count(block_offset(sb.inode_bitmap), 0, sb.inodes_count);
+		int free_blocks_count = sb.blocks_count - bit_count(block_offset(sb.block_bitmap), 0, sb.blocks_count);
+		int drifted_groups = group_recount();
+		if (drifted_groups > 0)
+			cout << "Group counts drifted in " << drifted_groups << " of " << sb.groups_count << " groups, corrected\n";
+		if (free_inodes_count != sb.free_inodes_count)
+			cout << "Free inodes count drifted: " << sb.free_inodes_count << " (counted " << free_inodes_count << "), corrected\n";
+		if (free_blocks_count != sb.free_blocks_count)
+			cout << "Free blocks count drifted: " << sb.free_blocks_count << " (counted " << free_blocks_count << "), corrected\n";
+		if (free_inodes_count == sb.free_inodes_count && free_blocks_count == sb.free_blocks_count && drifted_groups == 0)
+			cout << "Free counts verified\n";
+		cout << "\n";
+		sb.free_inodes_count = free_inodes_count;
+		sb.free_blocks_count = free_blocks_count;
+	}
 
-	cout << "Used inodes: " << used_inodes_count << "/" << sb.inodes_count << " (" << (used_inodes_count * 100 / sb.inodes_count) << "%)" << endl;
-	cout << "Used blocks: " << used_blocks_count << "/" << sb.blocks_count << " (" << (used_blocks_count * 100 / sb.blocks_count) << "%)" << endl;
-    cout << endl;
-	cout << "Disk size: " << sb.disk_size << endl;
-	cout << "Block size: " << sb.block_size << endl;
-    cout << endl;
-	cout << "File system revision: " << sb.rev_level << endl;
-    cout << endl;
-	cout << "Block Bitmap: " << sb.block_bitmap << endl;
-	cout << "Inode Bitmap: " << sb.inode_bitmap << endl;
-	cout << "Inode Table: " << sb.inode_table << endl;
-	cout << endl;
-	cout << "First data block: " << first_data_block << endl;
+	int used_inodes_count = sb.inodes_count - sb.free_inodes_count;
+	int used_blocks_count = sb.blocks_count - sb.free_blocks_count;
+
+	cout << "Used inodes: " << used_inodes_count << "/" << sb.inodes_count << " (" << (used_inodes_count * 100LL / sb.inodes_count) << "%)\n";
+	cout << "Used blocks: " << used_blocks_count << "/" << sb.blocks_count << " (" << (used_blocks_count * 100LL / sb.blocks_count) << "%)\n";
+    cout << "\n";
+	cout << "Disk size: " << sb.disk_size << "\n";
+	cout << "Block size: " << sb.block_size << "\n";
+	if (device && image_path != "")
+		cout << "Image device: " << device->name() << (on_demand ? ", on demand" : "") << "\n";
+    cout << "\n";
+	cout << "File system revision: " << sb.rev_level << "\n";
+    cout << "\n";
+	cout << "Block Bitmap: " << sb.block_bitmap << "\n";
+	cout << "Inode Bitmap: " << sb.inode_bitmap << "\n";
+	cout << "Inode Table: " << sb.inode_table << "\n";
+	if (sb.group_table != 0)
+		cout << "Block groups: " << sb.group_table << " (" << sb.groups_count << " groups, " << sb.blocks_per_group
+			<< " blocks and " << sb.inodes_per_group << " inodes each)\n";
+	if (sb.journal_blocks > 0)
+		cout << "Journal: " << sb.journal_block << " (" << sb.journal_blocks << " blocks, " << journal_head << " used)\n";
+	if (sb.refcount_blocks > 0)
+		cout << "Reference counts: " << sb.refcount_table << "\n";
+	cout << "\n";
+	cout << "First data block: " << first_data_block << "\n";
 	return SUCCESS;
 }
 
 
-bool FileSystem::bit_read(int byte_offset, int bit_offset) {
+bool FileSystem::bit_read(long long byte_offset, int bit_offset) {
 	char value = 0;
 	object_read(byte_offset + bit_offset / 8, &value);
 	int index = 8 - bit_offset % 8 - 1;
 	return bool((value >> index) & 1);
 }
 
-bool FileSystem::bit_write(int byte_offset, int bit_offset, bool is_used) {
+bool FileSystem::bit_write(long long byte_offset, int bit_offset, bool is_used) {
 	char value = 0;
 	object_read(byte_offset + bit_offset / 8, &value);
 	int index = 8 - bit_offset % 8 - 1;
+	bool was_used = bool((value >> index) & 1);
     value &= ~(1 << index);
     value |= is_used << index;
 	object_write(byte_offset + bit_offset / 8, value);
+
+	if (was_used != is_used) {
+		// Groups are locked separately, the totals are shared by all of them
+		int delta = is_used ? -1 : 1;
+		if (byte_offset == block_offset(sb.block_bitmap)) {
+			atomic_add32(&sb.free_blocks_count, delta);
+			group_add(bit_offset / sb.blocks_per_group, offsetof(GroupDesc, free_blocks_count), delta);
+		} else if (byte_offset == block_offset(sb.inode_bitmap)) {
+			atomic_add32(&sb.free_inodes_count, delta);
+			group_add(bit_offset / sb.inodes_per_group, offsetof(GroupDesc, free_inodes_count), delta);
+		}
+	}
 	return true;
 }
 
-int FileSystem::bit_unused(int byte_offset, int size) {
-	for (int i = 0; i < size; i++) {
-		if (bit_read(byte_offset, i) == UNUSED)
-			return i;
-	};
-	return -1;
-}
+int FileSystem::bit_unused(long long byte_offset, int first, int last, int start) {
+	StatsTimer timer(*stats, Stats::BIT_UNUSED);
+	// Next-fit in [first, last): continue from start, then wrap around
+	if (start <= first || start >= last)
+		start = first;
 
+	int bit_offset = bit_scan(byte_offset, start, last);
+	if (bit_offset == -1 && start > first)
+		bit_offset = bit_scan(byte_offset, first, start);
+	return bit_offset;
+}
 
-int FileSystem::save(string filepath) {
-	fstream file(filepath, ios::out | ios::binary);
-    if (!file)
-        return FAILED;
-	file.write(disk.get(), sb.disk_size);
-	file.close();
-    
-	return SUCCESS;
+int FileSystem::bit_scan(long long byte_offset, int first, int last, bool is_used) {
+	// Scan 64 bits at a time. Bits are stored MSB first, so after swapping
+	// the bytes of the word the first bit in memory is the most significant.
+	for (int base = first - first % 64; base < last; base += 64) {
+		uint64_t word = 0;
+		object_read(byte_offset + base / 8, &word);
+		uint64_t found_bits = is_used ? bswap64(word) : ~bswap64(word);
+		if (base < first)
+			found_bits &= ~0ULL >> (first - base);
+		if (last - base < 64)
+			found_bits &= ~(~0ULL >> (last - base));
+		if (found_bits != 0)
+			return base + clz64(found_bits);
+	}
+	return -1;
 }
 
-int FileSystem::load(string filepath) {
-	fstream file(filepath, ios::in | ios::binary);
-    if (!file)
-        return NOT_EXIST;
-    file.seekg (0, file.end);
-    sb.disk_size = (int) file.tellg();
-    
-    file.seekg (0, file.beg);
-    file.read((char*) &sb, sizeof(Superblock));
 
-    file.seekg (0, file.beg);
-	disk = make_unique<char[]>(sb.disk_size);
-	file.read(disk.get(), sb.disk_size);
-	
-	object_read(0, &sb);
+int FileSystem::bit_count(long long byte_offset, int first, int last) {
+	int count = 0;
+	for (int base = first - first % 64; base < last; base += 64) {
+		uint64_t word = 0;
+		object_read(byte_offset + base / 8, &word);
+		uint64_t used_bits = bswap64(word);
+		if (base < first)
+			used_bits &= ~0ULL >> (first - base);
+		if (last - base < 64)
+			used_bits &= ~(~0ULL >> (last - base));
+		count += popcount64(used_bits);
+	}
+	return count;
+}
 
-	if (sb.rev_level != REV_LEVEL)
-		return INCOMPATIBLE;
-	return SUCCESS;
+// First run of count unused bits in [first, last), -1 if there is none
+int FileSystem::bit_unused_run(long long byte_offset, int first, int last, int count) {
+	while (first < last) {
+		int start = bit_scan(byte_offset, first, last, UNUSED);
+		if (start == -1 || last - start < count)
+			return -1;
+		int used = bit_scan(byte_offset, start, start + count, USED);
+		if (used == -1)
+			return start;
+		first = used + 1;
+	}
+	return -1;
 }
 
 
-int FileSystem::dir_entry_find(int inode_num, const char* name, int indirect) {
-	Inode dir_inode;
-	object_read(sb.inode_table * sb.block_size + inode_num * sizeof(Inode), &dir_inode);
-	int max_entries = sb.block_size / sizeof(DirEntry);
+int FileSystem::save(string filepath, bool compressed) {
+	WriteLock disk_lock = write_lock(locks->disk);
+	StatsTimer timer(*stats, Stats::SAVE);
+	if (compressed) {
+		timer.add(sb.blocks_count, sb.disk_size);
+		return image_write_chunked(filepath);
+	}
 
-	if (indirect == 0) {
-		for (int i = 0; i < Inode::direct_blocks_count; i++) {
-			int block_num = dir_inode.direct_blocks[i];
-			if (block_num == 0 && strcmp(name, DirEntry().name) == 0) {
-				block_num = bit_unused(sb.block_bitmap * sb.block_size, sb.blocks_count);
-				bit_write(sb.block_bitmap * sb.block_size, block_num, USED);
+	// Saving back to the image file writes only what changed
+	if (filepath == image_path)
+		return checkpoint();
+	int used_blocks_count = sb.blocks_count - sb.free_blocks_count;
+	timer.add(used_blocks_count, (uint64_t) used_blocks_count * sb.block_size);
+	return image_write(filepath);
+}
+
+int FileSystem::image_write(string filepath) {
+	// Transactions in the journal are already in the saved image
+	sb.journal_sequence = journal_next;
+	journal_head = 0;
+	object_write(0, sb);
 
-				dir_inode.direct_blocks[i] = block_num;
-				object_write(sb.inode_table * sb.block_size + inode_num * sizeof(Inode), dir_inode);
+	// Only allocated blocks are written, the free ones are left as holes of a sparse file.
+	// Allocated blocks of zeros are holes as well, like the unused parts of the tables.
+	RawFile file;
+	if (!file.open(filepath, true) || !file.resize(0) || !file.resize(sb.disk_size))
+		return FAILED;
+	file.close();
+	unique_ptr<BlockDevice> image = BlockDevice::open(filepath, device_flags);
+	if (!image)
+		return FAILED;
 
-				return block_num * sb.block_size;
-			}
-			for (int j = 0; j < max_entries; j++) {
-				DirEntry current;
-				object_read(block_num * sb.block_size + j * sizeof(DirEntry), &current);
-				if (strcmp(name, current.name) == 0)
-					return (block_num * sb.block_size + j * sizeof(DirEntry));
+	// Runs of blocks go to the device in one batch
+	vector<BlockDevice::Request> requests;
+	long long bitmap_offset = block_offset(sb.block_bitmap);
+	int first = bit_scan(bitmap_offset, 0, sb.blocks_count, USED);
+	while (first != -1) {
+		int last = bit_scan(bitmap_offset, first, sb.blocks_count, UNUSED);
+		if (last == -1)
+			last = sb.blocks_count;
+		while (first < last) {
+			if (is_zeros(disk_at(block_offset(first), sb.block_size), sb.block_size)) {
+				first++;
+				continue;
 			}
+			int end = first + 1;
+			while (end < last && !is_zeros(disk_at(block_offset(end), sb.block_size), sb.block_size))
+				end++;
+			size_t length = (size_t) (end - first) * sb.block_size;
+			requests.push_back(BlockDevice::Request{block_offset(first), disk + block_offset(first), length});
+			first = end;
 		}
+		first = bit_scan(bitmap_offset, last, sb.blocks_count, USED);
 	}
-	// ! Indirect block support
-	return 0;
+	if (!device_write(*image, requests))
+		return FAILED;
+
+	// The disk is attached to the new file, a disk in memory becomes its buffer
+	if (!disk_map) {
+		MemoryDevice* memory_device = dynamic_cast<MemoryDevice*>(device.get());
+		if (memory_device != NULL)
+			disk_buffer = memory_device->release();
+		device = move(image);
+		image_path = filepath;
+	}
+	dirty_clear();
+    
+	return SUCCESS;
 }
 
-int FileSystem::dir_entry_add(int inode_num, DirEntry entry) {
-	Inode dir_inode;
-	object_read(sb.inode_table * sb.block_size + inode_num * sizeof(Inode), &dir_inode);
+int FileSystem::image_write_chunked(string filepath) {
+	// Compressed images are not written in place, the attached image is brought
+	// up to date first so the copy has an empty journal as well
+	if (disk_map && filepath == image_path)
+		return FAILED;
+	if (image_path != "") {
+		if (checkpoint() != SUCCESS)
+			return FAILED;
+	} else {
+		sb.journal_sequence = journal_next;
+		journal_head = 0;
+		object_write(0, sb);
+	}
 
-	int entry_offset = dir_entry_find(inode_num, "");
-	if (entry_offset == 0)
+	if (!ChunkedImage::write(filepath, disk_at(0, sb.disk_size), sb.disk_size, thread_pool()))
 		return FAILED;
-	object_write(entry_offset, entry);
+	// The attached file holds compressed chunks now, so the disk is detached from it. Writing
+	// read every frame of a disk on demand, the buffer becomes a disk in memory.
+	if (filepath == image_path) {
+		device = make_unique<MemoryDevice>(move(disk_buffer), sb.disk_size);
+		disk = device->memory();
+		frames_reset(false);
+		image_path = "";
+	}
 	return SUCCESS;
 }
 
-int FileSystem::inode_of(string path, int parent_inode) {
-	string filename = path;
-	string next = "";
-	if (path.rfind("/") != string::npos) {
-		filename = path.substr(0, path.find("/"));
-		next = path.substr(path.find("/") + 1);
+ThreadPool& FileSystem::thread_pool() {
+	if (!pool)
+		pool = make_unique<ThreadPool>();
+	return *pool;
+}
+
+int FileSystem::sync() {
+	WriteLock disk_lock = write_lock(locks->disk);
+	StatsTimer timer(*stats, Stats::SYNC);
+	// Nothing of a mapped image is logged, its changed blocks are flushed instead
+	if (disk_map)
+		return checkpoint();
+	if (!journal_active())
+		return FAILED;
+	int result = SUCCESS;
+	if (journal_commit() != SUCCESS)
+		result = checkpoint();
+	// Keep enough room for the next transaction
+	else if (sb.journal_blocks - journal_head < journal_threshold() + 2)
+		result = checkpoint();
+
+	// Committed blocks can be evicted now
+	frames_trim();
+	return result;
+}
+
+int FileSystem::load(string filepath, int flags) {
+	WriteLock disk_lock = write_lock(locks->disk);
+	StatsTimer timer(*stats, Stats::LOAD);
+	RawFile file;
+	if (!file.open(filepath))
+		return NOT_EXIST;
+	long long file_size = file.size();
+	if (file_size < (long long) sizeof(Superblock))
+		return INCOMPATIBLE;
+
+	// Compressed images are decompressed on all workers and not written back in place
+	char magic[sizeof(ChunkedHeader)];
+	if (file.read_at(0, magic, sizeof(magic)) && ChunkedImage::detect(magic, sizeof(magic))) {
+		file.close();
+		ChunkedImage image;
+		if (!image.open(filepath) || image.disk_size() < (long long) sizeof(Superblock))
+			return INCOMPATIBLE;
+		ZeroBuffer buffer = zero_buffer((size_t) image.disk_size());
+		if (!buffer)
+			return FAILED;
+		if (!image.read_all(buffer.get(), thread_pool()))
+			return INCOMPATIBLE;
+		disk_map.reset();
+		disk_buffer.reset();
+		device = make_unique<MemoryDevice>(move(buffer), image.disk_size());
+		disk = device->memory();
+		frames_reset(false);
+		sb.disk_size = image.disk_size();
+		image_path = "";
+		timer.add(sb.disk_size / max(sb.block_size, 1), sb.disk_size);
+		return mount();
 	}
 
-	if (filename == "") {
-		if (next == "")
-			return inode_root;
-		else
-			return inode_of(next, inode_root);
+	int open_flags = 0;
+	if (flags & LOAD_DIRECT)
+		open_flags |= BlockDevice::DIRECT;
+	if (flags & LOAD_NO_URING)
+		open_flags |= BlockDevice::NO_URING;
+	unique_ptr<BlockDevice> image = BlockDevice::open(filepath, open_flags);
+	if (!image)
+		return NOT_EXIST;
+	ZeroBuffer buffer = zero_buffer((size_t) file_size, (flags & LOAD_ON_DEMAND) != 0);
+	if (!buffer)
+		return FAILED;
+
+	// Holes of a sparse image are already zeros in the buffer, only the data is read,
+	// all of it in one batch. On demand nothing is read before it is used.
+	uint64_t bytes_read = 0;
+	vector<BlockDevice::Request> requests;
+	long long offset = (flags & LOAD_ON_DEMAND) ? -1 : file.data_next(0);
+	while (offset != -1 && offset < file_size) {
+		long long end = min(file.hole_next(offset), file_size);
+		if (end <= offset)
+			return FAILED;
+		requests.push_back(BlockDevice::Request{offset, buffer.get() + offset, (size_t) (end - offset)});
+		bytes_read += end - offset;
+		offset = file.data_next(end);
 	}
+	file.close();
+	if (!device_read(*image, requests))
+		return FAILED;
 
-	if (bit_read(sb.inode_bitmap * sb.block_size, parent_inode) == UNUSED)
-		return 0;
+	disk_map.reset();
+	device = move(image);
+	device_flags = open_flags;
+	disk_buffer = move(buffer);
+	disk = disk_buffer.get();
+	sb.disk_size = file_size;
+	frames_reset((flags & LOAD_ON_DEMAND) != 0);
+	image_path = filepath;
+	timer.add(bytes_read / max(sb.block_size, 1), bytes_read);
+
+	return mount();
+}
 
-	int entry_offset = dir_entry_find(parent_inode, filename.c_str());
-	if (entry_offset == 0)
-		return 0;
+int FileSystem::map(string filepath) {
+	WriteLock disk_lock = write_lock(locks->disk);
+	StatsTimer timer(*stats, Stats::MAP);
+	unique_ptr<MappedFile> mapping = make_unique<MappedFile>();
+	if (!mapping->open(filepath))
+		return NOT_EXIST;
+	if (mapping->size() < sizeof(Superblock) || ChunkedImage::detect(mapping->data(), mapping->size()))
+		return INCOMPATIBLE;
 
-	DirEntry entry;
-	object_read(entry_offset, &entry);
-	if (next == "")
-		return entry.inode;
-	return inode_of(next, entry.inode);
+	device.reset();
+	disk_buffer.reset();
+	disk_map = move(mapping);
+	disk = disk_map->data();
+	frames_reset(false);
+	sb.disk_size = (long long) disk_map->size();
+	image_path = filepath;
+	return mount();
 }
 
-int FileSystem::blocks_free_all(int inode_num, int indirect) {
-	Inode inode;
-	object_read(sb.inode_table * sb.block_size + inode_num * sizeof(Inode), &inode);
+void FileSystem::frames_reset(bool enabled) {
+	// Frames are whole pages, so they can be given back to the system on their own
+	on_demand = enabled;
+	frame_size = 0;
+	frames_resident.clear();
+	frames_referenced.clear();
+	frames_hot.clear();
+	frames_count = 0;
+	frames_hand = 0;
+	readaheads.assign(readahead_slots, Readahead());
+	if (!enabled)
+		return;
+	frame_size = 4096;
+	size_t words = (size_t) ((sb.disk_size - 1) / frame_size / 64 + 1);
+	frames_resident.assign(words, 0);
+	frames_referenced.assign(words, 0);
+	frames_hot.assign(words, 0);
+}
 
-	if (indirect == 0) {
-		for (int i = 0; i < Inode::direct_blocks_count; i++) {
-			int block_num = inode.direct_blocks[i];
-			if (block_num != 0)
-				bit_write(sb.block_bitmap * sb.block_size, block_num, UNUSED);
+void FileSystem::frames_fetch(long long byte_offset, long long length) {
+	long long first = byte_offset / frame_size;
+	long long last = (byte_offset + max(length, 1LL) - 1) / frame_size;
+	bool resident = true;
+	bool inode_table = byte_offset >= block_offset(sb.inode_table) && byte_offset < inode_offset(sb.inodes_count);
+	for (long long frame = first; frame <= last; frame++) {
+		// Marks of use are only written when missing, a sweep of the clock clears them
+		uint64_t bit = 1ULL << (frame % 64);
+		resident &= (atomic_acquire64(&frames_resident[frame / 64]) & bit) != 0;
+		if (!(atomic_load64(&frames_referenced[frame / 64]) & bit))
+			atomic_or64(&frames_referenced[frame / 64], bit);
+		if (inode_table && !(atomic_load64(&frames_hot[frame / 64]) & bit))
+			atomic_or64(&frames_hot[frame / 64], bit);
+	}
+	if (resident) {
+		if (concurrent)
+			atomic_add64(&cache_counters.hits, 1);
+		else
+			cache_counters.hits++;
+		return;
+	}
+
+	// Another thread may have read them first
+	uint64_t count = frames_read(vector<pair<long long, long long>>(1, make_pair(byte_offset, max(length, 1LL))));
+	atomic_add64(count > 0 ? &cache_counters.misses : &cache_counters.hits, 1);
+}
+
+uint64_t FileSystem::frames_read(const vector<pair<long long, long long>>& ranges) {
+	// Missing frames of all ranges are read in one batch, in order and each once
+	vector<long long> frames;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		long long last = (ranges[i].first + ranges[i].second - 1) / frame_size;
+		for (long long frame = ranges[i].first / frame_size; frame <= last; frame++) {
+			if (!(atomic_acquire64(&frames_resident[frame / 64]) & (1ULL << (frame % 64))))
+				frames.push_back(frame);
 		}
 	}
-	return SUCCESS;
+	if (frames.empty())
+		return 0;
+	sort(frames.begin(), frames.end());
+	frames.erase(unique(frames.begin(), frames.end()), frames.end());
+
+	// A frame is marked once it is read
+	MutexLock fetch_lock = mutex_lock(locks->fetch);
+	vector<BlockDevice::Request> requests;
+	size_t missing = 0;
+	for (size_t i = 0; i < frames.size(); i++) {
+		long long frame = frames[i];
+		if ((frames_resident[frame / 64] >> (frame % 64)) & 1)
+			continue;
+		frames[missing++] = frame;
+		long long frame_offset = frame * frame_size;
+		size_t frame_length = (size_t) min(frame_size, sb.disk_size - frame_offset);
+		if (!requests.empty() && requests.back().offset + (long long) requests.back().length == frame_offset)
+			requests.back().length += frame_length;
+		else
+			requests.push_back(BlockDevice::Request{frame_offset, disk + frame_offset, frame_length});
+	}
+	if (!device_read(*device, requests)) {
+		cerr << "Reading the image failed at " << requests[0].offset << "\n";
+		return 0;
+	}
+	for (size_t i = 0; i < missing; i++)
+		atomic_or_release64(&frames_resident[frames[i] / 64], 1ULL << (frames[i] % 64));
+	atomic_add64(&frames_count, missing);
+	return missing;
 }
 
+void FileSystem::file_readahead(const Inode& inode, Readahead& state, long long offset, long long length) {
+	// A read that does not go on from the last one fetches only itself. A sequential one
+	// fetches a larger window once less than half of the last is left ahead of it.
+	long long end = min(offset + length, inode.size());
+	long long fetch_end = end;
+	if (offset != state.next) {
+		state.window = 0;
+		state.ahead = offset;
+	} else if (state.ahead - end < state.window / 2) {
+		// A window larger than a part of the cache would evict itself before it is read
+		long long window_max = cache_limit > 0 ? min((long long) readahead_max, max(cache_limit / 4, frame_size)) : readahead_max;
+		state.window = min(state.window == 0 ? (long long) readahead_min : state.window * 2, window_max);
+		fetch_end = min(end + state.window, inode.size());
+	}
+	state.next = end;
+	long long fetch_first = max(offset, state.ahead);
+	if (fetch_first >= fetch_end)
+		return;
+	state.ahead = fetch_end;
+
+	// Physical runs of the blocks, holes have nothing to read
+	vector<pair<long long, long long>> ranges;
+	int last = (int) ((fetch_end - 1) / sb.block_size);
+	for (int logical = (int) (fetch_first / sb.block_size); logical <= last; ) {
+		int count = 0;
+		int block_num = block_run(inode, logical, &count, last - logical + 1);
+		if (block_num == 0) {
+			logical++;
+			continue;
+		}
+		count = min(count, last - logical + 1);
+		ranges.push_back(make_pair(block_offset(block_num), (long long) count * sb.block_size));
+		logical += count;
+	}
+	frames_read(ranges);
+}
 
-string FileSystem::path_abspath(string fullpath) {
-	int inode_num = inode_of(fullpath);
-	if (inode_num == 0)
-		return "";
+// Frames of a buffer that cannot give pages back are kept, evicting them would free nothing
+bool FileSystem::frames_over_limit() {
+	return on_demand && cache_limit > 0 && (long long) atomic_load64(&frames_count) * frame_size > cache_limit
+		&& zero_releasable(disk_buffer);
+}
 
-	vector<int> inode_nums = {inode_root};
-	vector<string> dir_names = {""};
-	string filename;
-	string next = fullpath;
-	do {
-		if (next.rfind("/") == string::npos) {
-			filename = next;
-			next = "";
-		} else {
-			filename = next.substr(0, next.find("/"));
-			next = next.substr(next.find("/") + 1);
-		}
-		if (filename == "")
+void FileSystem::frames_trim() {
+	// The caller has the disk to itself, so no operation holds a view of the frames
+	if (!frames_over_limit() || sb.block_size <= 0)
+		return;
+	long long frames_total = (sb.disk_size - 1) / frame_size + 1;
+	long long pinned = min((block_offset(sb.inode_table) - 1) / frame_size + 1, frames_total);
+	long long limit = max(cache_limit / frame_size, 1LL);
+	long long excess = (long long) frames_count - (limit - limit / 8);
+
+	// Three sweeps clear the referenced and hot bits of every frame. Frames with blocks
+	// of the next journal commit stay until it is written.
+	vector<long long> victims;
+	for (long long steps = 3 * (frames_total - pinned); steps > 0 && (long long) victims.size() < excess; steps--) {
+		if (frames_hand < pinned || frames_hand >= frames_total)
+			frames_hand = pinned;
+		long long frame = frames_hand++;
+		size_t word = (size_t) (frame / 64);
+		uint64_t bit = 1ULL << (frame % 64);
+		if (!(frames_resident[word] & bit))
+			continue;
+		if (frames_referenced[word] & bit) {
+			frames_referenced[word] &= ~bit;
 			continue;
-
-		int current_inode_num = inode_of(filename, inode_nums.back());
-		bool match = false;
-		for (size_t i = 0; i < inode_nums.size(); i++) {
-			if (inode_nums[i] == current_inode_num) {
-				inode_nums.erase(inode_nums.begin() + i + 1, inode_nums.end());
-				dir_names.erase(dir_names.begin() + i + 1, dir_names.end());
-				match = true;
-				break;
-			}
 		}
-		if (!match) {
-			inode_nums.push_back(current_inode_num);
-			dir_names.push_back(filename);
+		if (frames_hot[word] & bit) {
+			frames_hot[word] &= ~bit;
+			continue;
 		}
-	} while (next != "");
+		long long frame_offset = frame * frame_size;
+		int first_block = (int) (frame_offset / sb.block_size);
+		int last_block = (int) ((min(frame_offset + frame_size, sb.disk_size) - 1) / sb.block_size);
+		bool journaled = false;
+		for (int block_num = first_block; block_num <= last_block && !journaled; block_num++)
+			journaled = (journal_dirty[block_num / 64] >> (block_num % 64)) & 1;
+		if (!journaled)
+			victims.push_back(frame);
+	}
+	if (victims.empty())
+		return;
+	sort(victims.begin(), victims.end());
+
+	// Dirty blocks of the victims are written in place, as data_flush() does
+	vector<uint64_t> pending(dirty_blocks.size(), 0);
+	for (size_t i = 0; i < victims.size(); i++) {
+		long long frame_offset = victims[i] * frame_size;
+		int first_block = (int) (frame_offset / sb.block_size);
+		int last_block = (int) ((min(frame_offset + frame_size, sb.disk_size) - 1) / sb.block_size);
+		for (int block_num = first_block; block_num <= last_block; block_num++)
+			pending[block_num / 64] |= dirty_blocks[block_num / 64] & (1ULL << (block_num % 64));
+	}
+	vector<BlockDevice::Request> requests;
+	int count = 0;
+	uint64_t written = 0;
+	for (int block_num = dirty_next(pending, 0, &count); block_num != -1; block_num = dirty_next(pending, block_num + count, &count)) {
+		size_t length = (size_t) count * sb.block_size;
+		requests.push_back(BlockDevice::Request{block_offset(block_num), disk_at(block_offset(block_num), length), length});
+		written += count;
+	}
+	if (!device_write(*device, requests)) {
+		cerr << "Writing the image failed, nothing is evicted\n";
+		return;
+	}
+	for (size_t i = 0; i < pending.size(); i++)
+		dirty_blocks[i] &= ~pending[i];
+
+	// Runs of frames go back to the system at once
+	for (size_t i = 0; i < victims.size(); ) {
+		size_t end = i + 1;
+		while (end < victims.size() && victims[end] == victims[end - 1] + 1)
+			end++;
+		for (size_t j = i; j < end; j++)
+			frames_resident[victims[j] / 64] &= ~(1ULL << (victims[j] % 64));
+		long long offset = victims[i] * frame_size;
+		long long length = min((long long) (end - i) * frame_size, sb.disk_size - offset);
+		zero_release(disk_buffer, (size_t) offset, (size_t) length);
+		i = end;
+	}
+	frames_count -= victims.size();
+	cache_counters.evictions += victims.size();
+	cache_counters.written_back += written;
+}
 
-	string abspath = "";
-	for (size_t i = 0; i < dir_names.size(); i++)
-		abspath += "/" + dir_names[i];
-	if (abspath.substr(0, 2) == "//")
-		abspath.erase(0, 1);
+bool FileSystem::device_read(BlockDevice& source, const vector<BlockDevice::Request>& requests) {
+	if (requests.empty())
+		return true;
+	StatsTimer timer(*stats, Stats::DEVICE_READ);
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < requests.size(); i++)
+		bytes += requests[i].length;
+	timer.add(bytes / max(sb.block_size, 1), bytes);
+	return source.read(requests.data(), (int) requests.size());
+}
 
-	return abspath;
+bool FileSystem::device_write(BlockDevice& target, const vector<BlockDevice::Request>& requests) {
+	if (requests.empty())
+		return true;
+	StatsTimer timer(*stats, Stats::DEVICE_WRITE);
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < requests.size(); i++)
+		bytes += requests[i].length;
+	timer.add(bytes / max(sb.block_size, 1), bytes);
+	return target.write(requests.data(), (int) requests.size());
 }
 
-int FileSystem::type_of(string fullpath) {
-	int inode_num = inode_of(fullpath);
-	if (inode_num == 0) 
-		return Inode::UNKNOWN;
+int FileSystem::mount() {
+	long long disk_size = sb.disk_size;
+	int disk_rev_level = superblock_read();
+	if (sb.rev_level != REV_LEVEL)
+		return INCOMPATIBLE;
+	if (sb.features & ~FEATURES_SUPPORTED)
+		return INCOMPATIBLE;
+	if (sb.block_size <= 0 || sb.disk_size != disk_size || sb.blocks_count <= 0 || sb.blocks_count > blocks_max)
+		return INCOMPATIBLE;
 
-	Inode inode;
-	object_read(sb.inode_table * sb.block_size + inode_num * sizeof(Inode), &inode);
-	return inode.file_type;
-}
+	dirty_clear();
+	dentry_clear();
+	defrag_pass = DefragPass();
+	groups_single();
+	block_hints.assign(sb.groups_count, 0);
+	inode_hints.assign(sb.groups_count, 0);
+	locks_reset();
+	journal_head = 0;
+	journal_next = 0;
+	journal_ops = 0;
+
+	if (sb.group_table != 0 && (sb.blocks_per_group <= 0 || sb.inodes_per_group <= 0
+		|| sb.groups_count != (sb.blocks_count - 1) / sb.blocks_per_group + 1
+		|| sb.inodes_count != sb.inodes_per_group * sb.groups_count))
+		return INCOMPATIBLE;
 
-int FileSystem::dir_list(string fullpath) {
-	int inode_num = inode_of(fullpath);
-	if (inode_num == 0) 
-		return NOT_EXIST;
+	// Bitmaps, tables and the journal have to fit the disk in this order
+	long long bits = sb.block_size * 8LL;
+	long long blocks_count = sb.blocks_count;
+	if (blocks_count * sb.block_size > sb.disk_size || sb.inodes_count <= sb.first_inode || sb.inodes_count > inodes_max
+		|| sb.first_inode <= inode_root || sb.block_bitmap <= 0
+		|| sb.inode_bitmap - (long long) sb.block_bitmap < (blocks_count - 1) / bits + 1
+		|| sb.inode_table - (long long) sb.inode_bitmap < (sb.inodes_count - 1) / bits + 1)
+		return INCOMPATIBLE;
+	long long table_end = sb.inode_table + ((long long) sb.inodes_count * sizeof(Inode) - 1) / sb.block_size + 1;
+	if (sb.group_table != 0 && (sb.group_table < 0
+		|| sb.group_table + ((long long) sb.groups_count * sizeof(GroupDesc) - 1) / sb.block_size + 1 > sb.block_bitmap))
+		return INCOMPATIBLE;
+	if (sb.journal_blocks < 0 || (sb.journal_blocks > 0 && (sb.journal_block < table_end
+		|| (long long) sb.journal_block + sb.journal_blocks > blocks_count)))
+		return INCOMPATIBLE;
+	if (sb.refcount_blocks < 0 || (sb.refcount_blocks > 0 && (sb.refcount_table < table_end
+		|| (long long) sb.refcount_blocks * sb.block_size < blocks_count * (long long) sizeof(uint16_t)
+		|| (long long) sb.refcount_table + sb.refcount_blocks > blocks_count)))
+		return INCOMPATIBLE;
+	if (data_block_first() < table_end || data_block_first() >= blocks_count)
+		return INCOMPATIBLE;
 
-	Inode dir_inode;
-	object_read(sb.inode_table * sb.block_size + inode_num * sizeof(Inode), &dir_inode);
-	if (dir_inode.file_type != Inode::DIRECTORY)
-		return NOT_DIR;
+	// Revision 3 has no free counts, count them once
+	if (disk_rev_level == 3) {
+		sb.free_inodes_count = sb.inodes_count - bit_count(block_offset(sb.inode_bitmap), 0, sb.inodes_count);
+		sb.free_blocks_count = sb.blocks_count - bit_count(block_offset(sb.block_bitmap), 0, sb.blocks_count);
+	}
 
-    cout << " " << right << setw(5) << "Inode"
-        << "   " << left << setw(28) << "Name"
-        << "   " << left << setw(10) << "Type"
-        << "   " << left << setw(14) << "Modified Time"
-        << endl;
-	int max_entries = sb.block_size / sizeof(DirEntry);
-	for (int i = 0; i < Inode::direct_blocks_count; i++) {
-		int block_num = dir_inode.direct_blocks[i];
-		if (block_num == 0)
-			continue;
+	if (journal_replay() > 0) {
+		groups_single();
+		locks_reset();
+	}
 
-		for (int j = 0; j < max_entries; j++) {
-			DirEntry entry;
-			object_read(block_num * sb.block_size + j * sizeof(DirEntry), &entry);
-			if (entry.inode == 0)
+	// Converted superblock is written like any other change
+	if (disk_rev_level != REV_LEVEL)
+		object_write(0, sb);
+	return SUCCESS;
+}
+
+// Superblock in the layout of this revision, revisions 3 and 4 are converted. Returns
+// the revision found on disk.
+int FileSystem::superblock_read() {
+	// Revision 3 marked the root inode at the byte offset of the inode bitmap instead of
+	// in the bitmap, which set bit 0x20 of that byte of block 0. On most disks the byte
+	// is in the superblock, rev_level included.
+	long long disk_size = sb.disk_size;
+	int rev_level = 0;
+	object_read(offsetof(Superblock, rev_level), &rev_level);
+	bool rev3 = rev_level == 3;
+	for (int i = 0; i < 4; i++)
+		rev3 |= rev_level == (3 | 0x20 << (8 * i));
+	if (!rev3 && rev_level != 4) {
+		object_read(0, &sb);
+		return sb.rev_level;
+	}
+
+	SuperblockRev4 old;
+	object_read(0, &old);
+	if (rev3) {
+		// The layout of revision 3 follows from the disk and block size. Of the superblock
+		// as stored and the copies with one such bit cleared, the one that has that layout
+		// is taken. Fields after disk_size did not exist.
+		const int rev3_size = offsetof(SuperblockRev4, free_blocks_count);
+		unsigned char stored[rev3_size];
+		memcpy(stored, &old, rev3_size);
+		for (int byte = rev3_size - 1; byte >= -1; byte--) {
+			if (byte >= 0 && !(stored[byte] & 0x20))
 				continue;
-            
-			Inode inode;
-			object_read(sb.inode_table * sb.block_size + entry.inode * sizeof(Inode), &inode);
-            string file_type;
-            switch(inode.file_type) {
-            case Inode::UNKNOWN: file_type = "Unknown"; break;
-            case Inode::FILE: file_type = "File"; break;
-            case Inode::DIRECTORY: file_type = "Directory"; break;
-            default: file_type = "Unknown"; break;
-            }
-			cout << " " << right << setw(5) << entry.inode
-                << "   " << left << setw(28) << entry.name
-                << "   " << left << setw(10) << file_type
-                << "   " << left << setw(14) << inode.mod_time
-                << endl;
+			memset(&old, 0, sizeof(old));
+			memcpy(&old, stored, rev3_size);
+			if (byte >= 0)
+				((unsigned char*) &old)[byte] &= ~0x20;
+			if (superblock_rev3_valid(old, disk_size) && (byte == -1 || old.inode_bitmap == byte))
+				break;
 		}
+		rev_level = 3;
 	}
-	return SUCCESS;
+	sb.inodes_count = old.inodes_count;
+	sb.blocks_count = old.blocks_count;
+	sb.block_size = old.block_size;
+	sb.rev_level = REV_LEVEL;
+	sb.first_inode = old.first_inode;
+	sb.block_bitmap = old.block_bitmap;
+	sb.inode_bitmap = old.inode_bitmap;
+	sb.inode_table = old.inode_table;
+	sb.disk_size = (uint32_t) old.disk_size;
+	sb.free_blocks_count = old.free_blocks_count;
+	sb.free_inodes_count = old.free_inodes_count;
+	sb.features = old.features;
+	sb.journal_block = old.journal_block;
+	sb.journal_blocks = old.journal_blocks;
+	sb.journal_sequence = old.journal_sequence;
+	sb.refcount_table = old.refcount_table;
+	sb.refcount_blocks = old.refcount_blocks;
+	sb.blocks_per_group = old.blocks_per_group;
+	sb.inodes_per_group = old.inodes_per_group;
+	sb.groups_count = old.groups_count;
+	sb.group_table = old.group_table;
+
+	// The new layout must still end before the first block after it
+	int first_block = sb.group_table != 0 ? sb.group_table : sb.block_bitmap;
+	if (sb.block_size <= 0 || (long long) first_block * sb.block_size < (long long) sizeof(Superblock))
+		sb.rev_level = rev_level;
+	return rev_level;
 }
 
-int FileSystem::dir_create(string path, string name) {
-	int path_inode_num = inode_of(path);
-	if (path_inode_num == 0)
-		return NOT_EXIST;
-	
-	int new_inode_num = inode_of(name, path_inode_num);
-	if (new_inode_num != 0)
-		return ALREADY_EXIST;
+bool FileSystem::superblock_rev3_valid(const SuperblockRev4& old, long long disk_size) {
+	if (old.rev_level != 3 || old.block_size <= 0 || old.disk_size != disk_size)
+		return false;
+	int block_bitmap = (offsetof(SuperblockRev4, free_blocks_count) - 1) / old.block_size + 1;
+	return old.blocks_count == disk_size / old.block_size && old.inodes_count == old.blocks_count / 2
+		&& old.first_inode == inode_first && old.block_bitmap == block_bitmap
+		&& old.inode_bitmap == old.block_bitmap + (old.blocks_count - 1) / old.block_size + 1
+		&& old.inode_table == old.inode_bitmap + (old.inodes_count - 1) / old.block_size + 1;
+}
 
-	new_inode_num = bit_unused(sb.inode_bitmap * sb.block_size, sb.inodes_count);
-	bit_write(sb.inode_bitmap * sb.block_size, new_inode_num, USED);
-	object_write(sb.inode_table * sb.block_size + new_inode_num * sizeof(Inode), Inode(Inode::DIRECTORY));
-	dir_entry_add(new_inode_num, DirEntry(new_inode_num, "."));
-	dir_entry_add(new_inode_num, DirEntry(path_inode_num, ".."));
+void FileSystem::set_concurrent(bool enabled) {
+	WriteLock disk_lock = write_lock(locks->disk);
+	concurrent = enabled;
+	stats->shared = enabled;
+	locks_reset();
+	// Concurrent operations share the pool, so it is not created by one of them
+	if (enabled)
+		thread_pool();
+}
 
-	dir_entry_add(path_inode_num, DirEntry(new_inode_num, name.c_str()));
+void FileSystem::set_cache_limit(long long bytes) {
+	WriteLock disk_lock = write_lock(locks->disk);
+	cache_limit = max(bytes, 0LL);
+	frames_trim();
+}
 
-	return SUCCESS;
+void FileSystem::locks_reset() {
+	locks->inodes.reset();
+	locks->block_groups.reset();
+	locks->inode_groups.reset();
+	if (concurrent && disk != NULL) {
+		locks->inodes = make_unique<shared_mutex[]>(sb.inodes_count);
+		locks->block_groups = make_unique<mutex[]>(sb.groups_count);
+		locks->inode_groups = make_unique<mutex[]>(sb.groups_count);
+	}
 }
 
-int FileSystem::dir_remove(string path, string name) {
-	if (name == "." || name == "..")
-		return FAILED;
+// Locks are only taken in concurrent mode, otherwise they are returned unlocked
+FileSystem::ReadLock FileSystem::read_lock(shared_mutex& mutex) {
+	if (!concurrent)
+		return ReadLock();
+	return ReadLock(mutex);
+}
 
-	int path_inode_num = inode_of(path);
-	if (path_inode_num == 0)
-		return NOT_EXIST;
+// Operations start here. Frames beyond the cache limit are evicted first, with the disk
+// to ourselves.
+FileSystem::ReadLock FileSystem::disk_read_lock() {
+	ReadLock disk_lock = read_lock(locks->disk);
+	if (!frames_over_limit())
+		return disk_lock;
+	unlock(disk_lock);
+	WriteLock trim_lock = write_lock(locks->disk);
+	frames_trim();
+	unlock(trim_lock);
+	return read_lock(locks->disk);
+}
 
-	int target_inode_num = inode_of(name, path_inode_num);
-	if (target_inode_num == 0)
-		return NOT_EXIST;
+FileSystem::WriteLock FileSystem::write_lock(shared_mutex& mutex) {
+	if (!concurrent)
+		return WriteLock();
+	return WriteLock(mutex);
+}
 
-	Inode path_inode;
-	object_read(sb.inode_table * sb.block_size + target_inode_num * sizeof(Inode), &path_inode);
-	if (path_inode.file_type != Inode::DIRECTORY)
-		return NOT_DIR;
+FileSystem::ReadLock FileSystem::inode_read_lock(int inode_num) {
+	if (!locks->inodes)
+		return ReadLock();
+	return read_lock(locks->inodes[inode_num]);
+}
 
-	int entry_offset = dir_entry_find(path_inode_num, name.c_str());
-	if (entry_offset == 0)
-		return FAILED;
-	object_write(entry_offset, DirEntry());
-	bit_write(sb.inode_bitmap * sb.block_size, target_inode_num, UNUSED);
+FileSystem::WriteLock FileSystem::inode_write_lock(int inode_num) {
+	if (!locks->inodes)
+		return WriteLock();
+	return write_lock(locks->inodes[inode_num]);
+}
 
-	// ! Free up blocks if blocks does not contain any entry
+FileSystem::MutexLock FileSystem::mutex_lock(mutex& mutex) {
+	if (!concurrent)
+		return MutexLock();
+	return MutexLock(mutex);
+}
 
-	return SUCCESS;
+FileSystem::MutexLock FileSystem::group_lock(unique_ptr<mutex[]>& group_locks, int group) {
+	if (!group_locks)
+		return MutexLock();
+	return mutex_lock(group_locks[group]);
 }
 
-int FileSystem::file_create(string path, string name, int size) {
-	int path_inode_num = inode_of(path);
-	if (path_inode_num == 0)
-		return NOT_EXIST;
+int FileSystem::data_block_first() {
+	if (sb.refcount_blocks > 0)
+		return sb.refcount_table + sb.refcount_blocks;
+	if (sb.journal_blocks > 0)
+		return sb.journal_block + sb.journal_blocks;
+	return sb.inode_table + (sb.inodes_count * sizeof(Inode) - 1) / sb.block_size + 1;
+}
 
-	int new_inode_num = inode_of(name, path_inode_num);
-	if (new_inode_num != 0)
-		return ALREADY_EXIST;
+void FileSystem::dirty_clear() {
+	dirty_blocks.assign((sb.disk_size / sb.block_size + 63) / 64 + 1, 0);
+	journal_dirty.assign(dirty_blocks.size(), 0);
+	journal_dirty_count = 0;
+}
 
-	new_inode_num = bit_unused(sb.inode_bitmap * sb.block_size, sb.inodes_count);
-	bit_write(sb.inode_bitmap * sb.block_size, new_inode_num, USED);
-    Inode new_inode;
-    new_inode.file_type = Inode::FILE;
-    new_inode.size = size;
-    new_inode.mod_time = (int) time(0);
+int FileSystem::dirty_next(const vector<uint64_t>& blocks, int block_num, int* count) {
+	// First block set at or after block_num, and the length of its run
+	int words = (int) blocks.size();
+	int word = block_num / 64;
+	if (word >= words)
+		return -1;
+	uint64_t bits = blocks[word] & (~0ULL << (block_num % 64));
+	while (bits == 0) {
+		if (++word >= words)
+			return -1;
+		bits = blocks[word];
+	}
+	int first = word * 64 + ctz64(bits);
+
+	int last = first;
+	bits = ~blocks[word] & (~0ULL << (first % 64));
+	while (bits == 0 && ++word < words)
+		bits = ~blocks[word];
+	last = (word < words) ? word * 64 + ctz64(bits) : words * 64;
+	*count = last - first;
+	return first;
+}
 
-	// ! Fill file with random values
-    
-	object_write(sb.inode_table * sb.block_size + new_inode_num * sizeof(Inode), new_inode);
-	dir_entry_add(path_inode_num, DirEntry(new_inode_num, name.c_str()));
 
-	return SUCCESS;
+// A mapped image takes every write in place at once, the journal could not be ahead of it
+bool FileSystem::journal_active() {
+	return (sb.features & FEATURE_JOURNAL) && sb.journal_blocks > 0 && image_path != "" && !disk_map;
 }
 
-int FileSystem::file_remove(string path, string name) {
-	int path_inode_num = inode_of(path);
-	if (path_inode_num == 0)
-		return NOT_EXIST;
+int FileSystem::journal_threshold() {
+	int descriptor_max = (int) ((sb.block_size - sizeof(JournalHeader)) / sizeof(int));
+	return min(sb.journal_blocks / 4, descriptor_max);
+}
 
-	int target_inode_num = inode_of(name, path_inode_num);
-	if (target_inode_num == 0)
-		return NOT_EXIST;
+int FileSystem::journal_end(ReadLock& disk_lock) {
+	// Group commit: operations are logged together once enough accumulate
+	int ops = atomic_add32(&journal_ops, 1) + 1;
+	if (!journal_active())
+		return SUCCESS;
+	if (ops < journal_batch && atomic_load32(&journal_dirty_count) < journal_threshold())
+		return SUCCESS;
+
+	// Commit needs the disk to itself
+	unlock(disk_lock);
+	return sync();
+}
 
-	Inode path_inode;
-	object_read(sb.inode_table * sb.block_size + target_inode_num * sizeof(Inode), &path_inode);
-	if (path_inode.file_type != Inode::FILE)
-		return NOT_FILE;
+int FileSystem::journal_commit() {
+	StatsTimer timer(*stats, Stats::JOURNAL_COMMIT);
+	if (!journal_active() || journal_dirty_count == 0) {
+		fill(journal_dirty.begin(), journal_dirty.end(), 0);
+		journal_dirty_count = 0;
+		journal_ops = 0;
+		return SUCCESS;
+	}
+	object_write(0, sb);
 
-	blocks_free_all(target_inode_num);
-	bit_write(sb.inode_bitmap * sb.block_size, target_inode_num, UNUSED);
+	vector<int> blocks;
+	for (size_t word = 0; word < journal_dirty.size(); word++) {
+		for (uint64_t bits = journal_dirty[word]; bits != 0; bits &= bits - 1)
+			blocks.push_back((int) word * 64 + ctz64(bits));
+	}
+	int count = (int) blocks.size();
+	int descriptor_max = (int) ((sb.block_size - sizeof(JournalHeader)) / sizeof(int));
+	if (count > descriptor_max || journal_head + count + 2 > sb.journal_blocks)
+		return FAILED;
 
-	int entry_offset = dir_entry_find(path_inode_num, name.c_str());
+	// Descriptor, copies and commit are contiguous, written at once
+	vector<char> buffer((size_t) (count + 2) * sb.block_size, 0);
+	JournalHeader descriptor;
+	descriptor.type = JournalHeader::DESCRIPTOR;
+	descriptor.sequence = journal_next;
+	descriptor.count = count;
+	memcpy(buffer.data(), &descriptor, sizeof(JournalHeader));
+	memcpy(buffer.data() + sizeof(JournalHeader), blocks.data(), count * sizeof(int));
+
+	uint32_t checksum = fnv1a32(&journal_next, sizeof(journal_next));
+	for (int i = 0; i < count; i++) {
+		char* copy = buffer.data() + (size_t) (i + 1) * sb.block_size;
+		memcpy(copy, disk_at(block_offset(blocks[i]), sb.block_size), sb.block_size);
+		checksum = fnv1a32(copy, sb.block_size, checksum);
+	}
+	JournalHeader commit = descriptor;
+	commit.type = JournalHeader::COMMIT;
+	char* commit_block = buffer.data() + (size_t) (count + 1) * sb.block_size;
+	memcpy(commit_block, &commit, sizeof(JournalHeader));
+	memcpy(commit_block + sizeof(JournalHeader), &checksum, sizeof(checksum));
+
+	if (data_flush() != SUCCESS)
+		return FAILED;
+
+	long long offset = block_offset(sb.journal_block + journal_head);
+	if (disk_map) {
+		memcpy(disk + offset, buffer.data(), buffer.size());
+		if (!disk_map->sync((size_t) offset, buffer.size()))
+			return FAILED;
+	} else {
+		vector<BlockDevice::Request> requests(1, BlockDevice::Request{offset, buffer.data(), buffer.size()});
+		if (!device_write(*device, requests) || !device->sync())
+			return FAILED;
+	}
+
+	timer.add(count + 2, buffer.size());
+	journal_head += count + 2;
+	journal_next++;
+	fill(journal_dirty.begin(), journal_dirty.end(), 0);
+	journal_dirty_count = 0;
+	journal_ops = 0;
+	return SUCCESS;
+}
+
+int FileSystem::data_flush() {
+	// Ordered mode: file data and blocks of earlier commits are written in place
+	// before a commit, so replayed metadata never points at unwritten data
+	vector<uint64_t> pending(dirty_blocks.size());
+	bool is_pending = false;
+	for (size_t i = 0; i < pending.size(); i++) {
+		pending[i] = dirty_blocks[i] & ~journal_dirty[i];
+		is_pending |= pending[i] != 0;
+	}
+	if (!is_pending)
+		return SUCCESS;
+
+	if (!disk_map && device->size() != sb.disk_size)
+		return FAILED;
+	vector<BlockDevice::Request> requests;
+	int count = 0;
+	for (int block_num = dirty_next(pending, 0, &count); block_num != -1; block_num = dirty_next(pending, block_num + count, &count)) {
+		size_t length = (size_t) count * sb.block_size;
+		if (disk_map && !disk_map->sync((size_t) block_offset(block_num), length))
+			return FAILED;
+		if (!disk_map)
+			requests.push_back(BlockDevice::Request{block_offset(block_num), disk_at(block_offset(block_num), length), length});
+	}
+	if (!disk_map && (!device_write(*device, requests) || !device->sync()))
+		return FAILED;
+
+	for (size_t i = 0; i < pending.size(); i++)
+		dirty_blocks[i] &= ~pending[i];
+	return SUCCESS;
+}
+
+int FileSystem::journal_replay() {
+	if (!(sb.features & FEATURE_JOURNAL) || sb.journal_blocks == 0)
+		return 0;
+
+	// Apply committed transactions in sequence, stop at the first incomplete one
+	int descriptor_max = (int) ((sb.block_size - sizeof(JournalHeader)) / sizeof(int));
+	journal_next = sb.journal_sequence;
+	int replayed = 0;
+	while (journal_head + 2 <= sb.journal_blocks) {
+		long long offset = block_offset(sb.journal_block + journal_head);
+		JournalHeader descriptor;
+		object_read(offset, &descriptor);
+		if (descriptor.magic != JournalHeader::MAGIC || descriptor.type != JournalHeader::DESCRIPTOR
+			|| descriptor.sequence != journal_next || descriptor.count <= 0 || descriptor.count > descriptor_max
+			|| journal_head + descriptor.count + 2 > sb.journal_blocks)
+			break;
+
+		int count = descriptor.count;
+		JournalHeader commit;
+		uint32_t commit_checksum = 0;
+		object_read(offset + (long long) (count + 1) * sb.block_size, &commit);
+		object_read(offset + (long long) (count + 1) * sb.block_size + (int) sizeof(JournalHeader), &commit_checksum);
+		uint32_t checksum = fnv1a32(&journal_next, sizeof(journal_next));
+		for (int i = 0; i < count; i++)
+			checksum = fnv1a32(disk_at(offset + (long long) (i + 1) * sb.block_size, sb.block_size), sb.block_size, checksum);
+		if (commit.magic != JournalHeader::MAGIC || commit.type != JournalHeader::COMMIT
+			|| commit.sequence != journal_next || commit.count != count || commit_checksum != checksum)
+			break;
+
+		for (int i = 0; i < count; i++) {
+			int block_num = 0;
+			object_read(offset + (int) sizeof(JournalHeader) + i * (int) sizeof(int), &block_num);
+			if (block_num >= 0 && block_num < sb.blocks_count)
+				block_write(block_num, disk_at(offset + (long long) (i + 1) * sb.block_size, sb.block_size));
+		}
+		journal_head += count + 2;
+		journal_next++;
+		replayed++;
+	}
+
+	// Superblock may be one of the replayed blocks
+	if (replayed > 0)
+		superblock_read();
+	fill(journal_dirty.begin(), journal_dirty.end(), 0);
+	journal_dirty_count = 0;
+	return replayed;
+}
+
+int FileSystem::checkpoint() {
+	StatsTimer timer(*stats, Stats::CHECKPOINT);
+	if (image_path == "")
+		return FAILED;
+
+	// Log pending changes first, a crash while writing in place is then replayed.
+	// Without room in the journal the changes are written in place unprotected.
+	if (journal_active())
+		journal_commit();
+	sb.journal_sequence = journal_next;
+	journal_head = 0;
+	object_write(0, sb);
+
+	// Superblock goes last, it retires the journal once everything else is in place
+	int count = 0;
+	if (disk_map) {
+		for (int block_num = dirty_next(dirty_blocks, 1, &count); block_num != -1; block_num = dirty_next(dirty_blocks, block_num + count, &count)) {
+			if (!disk_map->sync((size_t) block_num * sb.block_size, (size_t) count * sb.block_size))
+				return FAILED;
+			timer.add(count, (uint64_t) count * sb.block_size);
+		}
+		if (!disk_map->sync(0, sb.block_size))
+			return FAILED;
+		dirty_clear();
+		return SUCCESS;
+	}
+
+	// An image that changed size behind our back is written again
+	if (device->size() != sb.disk_size) {
+		string filepath = image_path;
+		image_path = "";
+		return image_write(filepath);
+	}
+	vector<BlockDevice::Request> requests;
+	for (int block_num = dirty_next(dirty_blocks, 1, &count); block_num != -1; block_num = dirty_next(dirty_blocks, block_num + count, &count)) {
+		size_t length = (size_t) count * sb.block_size;
+		requests.push_back(BlockDevice::Request{block_offset(block_num), disk_at(block_offset(block_num), length), length});
+		timer.add(count, length);
+	}
+	if (!device_write(*device, requests) || !device->sync())
+		return FAILED;
+	requests.assign(1, BlockDevice::Request{0, disk_at(0, sb.block_size), (size_t) sb.block_size});
+	if (!device_write(*device, requests) || !device->sync())
+		return FAILED;
+	dirty_clear();
+	return SUCCESS;
+}
+
+
+// Images without block groups are one group covering the whole disk
+void FileSystem::groups_single() {
+	if (sb.features & FEATURE_BLOCK_GROUPS)
+		return;
+	sb.blocks_per_group = max(sb.blocks_count, 1);
+	sb.inodes_per_group = max(sb.inodes_count, 1);
+	sb.groups_count = 1;
+	sb.group_table = 0;
+}
+
+// Field is the offset of a count in GroupDesc, a single group uses the totals
+int FileSystem::group_read(int group, int field) {
+	if (sb.group_table == 0) {
+		if (field == offsetof(GroupDesc, free_blocks_count))
+			return atomic_load32(&sb.free_blocks_count);
+		if (field == offsetof(GroupDesc, free_inodes_count))
+			return atomic_load32(&sb.free_inodes_count);
+		return 0;
+	}
+	return atomic_load32((int*) disk_at(block_offset(sb.group_table) + group * sizeof(GroupDesc) + field, sizeof(int)));
+}
+
+// Counts are read without the group lock to pick a group, so they change atomically
+void FileSystem::group_add(int group, int field, int delta) {
+	if (sb.group_table == 0)
+		return;
+	long long byte_offset = block_offset(sb.group_table) + group * sizeof(GroupDesc) + field;
+	atomic_add32((int*) disk_at(byte_offset, sizeof(int)), delta);
+	dirty_mark(byte_offset, sizeof(int));
+}
+
+// Count the groups again from the bitmaps, returns the number of groups that differed
+int FileSystem::group_recount() {
+	int drifted = 0;
+	for (int i = 0; sb.group_table != 0 && i < sb.groups_count; i++) {
+		int first_block = i * sb.blocks_per_group;
+		int last_block = min(first_block + sb.blocks_per_group, sb.blocks_count);
+		int first_inode = i * sb.inodes_per_group;
+		int last_inode = first_inode + sb.inodes_per_group;
+
+		GroupDesc desc, counted;
+		object_read(block_offset(sb.group_table) + i * sizeof(GroupDesc), &desc);
+		counted = desc;
+		counted.free_blocks_count = last_block - first_block - bit_count(block_offset(sb.block_bitmap), first_block, last_block);
+		counted.free_inodes_count = last_inode - first_inode - bit_count(block_offset(sb.inode_bitmap), first_inode, last_inode);
+		counted.used_dirs_count = 0;
+		for (int inode_num = first_inode; inode_num < last_inode; inode_num++) {
+			if (bit_read(block_offset(sb.inode_bitmap), inode_num) == USED && inode_type(inode_num) == Inode::DIRECTORY)
+				counted.used_dirs_count++;
+		}
+		if (memcmp(&desc, &counted, sizeof(GroupDesc)) != 0) {
+			object_write(block_offset(sb.group_table) + i * sizeof(GroupDesc), counted);
+			drifted++;
+		}
+	}
+	return drifted;
+}
+
+// Group to take a new inode from. Files and nested directories stay with their parent,
+// directories in the root spread over the groups like the Orlov allocator of ext4.
+int FileSystem::group_of_inode(int file_type, int parent_inode) {
+	int parent_group = parent_inode / sb.inodes_per_group;
+	if (file_type != Inode::DIRECTORY || parent_inode != inode_root || sb.groups_count == 1)
+		return parent_group;
+
+	// Fewest directories among the groups with at least the average free inodes and blocks
+	int free_inodes_average = atomic_load32(&sb.free_inodes_count) / sb.groups_count;
+	int free_blocks_average = atomic_load32(&sb.free_blocks_count) / sb.groups_count;
+	int best_group = parent_group;
+	int best_dirs = INT_MAX;
+	for (int i = 0; i < sb.groups_count; i++) {
+		if (group_read(i, offsetof(GroupDesc, free_inodes_count)) < max(free_inodes_average, 1))
+			continue;
+		if (group_read(i, offsetof(GroupDesc, free_blocks_count)) < free_blocks_average)
+			continue;
+		int dirs = group_read(i, offsetof(GroupDesc, used_dirs_count));
+		if (dirs < best_dirs) {
+			best_group = i;
+			best_dirs = dirs;
+		}
+	}
+	return best_group;
+}
+
+// New data continues where the last allocation in the group of its inode ended
+int FileSystem::block_goal(int inode_num) {
+	int group = inode_num / sb.inodes_per_group;
+	int goal = atomic_load32(&block_hints[group]);
+	if (goal / sb.blocks_per_group != group)
+		goal = group * sb.blocks_per_group;
+	return goal;
+}
+
+int FileSystem::block_alloc(int goal, bool journaled) {
+	StatsTimer timer(*stats, Stats::BLOCK_ALLOC);
+	if (goal <= 0 || goal >= sb.blocks_count)
+		goal = atomic_load32(&block_hints[0]);
+	if (goal < 0 || goal >= sb.blocks_count)
+		goal = 0;
+
+	// Group of the goal first, then the following groups
+	int goal_group = goal / sb.blocks_per_group;
+	int block_num = -1;
+	for (int i = 0; i < sb.groups_count && block_num == -1; i++) {
+		int group = (goal_group + i) % sb.groups_count;
+		if (group_read(group, offsetof(GroupDesc, free_blocks_count)) == 0)
+			continue;
+		MutexLock alloc_lock = group_lock(locks->block_groups, group);
+		int first = group * sb.blocks_per_group;
+		int last = min(first + sb.blocks_per_group, sb.blocks_count);
+		block_num = bit_unused(block_offset(sb.block_bitmap), first, last, i == 0 ? goal : atomic_load32(&block_hints[group]));
+		if (block_num == -1)
+			continue;
+		bit_write(block_offset(sb.block_bitmap), block_num, USED);
+		atomic_store32(&block_hints[group], block_num + 1);
+	}
+	if (block_num == -1)
+		return 0;
+	timer.add(1, sb.block_size);
+
+	// Block may contain leftovers of a removed file or directory
+	vector<char> zeros(sb.block_size, 0);
+	if (journaled)
+		block_write(block_num, zeros.data());
+	else
+		data_write(block_offset(block_num), zeros.data(), sb.block_size);
+	return block_num;
+}
+
+int FileSystem::block_of(const Inode& inode, int logical) {
+	int count = 0;
+	return block_run(inode, logical, &count, 1);
+}
+
+int FileSystem::block_run(const Inode& inode, int logical, int* count, int limit) {
+	*count = 0;
+	if (logical < 0)
+		return 0;
+
+	if (inode.flags & Inode::EXTENTS) {
+		Extent extent;
+		if (extent_find(inode, logical, &extent) != SUCCESS)
+			return 0;
+		*count = extent.length - (logical - extent.logical);
+		return extent.physical + (logical - extent.logical);
+	}
+
+	// Direct and single indirect block pointers, the run goes on while the blocks follow each other
+	int pointers_count = Inode::direct_blocks_count + sb.block_size / (int) sizeof(int);
+	int block_num = 0;
+	for (int next = logical; next < pointers_count && *count < limit; next++) {
+		int next_block = 0;
+		if (next < Inode::direct_blocks_count)
+			next_block = inode.direct_blocks[next];
+		else if (inode.indirect_block != 0)
+			object_read(block_offset(inode.indirect_block) + (next - Inode::direct_blocks_count) * sizeof(int), &next_block);
+		if (next == logical)
+			block_num = next_block;
+		if (block_num == 0 || next_block != block_num + (next - logical))
+			break;
+		(*count)++;
+	}
+	return block_num;
+}
+
+int FileSystem::block_map(int inode_num, Inode& inode, int logical, bool journaled) {
+	if (logical < 0)
+		return 0;
+
+	// Place the block right after the previous logical block if possible
+	int goal = block_of(inode, logical - 1);
+	if (goal != 0)
+		goal++;
+	else
+		goal = block_goal(inode_num);
+
+	int block_num = block_alloc(goal, journaled);
+	if (block_num == 0)
+		return 0;
+	if (block_set(inode_num, inode, logical, block_num) != SUCCESS) {
+		blocks_free_run(block_num, 1);
+		return 0;
+	}
+	return block_num;
+}
+
+int FileSystem::block_set(int inode_num, Inode& inode, int logical, int block_num) {
+	if (logical < 0)
+		return FAILED;
+
+	if (inode.flags & Inode::EXTENTS) {
+		if (extent_insert(inode, logical, block_num) != SUCCESS)
+			return FAILED;
+		object_write(inode_offset(inode_num), inode);
+		return SUCCESS;
+	}
+
+	int indirect_entries = sb.block_size / sizeof(int);
+	if (logical >= Inode::direct_blocks_count + indirect_entries)
+		return FAILED;
+	if (logical >= Inode::direct_blocks_count && inode.indirect_block == 0) {
+		inode.indirect_block = block_alloc(block_goal(inode_num));
+		if (inode.indirect_block == 0)
+			return FAILED;
+	}
+	if (logical < Inode::direct_blocks_count)
+		inode.direct_blocks[logical] = block_num;
+	else
+		object_write(block_offset(inode.indirect_block) + (logical - Inode::direct_blocks_count) * sizeof(int), block_num);
+	object_write(inode_offset(inode_num), inode);
+	return SUCCESS;
+}
+
+// Reference counts are guarded by their own lock
+int FileSystem::block_refs(int block_num) {
+	if (sb.refcount_blocks == 0)
+		return 0;
+	uint16_t refs = 0;
+	object_read(block_offset(sb.refcount_table) + block_num * sizeof(uint16_t), &refs);
+	return refs;
+}
+
+void FileSystem::block_refs_add(int block_num, int delta) {
+	uint16_t refs = (uint16_t) (block_refs(block_num) + delta);
+	object_write(block_offset(sb.refcount_table) + block_num * sizeof(uint16_t), refs);
+}
+
+int FileSystem::block_unshared(int block_num, int count) {
+	if (sb.refcount_blocks == 0)
+		return count;
+	MutexLock refs_lock = mutex_lock(locks->refcounts);
+	int unshared = 0;
+	while (unshared < count && block_refs(block_num + unshared) == 0)
+		unshared++;
+	return unshared;
+}
+
+int FileSystem::inode_extents(const Inode& inode, vector<Extent>& extents, vector<int>* tree_blocks) {
+	extents.clear();
+	if (tree_blocks != NULL)
+		tree_blocks->clear();
+	if (inode.flags & Inode::EXTENTS) {
+		const ExtentHeader* header = inode.extent_header();
+		const Extent* entries = inode.extents();
+		for (int i = 0; i < header->entries; i++) {
+			if (header->depth == 0)
+				extents.push_back(entries[i]);
+			else
+				extent_node_collect(entries[i].physical, header->depth - 1, extents, tree_blocks);
+		}
+		return SUCCESS;
+	}
+	if (tree_blocks != NULL && inode.indirect_block != 0)
+		tree_blocks->push_back(inode.indirect_block);
+
+	// Block pointers, adjacent blocks are merged into one extent
+	int indirect_entries = sb.block_size / sizeof(int);
+	for (int logical = 0; logical < Inode::direct_blocks_count + indirect_entries; logical++) {
+		if (logical >= Inode::direct_blocks_count && inode.indirect_block == 0)
+			break;
+		int block_num = block_of(inode, logical);
+		if (block_num == 0)
+			continue;
+		if (!extents.empty()) {
+			Extent& last = extents.back();
+			if (last.logical + last.length == logical && last.physical + last.length == block_num) {
+				last.length++;
+				continue;
+			}
+		}
+		extents.push_back(Extent(logical, block_num, 1));
+	}
+	return SUCCESS;
+}
+
+
+int FileSystem::extent_leaf_max() {
+	// Index blocks hold as many entries as leaves
+	return (int) ((sb.block_size - sizeof(ExtentHeader)) / sizeof(Extent));
+}
+
+void FileSystem::extent_node_read(int block_num, ExtentHeader* header, vector<Extent>& entries) {
+	long long node_offset = block_offset(block_num);
+	object_read(node_offset, header);
+	entries.resize(max(0, min((int) header->entries, extent_leaf_max())));
+	for (size_t i = 0; i < entries.size(); i++)
+		object_read(node_offset + sizeof(ExtentHeader) + i * sizeof(Extent), &entries[i]);
+}
+
+void FileSystem::extent_node_write(int block_num, ExtentHeader header, const vector<Extent>& entries) {
+	vector<char> node(sb.block_size, 0);
+	header.entries = (short) entries.size();
+	header.max = (short) extent_leaf_max();
+	memcpy(node.data(), &header, sizeof(header));
+	memcpy(node.data() + sizeof(header), entries.data(), entries.size() * sizeof(Extent));
+	block_write(block_num, node.data());
+}
+
+void FileSystem::extent_node_collect(int block_num, int depth, vector<Extent>& extents, vector<int>* tree_blocks) {
+	// Depth of the node comes from its parent, so a damaged header cannot make a loop
+	if (tree_blocks != NULL)
+		tree_blocks->push_back(block_num);
+	ExtentHeader header;
+	vector<Extent> entries;
+	extent_node_read(block_num, &header, entries);
+	for (size_t i = 0; i < entries.size(); i++) {
+		if (depth == 0)
+			extents.push_back(entries[i]);
+		else
+			extent_node_collect(entries[i].physical, depth - 1, extents, tree_blocks);
+	}
+}
+
+int FileSystem::extent_search(const Extent* entries, int count, int logical) {
+	// Last entry starting at or before the logical block, the first one otherwise
+	int low = 0;
+	int high = count - 1;
+	while (low < high) {
+		int mid = (low + high + 1) / 2;
+		if (entries[mid].logical <= logical)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return low;
+}
+
+int FileSystem::extent_tree_size(int count) {
+	int blocks = 0;
+	while (count > Inode::root_extents_count) {
+		count = (count - 1) / extent_leaf_max() + 1;
+		blocks += count;
+	}
+	return blocks;
+}
+
+void FileSystem::extent_tree_build(Inode& inode, vector<Extent> entries, int first_block) {
+	// Full nodes bottom up, each level points to the one below until the root can hold it
+	ExtentHeader* header = inode.extent_header();
+	header->depth = 0;
+	int block_num = first_block;
+	while ((int) entries.size() > Inode::root_extents_count) {
+		vector<Extent> parents;
+		for (size_t i = 0; i < entries.size(); i += extent_leaf_max()) {
+			vector<Extent> node(entries.begin() + i, entries.begin() + min(entries.size(), i + extent_leaf_max()));
+			ExtentHeader node_header;
+			node_header.depth = header->depth;
+			extent_node_write(block_num, node_header, node);
+			parents.push_back(Extent(node[0].logical, block_num, 0));
+			block_num++;
+		}
+		entries = parents;
+		header->depth++;
+	}
+	header->entries = (short) entries.size();
+	header->max = Inode::root_extents_count;
+	copy(entries.begin(), entries.end(), inode.extents());
+}
+
+void FileSystem::extent_tree_relink(Inode& inode, const vector<int>& old_blocks, const vector<int>& new_blocks) {
+	// Root and index nodes of a copied tree point to the copies of the nodes below
+	unordered_map<int, int> copies;
+	for (size_t i = 0; i < old_blocks.size(); i++)
+		copies[old_blocks[i]] = new_blocks[i];
+	ExtentHeader* header = inode.extent_header();
+	for (int i = 0; header->depth > 0 && i < header->entries; i++)
+		inode.extents()[i].physical = copies[inode.extents()[i].physical];
+	for (size_t i = 0; i < new_blocks.size(); i++) {
+		ExtentHeader node;
+		vector<Extent> entries;
+		extent_node_read(new_blocks[i], &node, entries);
+		if (node.depth == 0)
+			continue;
+		for (size_t j = 0; j < entries.size(); j++)
+			entries[j].physical = copies[entries[j].physical];
+		extent_node_write(new_blocks[i], node, entries);
+	}
+}
+
+int FileSystem::extent_find(const Inode& inode, int logical, Extent* extent) {
+	const ExtentHeader* header = inode.extent_header();
+	const Extent* entries = inode.extents();
+	if (header->entries == 0)
+		return NOT_EXIST;
+
+	// Nodes below the root are searched in place
+	*extent = entries[extent_search(entries, header->entries, logical)];
+	for (int depth = header->depth; depth > 0; depth--) {
+		if (extent->physical <= 0 || extent->physical >= sb.blocks_count)
+			return NOT_EXIST;
+		const ExtentHeader* node = (const ExtentHeader*) disk_at(block_offset(extent->physical), sb.block_size);
+		int count = min((int) node->entries, extent_leaf_max());
+		if (count <= 0)
+			return NOT_EXIST;
+		*extent = ((const Extent*) (node + 1))[extent_search((const Extent*) (node + 1), count, logical)];
+	}
+
+	if (logical < extent->logical || logical >= extent->logical + extent->length)
+		return NOT_EXIST;
+	return SUCCESS;
+}
+
+int FileSystem::extent_insert(Inode& inode, int logical, int physical) {
+	ExtentHeader* header = inode.extent_header();
+	Extent* entries = inode.extents();
+
+	if (header->depth == 0) {
+		vector<Extent> extents(entries, entries + header->entries);
+		if (extent_merge(extents, logical, physical) <= Inode::root_extents_count) {
+			header->entries = (short) extents.size();
+			header->max = Inode::root_extents_count;
+			copy(extents.begin(), extents.end(), entries);
+			return SUCCESS;
+		}
+
+		// Root is full, move its extents into a leaf block
+		int leaf_block = block_alloc(physical + 1);
+		if (leaf_block == 0)
+			return FAILED;
+		extent_node_write(leaf_block, ExtentHeader(), vector<Extent>(entries, entries + header->entries));
+		header->entries = 1;
+		header->max = Inode::root_extents_count;
+		header->depth = 1;
+		entries[0] = Extent(0, leaf_block, 0);
+	}
+
+	// Nodes from the root down to the leaf of the block, the root is in the inode
+	struct Node {
+		int block_num = 0;
+		ExtentHeader header;
+		vector<Extent> entries;
+		int index = 0;
+	};
+	vector<Node> path(header->depth + 1);
+	path[0].header = *header;
+	path[0].entries.assign(entries, entries + header->entries);
+	for (size_t level = 0; level + 1 < path.size(); level++) {
+		Node& node = path[level];
+		if (node.entries.empty())
+			return FAILED;
+		node.index = extent_search(node.entries.data(), (int) node.entries.size(), logical);
+		path[level + 1].block_num = node.entries[node.index].physical;
+		extent_node_read(path[level + 1].block_num, &path[level + 1].header, path[level + 1].entries);
+	}
+	extent_merge(path.back().entries, logical, physical);
+
+	// A node splits when the one below it did and it is full, a full root grows the tree
+	// by a level. Blocks for all of them are taken first, so a failure changes nothing.
+	int splits = 0;
+	for (int level = (int) path.size() - 1; level >= 0; level--) {
+		int count = (int) path[level].entries.size() + (splits > 0 ? 1 : 0);
+		if (count <= (level == 0 ? Inode::root_extents_count : extent_leaf_max()))
+			break;
+		splits++;
+	}
+	vector<int> new_blocks;
+	for (int i = 0; i < splits; i++) {
+		int block_num = block_alloc(physical + 1);
+		if (block_num == 0) {
+			for (size_t j = 0; j < new_blocks.size(); j++)
+				blocks_free_run(new_blocks[j], 1);
+			return FAILED;
+		}
+		new_blocks.push_back(block_num);
+	}
+
+	// Upper half of a split node goes to a new node after it
+	bool split = false;
+	Extent sibling;
+	for (int level = (int) path.size() - 1; level > 0; level--) {
+		Node& node = path[level];
+		if (split)
+			node.entries.insert(node.entries.begin() + node.index + 1, sibling);
+		split = (int) node.entries.size() > extent_leaf_max();
+		if (split) {
+			int half = (int) node.entries.size() / 2;
+			vector<Extent> upper(node.entries.begin() + half, node.entries.end());
+			node.entries.resize(half);
+			sibling = Extent(upper[0].logical, new_blocks.back(), 0);
+			new_blocks.pop_back();
+			extent_node_write(sibling.physical, node.header, upper);
+		}
+		extent_node_write(node.block_num, node.header, node.entries);
+	}
+	vector<Extent>& root = path[0].entries;
+	if (split)
+		root.insert(root.begin() + path[0].index + 1, sibling);
+	if ((int) root.size() > Inode::root_extents_count) {
+		ExtentHeader node_header;
+		node_header.depth = header->depth;
+		Extent child(root[0].logical, new_blocks.back(), 0);
+		extent_node_write(child.physical, node_header, root);
+		root.assign(1, child);
+		header->depth++;
+	}
+	header->entries = (short) root.size();
+	copy(root.begin(), root.end(), entries);
+	return SUCCESS;
+}
+
+int FileSystem::extent_merge(vector<Extent>& extents, int logical, int physical) {
+	// Drop the current mapping of the block, splitting its extent if needed
+	for (size_t i = 0; i < extents.size(); i++) {
+		Extent& current = extents[i];
+		if (logical < current.logical || logical >= current.logical + current.length)
+			continue;
+		Extent tail(logical + 1, current.physical + (logical - current.logical) + 1, current.logical + current.length - logical - 1);
+		current.length = logical - current.logical;
+		if (tail.length > 0)
+			extents.insert(extents.begin() + i + 1, tail);
+		if (extents[i].length == 0)
+			extents.erase(extents.begin() + i);
+		break;
+	}
+
+	// Extend the extent ending right before the block, otherwise insert a new one in order
+	size_t index = 0;
+	while (index < extents.size() && extents[index].logical < logical)
+		index++;
+	if (index > 0) {
+		Extent& previous = extents[index - 1];
+		if (previous.logical + previous.length == logical && previous.physical + previous.length == physical) {
+			previous.length++;
+			return (int) extents.size();
+		}
+	}
+	extents.insert(extents.begin() + index, Extent(logical, physical, 1));
+	return (int) extents.size();
+}
+
+long long FileSystem::dir_entry_find(int inode_num, const char* name, int* slot) {
+	StatsTimer timer(*stats, Stats::DIR_ENTRY_FIND);
+	if (name[0] == '\0')
+		return 0;
+
+	const Inode* dir_inode = inode_view(inode_num);
+	if (dir_inode == NULL)
+		return 0;
+	int max_entries = sb.block_size / sizeof(DirEntry);
+
+	// Blocks are searched in place
+	if (dir_inode->flags & Inode::INDEXED) {
+		// "." and ".." are kept in front of the index root
+		int block_num = block_of(*dir_inode, 0);
+		if (strcmp(name, ".") == 0)
+			return block_offset(block_num);
+		if (strcmp(name, "..") == 0)
+			return block_offset(block_num) + sizeof(DirEntry);
+
+		long long root_offset = block_offset(block_num) + 2 * sizeof(DirEntry);
+		const DirIndexEntry* leaf = object_view<DirIndexEntry>(root_offset + sizeof(DirIndexRoot) + dir_index_search(root_offset, dir_hash(name)) * sizeof(DirIndexEntry));
+		if (leaf == NULL)
+			return 0;
+		block_num = block_of(*dir_inode, leaf->block);
+		timer.add(1, 0);
+		int j = dir_block_view(block_num).find(name);
+		if (j == -1)
+			return 0;
+		return block_offset(block_num) + j * sizeof(DirEntry);
+	}
+
+	for (int i = 0; ; i++) {
+		int block_num = block_of(*dir_inode, i);
+		if (block_num == 0)
+			break;
+		timer.add(1, 0);
+		int j = dir_block_view(block_num).find(name);
+		if (j != -1) {
+			if (slot != NULL)
+				*slot = i * max_entries + j;
+			return block_offset(block_num) + j * sizeof(DirEntry);
+		}
+	}
+	return 0;
+}
+
+int FileSystem::dir_entry_add(int inode_num, DirEntry entry) {
+	StatsTimer timer(*stats, Stats::DIR_ENTRY_ADD);
+	Inode dir_inode;
+	object_read(inode_offset(inode_num), &dir_inode);
+	if (dir_inode.flags & Inode::INDEXED)
+		return dir_index_add(inode_num, dir_inode, entry);
+
+	// Slots before the hint are known to be in use
+	int max_entries = sb.block_size / sizeof(DirEntry);
+	for (int slot = dir_inode.slot_hint; ; slot++) {
+		int logical = slot / max_entries;
+		int block_num = block_of(dir_inode, logical);
+		if (block_num == 0) {
+			// Directory outgrows its first block, switch to hashed layout
+			if (logical == 1 && (sb.features & FEATURE_DIR_INDEX) && dir_index_limit() >= 2) {
+				if (dir_index_create(inode_num, dir_inode) != SUCCESS)
+					return FAILED;
+				return dir_index_add(inode_num, dir_inode, entry);
+			}
+			block_num = block_map(inode_num, dir_inode, logical);
+			if (block_num == 0)
+				return FAILED;
+		}
+
+		long long entry_offset = block_offset(block_num) + (slot % max_entries) * sizeof(DirEntry);
+		if (object_view<DirEntry>(entry_offset)->name[0] != '\0')
+			continue;
+
+		object_write(entry_offset, entry);
+		dir_inode.slot_hint = slot + 1;
+		object_write(inode_offset(inode_num), dir_inode);
+		return SUCCESS;
+	}
+}
+
+int FileSystem::dir_entry_remove(int inode_num, const char* name) {
+	int slot = -1;
+	long long entry_offset = dir_entry_find(inode_num, name, &slot);
 	if (entry_offset == 0)
 		return FAILED;
 	object_write(entry_offset, DirEntry());
 
+	if (slot == -1)
+		return SUCCESS;
+	Inode dir_inode;
+	object_read(inode_offset(inode_num), &dir_inode);
+	if (slot < dir_inode.slot_hint) {
+		dir_inode.slot_hint = slot;
+		object_write(inode_offset(inode_num), dir_inode);
+	}
+	return SUCCESS;
+}
+
+
+uint32_t FileSystem::dir_hash(const char* name) {
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (const char* c = name; *c != '\0'; c++) {
+		hash ^= (unsigned char) *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+int FileSystem::dir_index_limit() {
+	return (int) ((sb.block_size - 2 * sizeof(DirEntry) - sizeof(DirIndexRoot)) / sizeof(DirIndexEntry));
+}
+
+int FileSystem::dir_index_search(long long root_offset, uint32_t hash) {
+	// Last index entry with a lower bound not above the hash
+	DirIndexRoot root;
+	object_read(root_offset, &root);
+	int low = 0;
+	int high = root.count - 1;
+	while (low < high) {
+		int mid = (low + high + 1) / 2;
+		DirIndexEntry current;
+		object_read(root_offset + sizeof(DirIndexRoot) + mid * sizeof(DirIndexEntry), &current);
+		if (current.hash <= hash)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return low;
+}
+
+int FileSystem::dir_index_create(int inode_num, Inode& dir_inode) {
+	// Only a directory with a single linear block is converted
+	int root_block = block_of(dir_inode, 0);
+	int max_entries = sb.block_size / sizeof(DirEntry);
+	vector<DirEntry> entries;
+	for (int j = 0; j < max_entries; j++) {
+		DirEntry current;
+		object_read(block_offset(root_block) + j * sizeof(DirEntry), &current);
+		if (current.name[0] == '\0' || strcmp(current.name, ".") == 0 || strcmp(current.name, "..") == 0)
+			continue;
+		entries.push_back(current);
+	}
+
+	int leaf_block = block_map(inode_num, dir_inode, 1);
+	if (leaf_block == 0)
+		return FAILED;
+	for (size_t j = 0; j < entries.size(); j++)
+		object_write(block_offset(leaf_block) + j * sizeof(DirEntry), entries[j]);
+
+	// "." and ".." are always the first two entries
+	DirEntry self, parent;
+	object_read(block_offset(root_block), &self);
+	object_read(block_offset(root_block) + sizeof(DirEntry), &parent);
+
+	vector<char> zeros(sb.block_size, 0);
+	block_write(root_block, zeros.data());
+	object_write(block_offset(root_block), self);
+	object_write(block_offset(root_block) + sizeof(DirEntry), parent);
+
+	long long root_offset = block_offset(root_block) + 2 * sizeof(DirEntry);
+	DirIndexRoot root;
+	root.count = 1;
+	root.limit = dir_index_limit();
+	object_write(root_offset, root);
+	object_write(root_offset + sizeof(DirIndexRoot), DirIndexEntry(0, 1));
+
+	dir_inode.flags |= Inode::INDEXED;
+	dir_inode.slot_hint = 0;
+	object_write(inode_offset(inode_num), dir_inode);
+	return SUCCESS;
+}
+
+int FileSystem::dir_index_add(int inode_num, Inode& dir_inode, DirEntry entry) {
+	int max_entries = sb.block_size / sizeof(DirEntry);
+	long long root_offset = block_offset(block_of(dir_inode, 0)) + 2 * sizeof(DirEntry);
+	uint32_t hash = dir_hash(entry.name);
+	int index = dir_index_search(root_offset, hash);
+
+	DirIndexEntry leaf;
+	object_read(root_offset + sizeof(DirIndexRoot) + index * sizeof(DirIndexEntry), &leaf);
+	int leaf_block = block_of(dir_inode, leaf.block);
+	DirSpan leaf_entries = dir_block_view(leaf_block);
+	for (int j = 0; j < leaf_entries.count; j++) {
+		if (leaf_entries.entries[j].name[0] == '\0') {
+			object_write(block_offset(leaf_block) + j * sizeof(DirEntry), entry);
+			return SUCCESS;
+		}
+	}
+
+	// Leaf is full, split it in half by hash
+	DirIndexRoot root;
+	object_read(root_offset, &root);
+	if (root.count >= root.limit)
+		return FAILED;
+
+	vector<pair<uint32_t, DirEntry>> entries;
+	for (int j = 0; j < leaf_entries.count; j++)
+		entries.push_back(make_pair(dir_hash(leaf_entries.entries[j].name), leaf_entries.entries[j]));
+	entries.push_back(make_pair(hash, entry));
+	stable_sort(entries.begin(), entries.end(),
+		[](const pair<uint32_t, DirEntry>& a, const pair<uint32_t, DirEntry>& b) { return a.first < b.first; });
+
+	// Names with equal hash must stay in the same leaf
+	int half = (int) entries.size() / 2;
+	while (half < (int) entries.size() && entries[half - 1].first == entries[half].first)
+		half++;
+	if (half == (int) entries.size()) {
+		half = (int) entries.size() / 2;
+		while (half > 0 && entries[half - 1].first == entries[half].first)
+			half--;
+	}
+	if (half == 0 || half > max_entries || (int) entries.size() - half > max_entries)
+		return FAILED;
+
+	int new_logical = root.count + 1;
+	int new_block = block_map(inode_num, dir_inode, new_logical);
+	if (new_block == 0)
+		return FAILED;
+
+	vector<char> zeros(sb.block_size, 0);
+	block_write(leaf_block, zeros.data());
+	for (int j = 0; j < half; j++)
+		object_write(block_offset(leaf_block) + j * sizeof(DirEntry), entries[j].second);
+	for (int j = half; j < (int) entries.size(); j++)
+		object_write(block_offset(new_block) + (j - half) * sizeof(DirEntry), entries[j].second);
+
+	for (int i = root.count; i > index + 1; i--) {
+		DirIndexEntry current;
+		object_read(root_offset + sizeof(DirIndexRoot) + (i - 1) * sizeof(DirIndexEntry), &current);
+		object_write(root_offset + sizeof(DirIndexRoot) + i * sizeof(DirIndexEntry), current);
+	}
+	object_write(root_offset + sizeof(DirIndexRoot) + (index + 1) * sizeof(DirIndexEntry), DirIndexEntry(entries[half].first, new_logical));
+	root.count++;
+	object_write(root_offset, root);
+	return SUCCESS;
+}
+
+int FileSystem::inode_of(string path, int parent_inode) {
+	StatsTimer timer(*stats, Stats::INODE_OF);
+
+	// Walk the path one name at a time, an empty name starts over from the root
+	int inode_num = parent_inode;
+	size_t start = 0;
+	while (true) {
+		size_t end = path.find('/', start);
+		if (end == string::npos)
+			end = path.size();
+		string filename = path.substr(start, end - start);
+
+		if (filename == "") {
+			inode_num = inode_root;
+		} else {
+			// Free inodes are cleared, dir_lookup checks the type under the lock. The
+			// bitmap is not read here, its bytes are shared with the neighbouring inodes.
+			ReadLock parent_lock = inode_read_lock(inode_num);
+			inode_num = dir_lookup(inode_num, filename);
+			unlock(parent_lock);
+			if (inode_num == 0)
+				return 0;
+		}
+
+		if (end >= path.size() || end + 1 == path.size())
+			return inode_num;
+		start = end + 1;
+	}
+}
+
+int FileSystem::dir_lookup(int parent_inode, const string& name) {
+	// The caller holds the lock of the directory
+	if (!dir_open(parent_inode))
+		return 0;
+
+	int inode_num = dentry_lookup(parent_inode, name);
+	if (inode_num == -1) {
+		inode_num = 0;
+		long long entry_offset = dir_entry_find(parent_inode, name.c_str());
+		if (entry_offset != 0)
+			inode_num = object_view<DirEntry>(entry_offset)->inode;
+		dentry_insert(parent_inode, name, inode_num);
+	}
+	return inode_num;
+}
+
+int FileSystem::dir_entries(int inode_num, vector<DirEntry>* entries, int limit) {
+	// The caller holds the lock of the directory. Counts entries other than "." and
+	// "..", up to limit, and copies them if entries is not NULL.
+	const Inode* dir_inode = inode_view(inode_num);
+	if (dir_inode == NULL || dir_inode->file_type != Inode::DIRECTORY)
+		return 0;
+	int count = 0;
+	for (int i = 0; count < limit; i++) {
+		int block_num = block_of(*dir_inode, i);
+		if (block_num == 0)
+			break;
+
+		// Index root follows "." and ".." in the first block
+		DirSpan span = dir_block_view(block_num);
+		if (i == 0 && (dir_inode->flags & Inode::INDEXED))
+			span.count = min(span.count, 2);
+		for (int j = 0; j < span.count && count < limit; j++) {
+			const DirEntry& entry = span.entries[j];
+			if (entry.inode == 0 || strcmp(entry.name, ".") == 0 || strcmp(entry.name, "..") == 0)
+				continue;
+			if (entries != NULL)
+				entries->push_back(entry);
+			count++;
+		}
+	}
+	return count;
+}
+
+bool FileSystem::dir_contains(int dir_inode_num, int inode_num) {
+	// Follow ".." up to the root, at most once per inode in case the tree is broken
+	for (int i = 0; i < sb.inodes_count; i++) {
+		if (inode_num == dir_inode_num)
+			return true;
+		if (inode_num == inode_root)
+			return false;
+		ReadLock inode_lock = inode_read_lock(inode_num);
+		int parent_inode = dir_lookup(inode_num, "..");
+		if (parent_inode == 0 || parent_inode == inode_num)
+			return false;
+		inode_num = parent_inode;
+	}
+	return false;
+}
+
+int FileSystem::blocks_free_all(int inode_num) {
+	Inode inode;
+	object_read(inode_offset(inode_num), &inode);
+
+	if (inode.flags & Inode::EXTENTS) {
+		vector<Extent> extents;
+		vector<int> tree_blocks;
+		inode_extents(inode, extents, &tree_blocks);
+		for (size_t i = 0; i < extents.size(); i++)
+			blocks_free_run(extents[i].physical, extents[i].length);
+		for (size_t i = 0; i < tree_blocks.size(); i++)
+			blocks_free_run(tree_blocks[i], 1);
+		return SUCCESS;
+	}
+
+	for (int i = 0; i < Inode::direct_blocks_count; i++) {
+		int block_num = inode.direct_blocks[i];
+		if (block_num != 0)
+			blocks_free_run(block_num, 1);
+	}
+	if (inode.indirect_block != 0) {
+		for (int i = 0; i < sb.block_size / (int) sizeof(int); i++) {
+			int block_num = 0;
+			object_read(block_offset(inode.indirect_block) + i * sizeof(int), &block_num);
+			if (block_num != 0)
+				blocks_free_run(block_num, 1);
+		}
+		blocks_free_run(inode.indirect_block, 1);
+	}
+	return SUCCESS;
+}
+
+int FileSystem::blocks_free_run(int block_num, int count) {
+	// Shared blocks only lose a reference
+	MutexLock refs_lock;
+	if (sb.refcount_blocks > 0)
+		refs_lock = mutex_lock(locks->refcounts);
+	MutexLock alloc_lock;
+	int locked_group = -1;
+	for (int i = 0; i < count; i++) {
+		if (block_refs(block_num + i) > 0) {
+			block_refs_add(block_num + i, -1);
+			continue;
+		}
+		// A run may cross into the next group
+		int group = (block_num + i) / sb.blocks_per_group;
+		if (group != locked_group) {
+			unlock(alloc_lock);
+			alloc_lock = group_lock(locks->block_groups, group);
+			locked_group = group;
+		}
+		bit_write(block_offset(sb.block_bitmap), block_num + i, UNUSED);
+	}
+	return SUCCESS;
+}
+
+Inode FileSystem::inode_init(int file_type) {
+	Inode inode(file_type);
+	if (sb.features & FEATURE_EXTENTS) {
+		inode.flags |= Inode::EXTENTS;
+		inode.extent_header()->max = Inode::root_extents_count;
+	}
+	return inode;
+}
+
+int FileSystem::inode_alloc(const Inode& inode, int parent_inode) {
+	int goal_group = group_of_inode(inode.file_type, parent_inode);
+	int inode_num = -1;
+	for (int i = 0; i < sb.groups_count && inode_num == -1; i++) {
+		int group = (goal_group + i) % sb.groups_count;
+		if (group_read(group, offsetof(GroupDesc, free_inodes_count)) == 0)
+			continue;
+		MutexLock alloc_lock = group_lock(locks->inode_groups, group);
+		int first = group * sb.inodes_per_group;
+		int last = min(first + sb.inodes_per_group, sb.inodes_count);
+		inode_num = bit_unused(block_offset(sb.inode_bitmap), first, last, atomic_load32(&inode_hints[group]));
+		if (inode_num == -1)
+			continue;
+		bit_write(block_offset(sb.inode_bitmap), inode_num, USED);
+		atomic_store32(&inode_hints[group], inode_num + 1);
+		if (inode.file_type == Inode::DIRECTORY)
+			group_add(group, offsetof(GroupDesc, used_dirs_count), 1);
+	}
+	if (inode_num == -1)
+		return 0;
+
+	object_write(inode_offset(inode_num), inode);
+	return inode_num;
+}
+
+void FileSystem::inode_free(int inode_num) {
+	Inode inode;
+	object_read(inode_offset(inode_num), &inode);
+	// Cleared so a lookup that raced with the removal sees no file
+	object_write(inode_offset(inode_num), Inode(Inode::UNKNOWN));
+	int group = inode_num / sb.inodes_per_group;
+	MutexLock alloc_lock = group_lock(locks->inode_groups, group);
+	bit_write(block_offset(sb.inode_bitmap), inode_num, UNUSED);
+	if (inode.file_type == Inode::DIRECTORY)
+		group_add(group, offsetof(GroupDesc, used_dirs_count), -1);
+}
+
+void FileSystem::dir_mark_removed(int inode_num) {
+	// The caller holds the write lock of the directory
+	Inode inode;
+	object_read(inode_offset(inode_num), &inode);
+	inode.flags |= Inode::REMOVED;
+	object_write(inode_offset(inode_num), inode);
+}
+
+FileSystem::DentryShard& FileSystem::dentry_shard(int parent_inode, const string& name) {
+	// Names of one large directory spread over all shards
+	uint32_t hash = fnv1a32(name.data(), name.size(), fnv1a32(&parent_inode, sizeof(parent_inode)));
+	return dentry_shards[hash % dentry_shards_count];
+}
+
+void FileSystem::dentry_clear() {
+	for (int i = 0; i < dentry_shards_count; i++) {
+		dentry_shards[i].dirs.clear();
+		dentry_shards[i].size = 0;
+	}
+}
+
+int FileSystem::dentry_lookup(int parent_inode, const string& name) {
+	DentryShard& shard = dentry_shard(parent_inode, name);
+	ReadLock shard_lock = read_lock(shard.lock);
+	auto dir = shard.dirs.find(parent_inode);
+	if (dir == shard.dirs.end())
+		return -1;
+	auto entry = dir->second.find(name);
+	if (entry == dir->second.end())
+		return -1;
+	return entry->second;
+}
+
+void FileSystem::dentry_insert(int parent_inode, const string& name, int inode_num) {
+	DentryShard& shard = dentry_shard(parent_inode, name);
+	WriteLock shard_lock = write_lock(shard.lock);
+	if (shard.size >= dentry_cache_limit / dentry_shards_count) {
+		shard.dirs.clear();
+		shard.size = 0;
+	}
+	auto& dir = shard.dirs[parent_inode];
+	if (dir.find(name) == dir.end())
+		shard.size++;
+	dir[name] = inode_num;
+}
+
+void FileSystem::dentry_invalidate_dir(int inode_num) {
+	// Drop everything cached under an inode that is freed and may be reused
+	for (int i = 0; i < dentry_shards_count; i++) {
+		DentryShard& shard = dentry_shards[i];
+		WriteLock shard_lock = write_lock(shard.lock);
+		auto dir = shard.dirs.find(inode_num);
+		if (dir == shard.dirs.end())
+			continue;
+		shard.size -= (int) dir->second.size();
+		shard.dirs.erase(dir);
+	}
+}
+
+bool FileSystem::tree_parallel(bool read_only) {
+	// Groups and inodes are only locked when operations are concurrent, so are the
+	// frames read on demand
+	return (read_only && !on_demand) || concurrent;
+}
+
+int FileSystem::tree_walk(const TreeEntry& root, const TreeVisit& visit, const TreeLeave& leave, bool parallel) {
+	// The caller holds the disk lock, the workers of the pool run under it
+	ThreadPool* walk_pool = parallel ? &thread_pool() : NULL;
+	WorkQueues<TreeEntry> queues(walk_pool != NULL ? walk_pool->size() : 1);
+	queues.push(0, root);
+	queues.run(walk_pool, [&](int worker, TreeEntry& dir) {
+		// Entries are copied, so the directory is not locked during the visits
+		vector<DirEntry> entries;
+		ReadLock dir_lock = inode_read_lock(dir.inode);
+		dir_entries(dir.inode, &entries);
+		unlock(dir_lock);
+
+		for (size_t i = 0; i < entries.size(); i++) {
+			if (entries[i].inode <= 0 || entries[i].inode >= sb.inodes_count)
+				continue;
+			TreeEntry entry;
+			entry.inode = entries[i].inode;
+			ReadLock inode_lock = inode_read_lock(entry.inode);
+			entry.file_type = inode_type(entry.inode);
+			unlock(inode_lock);
+			entry.depth = dir.depth + 1;
+			entry.context = dir.context;
+			entry.name = entries[i].name;
+			entry.path = dir.path.empty() ? entry.name : dir.path + "/" + entry.name;
+			if (visit(entry) && entry.file_type == Inode::DIRECTORY)
+				queues.push(worker, move(entry));
+		}
+		if (leave)
+			leave(dir);
+	});
+	return SUCCESS;
+}
+
+
+string FileSystem::path_abspath(string fullpath) {
+	ReadLock disk_lock = disk_read_lock();
+	int inode_num = inode_of(fullpath);
+	if (inode_num == 0)
+		return "";
+
+	vector<int> inode_nums = {inode_root};
+	vector<string> dir_names = {""};
+	string filename;
+	string next = fullpath;
+	do {
+		if (next.rfind("/") == string::npos) {
+			filename = next;
+			next = "";
+		} else {
+			filename = next.substr(0, next.find("/"));
+			next = next.substr(next.find("/") + 1);
+		}
+		if (filename == "")
+			continue;
+
+		int current_inode_num = inode_of(filename, inode_nums.back());
+		bool match = false;
+		for (size_t i = 0; i < inode_nums.size(); i++) {
+			if (inode_nums[i] == current_inode_num) {
+				inode_nums.erase(inode_nums.begin() + i + 1, inode_nums.end());
+				dir_names.erase(dir_names.begin() + i + 1, dir_names.end());
+				match = true;
+				break;
+			}
+		}
+		if (!match) {
+			inode_nums.push_back(current_inode_num);
+			dir_names.push_back(filename);
+		}
+	} while (next != "");
+
+	string abspath = "";
+	for (size_t i = 0; i < dir_names.size(); i++)
+		abspath += "/" + dir_names[i];
+	if (abspath.substr(0, 2) == "//")
+		abspath.erase(0, 1);
+
+	return abspath;
+}
+
+int FileSystem::type_of(string fullpath) {
+	ReadLock disk_lock = disk_read_lock();
+	int inode_num = inode_of(fullpath);
+	if (inode_num == 0) 
+		return Inode::UNKNOWN;
+
+	ReadLock inode_lock = inode_read_lock(inode_num);
+	return inode_type(inode_num);
+}
+
+int FileSystem::dir_list(string fullpath) {
+	StatsTimer timer(*stats, Stats::DIR_LIST);
+	ReadLock disk_lock = disk_read_lock();
+	int inode_num = inode_of(fullpath);
+	if (inode_num == 0) 
+		return NOT_EXIST;
+
+	ReadLock dir_lock = inode_read_lock(inode_num);
+	const Inode& dir_inode = *inode_view(inode_num);
+	if (dir_inode.file_type == Inode::UNKNOWN)
+		return NOT_EXIST;
+	if (dir_inode.file_type != Inode::DIRECTORY)
+		return NOT_DIR;
+
+    cout << " " << right << setw(5) << "Inode"
+        << "   " << left << setw(28) << "Name"
+        << "   " << left << setw(10) << "Type"
+        << "   " << left << setw(14) << "Modified Time"
+        << "\n";
+	for (int i = 0; ; i++) {
+		int block_num = block_of(dir_inode, i);
+		if (block_num == 0)
+			break;
+
+		// Index root follows "." and ".." in the first block
+		DirSpan entries = dir_block_view(block_num);
+		if (i == 0 && (dir_inode.flags & Inode::INDEXED))
+			entries.count = min(entries.count, 2);
+		for (int j = 0; j < entries.count; j++) {
+			const DirEntry& entry = entries.entries[j];
+			if (entry.inode == 0)
+				continue;
+            
+			// Children are locked after their parent, "." and ".." are not
+			ReadLock inode_lock;
+			if (strcmp(entry.name, ".") != 0 && strcmp(entry.name, "..") != 0)
+				inode_lock = inode_read_lock(entry.inode);
+			const Inode* inode_ref = inode_view(entry.inode);
+			if (inode_ref == NULL)
+				continue;
+			const Inode& inode = *inode_ref;
+            string file_type;
+            switch(inode.file_type) {
+            case Inode::UNKNOWN: file_type = "Unknown"; break;
+            case Inode::FILE: file_type = "File"; break;
+            case Inode::DIRECTORY: file_type = "Directory"; break;
+            default: file_type = "Unknown"; break;
+            }
+			cout << " " << right << setw(5) << entry.inode
+                << "   " << left << setw(28) << entry.name
+                << "   " << left << setw(10) << file_type
+                << "   " << left << setw(14) << inode.mod_time
+                << "\n";
+		}
+	}
+	return SUCCESS;
+}
+
+int FileSystem::dir_create(string path, string name) {
+	StatsTimer timer(*stats, Stats::DIR_CREATE);
+	ReadLock disk_lock = disk_read_lock();
+	int path_inode_num = inode_of(path);
+	if (path_inode_num == 0)
+		return NOT_EXIST;
+
+	int result = dir_create_at(path_inode_num, name);
+	if (result != SUCCESS)
+		return result;
+	journal_end(disk_lock);
+	return SUCCESS;
+}
+
+int FileSystem::dir_create_at(int path_inode_num, const string& name, int* new_inode_num) {
+	WriteLock path_lock = inode_write_lock(path_inode_num);
+	if (!dir_open(path_inode_num))
+		return NOT_EXIST;
+	if (dir_lookup(path_inode_num, name) != 0)
+		return ALREADY_EXIST;
+
+	int inode_num = inode_alloc(inode_init(Inode::DIRECTORY), path_inode_num);
+	if (inode_num == 0)
+		return FAILED;
+	WriteLock new_lock = inode_write_lock(inode_num);
+	dir_entry_add(inode_num, DirEntry(inode_num, "."));
+	dir_entry_add(inode_num, DirEntry(path_inode_num, ".."));
+
+	if (dir_entry_add(path_inode_num, DirEntry(inode_num, name.c_str())) != SUCCESS) {
+		blocks_free_all(inode_num);
+		inode_free(inode_num);
+		return FAILED;
+	}
+	dentry_insert(path_inode_num, name, inode_num);
+	if (new_inode_num != NULL)
+		*new_inode_num = inode_num;
+	return SUCCESS;
+}
+
+int FileSystem::dir_remove(string path, string name) {
+	StatsTimer timer(*stats, Stats::DIR_REMOVE);
+	if (name == "." || name == "..")
+		return FAILED;
+
+	ReadLock disk_lock = disk_read_lock();
+	int path_inode_num = inode_of(path);
+	if (path_inode_num == 0)
+		return NOT_EXIST;
+
+	WriteLock path_lock = inode_write_lock(path_inode_num);
+	int target_inode_num = dir_lookup(path_inode_num, name);
+	if (target_inode_num == 0)
+		return NOT_EXIST;
+
+	WriteLock target_lock = inode_write_lock(target_inode_num);
+	if (inode_type(target_inode_num) != Inode::DIRECTORY)
+		return NOT_DIR;
+	// The entries would be lost with their inodes and blocks, rm -r frees them
+	if (dir_entries(target_inode_num, NULL, 1) != 0)
+		return NOT_EMPTY;
+
+	if (dir_entry_remove(path_inode_num, name.c_str()) != SUCCESS)
+		return FAILED;
+	blocks_free_all(target_inode_num);
+	inode_free(target_inode_num);
+	dentry_insert(path_inode_num, name, 0);
+	dentry_invalidate_dir(target_inode_num);
+
+	unlock(target_lock);
+	unlock(path_lock);
+	journal_end(disk_lock);
+	return SUCCESS;
+}
+
+int FileSystem::file_create(string path, string name, long long size) {
+	StatsTimer timer(*stats, Stats::FILE_CREATE);
+	ReadLock disk_lock = disk_read_lock();
+	int path_inode_num = inode_of(path);
+	if (path_inode_num == 0)
+		return NOT_EXIST;
+
+	WriteLock path_lock = inode_write_lock(path_inode_num);
+	if (!dir_open(path_inode_num))
+		return NOT_EXIST;
+	if (dir_lookup(path_inode_num, name) != 0)
+		return ALREADY_EXIST;
+
+    Inode new_inode = inode_init(Inode::FILE);
+    new_inode.mod_time = (int) time(0);
+	int new_inode_num = inode_alloc(new_inode, path_inode_num);
+	if (new_inode_num == 0)
+		return FAILED;
+	WriteLock new_lock = inode_write_lock(new_inode_num);
+	if (dir_entry_add(path_inode_num, DirEntry(new_inode_num, name.c_str())) != SUCCESS) {
+		inode_free(new_inode_num);
+		return FAILED;
+	}
+	timer.add((size + sb.block_size - 1) / sb.block_size, size);
+	dentry_insert(path_inode_num, name, new_inode_num);
+
+	// Fill file with random digits
+	srand(new_inode.mod_time);
+	vector<char> content(sb.block_size);
+	for (long long offset = 0; offset < size; offset += sb.block_size) {
+		int length = (int) min<long long>(sb.block_size, size - offset);
+		for (int i = 0; i < length; i++)
+			content[i] = (char) ('0' + rand() % 10);
+		if (inode_write(new_inode_num, offset, length, content.data()) != length) {
+			dir_entry_remove(path_inode_num, name.c_str());
+			dentry_insert(path_inode_num, name, 0);
+			blocks_free_all(new_inode_num);
+			inode_free(new_inode_num);
+			return FAILED;
+		}
+	}
+
+	unlock(new_lock);
+	unlock(path_lock);
+	journal_end(disk_lock);
+	return SUCCESS;
+}
+
+int FileSystem::file_remove(string path, string name) {
+	StatsTimer timer(*stats, Stats::FILE_REMOVE);
+	ReadLock disk_lock = disk_read_lock();
+	int path_inode_num = inode_of(path);
+	if (path_inode_num == 0)
+		return NOT_EXIST;
+
+	WriteLock path_lock = inode_write_lock(path_inode_num);
+	int target_inode_num = dir_lookup(path_inode_num, name);
+	if (target_inode_num == 0)
+		return NOT_EXIST;
+
+	WriteLock target_lock = inode_write_lock(target_inode_num);
+	if (inode_type(target_inode_num) != Inode::FILE)
+		return NOT_FILE;
+
+	blocks_free_all(target_inode_num);
+	inode_free(target_inode_num);
+
+	if (dir_entry_remove(path_inode_num, name.c_str()) != SUCCESS)
+		return FAILED;
+	dentry_insert(path_inode_num, name, 0);
+	dentry_invalidate_dir(target_inode_num);
+
+	unlock(target_lock);
+	unlock(path_lock);
+	journal_end(disk_lock);
+	return SUCCESS;
+}
+
+int FileSystem::file_display(string fullpath) {
+	StatsTimer timer(*stats, Stats::FILE_DISPLAY);
+	ReadLock disk_lock = disk_read_lock();
+	int file_inode_num = inode_of(fullpath);
+	if (file_inode_num == 0)
+		return NOT_EXIST;
+
+	ReadLock file_lock = inode_read_lock(file_inode_num);
+	const Inode& file_inode = *inode_view(file_inode_num);
+	if (file_inode.file_type == Inode::UNKNOWN)
+		return NOT_EXIST;
+	if (file_inode.file_type != Inode::FILE)
+		return NOT_FILE;
+	long long size = file_inode.size();
+	timer.add((size + sb.block_size - 1) / sb.block_size, size);
+
+	// Write runs of contiguous blocks straight from the disk
+	vector<char> zeros;
+	Readahead readahead;
+	for (int logical = 0; (long long) logical * sb.block_size < size; ) {
+		int count = 0;
+		int block_num = block_run(file_inode, logical, &count);
+		long long length = min((long long) max(count, 1) * sb.block_size, size - (long long) logical * sb.block_size);
+		if (on_demand)
+			file_readahead(file_inode, readahead, (long long) logical * sb.block_size, length);
+		if (block_num == 0) {
+			zeros.resize(sb.block_size, 0);
+			cout.write(zeros.data(), (streamsize) length);
+			logical++;
+			continue;
+		}
+		cout.write(disk_at(block_offset(block_num), length), (streamsize) length);
+		logical += count;
+	}
+	cout << "\n";
+
+	return SUCCESS;
+}
+
+int FileSystem::file_copy(string source, string dest_dir, string dest_name) {
+	StatsTimer timer(*stats, Stats::FILE_COPY);
+	ReadLock disk_lock = disk_read_lock();
+	int source_inode_num = inode_of(source);
+	if (source_inode_num == 0)
+		return NOT_EXIST;
+
+	int dest_inode_num = inode_of(dest_dir);
+	if (dest_inode_num == 0)
+		return NOT_EXIST;
+
+	long long size = 0;
+	int result = file_copy_at(source_inode_num, dest_inode_num, dest_name, &size);
+	timer.add((size + sb.block_size - 1) / sb.block_size, size);
+	if (result != SUCCESS)
+		return result;
+	journal_end(disk_lock);
+	return SUCCESS;
+}
+
+int FileSystem::file_copy_at(int source_inode_num, int dest_inode_num, const string& dest_name, long long* size_copied) {
+	if (dest_inode_num == source_inode_num)
+		return NOT_FILE;
+
+	// Destination directory first, the source is a file
+	WriteLock dest_lock = inode_write_lock(dest_inode_num);
+	if (!dir_open(dest_inode_num))
+		return NOT_EXIST;
+	if (dir_lookup(dest_inode_num, dest_name) != 0)
+		return ALREADY_EXIST;
+
+	ReadLock source_lock = inode_read_lock(source_inode_num);
+	Inode source_inode;
+	object_read(inode_offset(source_inode_num), &source_inode);
+	if (source_inode.file_type == Inode::UNKNOWN)
+		return NOT_EXIST;
+	if (source_inode.file_type != Inode::FILE)
+		return NOT_FILE;
+	long long size = source_inode.size();
+	if (size_copied != NULL)
+		*size_copied = size;
+	int new_inode_num = inode_alloc(inode_init(Inode::FILE), dest_inode_num);
+	if (new_inode_num == 0)
+		return FAILED;
+	WriteLock new_lock = inode_write_lock(new_inode_num);
+
+	if (dir_entry_add(dest_inode_num, DirEntry(new_inode_num, dest_name.c_str())) != SUCCESS) {
+		inode_free(new_inode_num);
+		return FAILED;
+	}
+	dentry_insert(dest_inode_num, dest_name, new_inode_num);
+
+	// Share the blocks of the source, or copy them without reference counts
+	if (!(sb.features & FEATURE_REFLINK) || inode_reflink(source_inode_num, new_inode_num) != SUCCESS) {
+		// Copy runs of contiguous blocks, holes stay holes
+		Readahead readahead;
+		for (int logical = 0; (long long) logical * sb.block_size < size; ) {
+			int count = 0;
+			int block_num = block_run(source_inode, logical, &count);
+			if (block_num == 0) {
+				logical++;
+				continue;
+			}
+			count = min(count, max(INT_MAX / sb.block_size, 1));
+			int length = (int) min((long long) count * sb.block_size, size - (long long) logical * sb.block_size);
+			if (on_demand)
+				file_readahead(source_inode, readahead, (long long) logical * sb.block_size, length);
+			if (inode_write(new_inode_num, (long long) logical * sb.block_size, length, disk_at(block_offset(block_num), length)) != length) {
+				dir_entry_remove(dest_inode_num, dest_name.c_str());
+				dentry_insert(dest_inode_num, dest_name, 0);
+				blocks_free_all(new_inode_num);
+				inode_free(new_inode_num);
+				return FAILED;
+			}
+			logical += count;
+		}
+		inode_truncate(new_inode_num, size);
+	}
 	return SUCCESS;
 }
 
-int FileSystem::file_display(string fullpath) {
-	int file_inode_num = inode_of(fullpath);
-	if (file_inode_num == 0)
+int FileSystem::tree_remove(string path, string name) {
+	StatsTimer timer(*stats, Stats::TREE_REMOVE);
+	if (name == "." || name == "..")
+		return FAILED;
+
+	ReadLock disk_lock = disk_read_lock();
+	int path_inode_num = inode_of(path);
+	if (path_inode_num == 0)
 		return NOT_EXIST;
 
-	Inode file_inode;
-	object_read(sb.inode_table * sb.block_size + file_inode_num * sizeof(Inode), &file_inode);
-	if (file_inode.file_type != Inode::FILE)
-		return NOT_FILE;
+	WriteLock path_lock = inode_write_lock(path_inode_num);
+	int target_inode_num = dir_lookup(path_inode_num, name);
+	if (target_inode_num == 0)
+		return NOT_EXIST;
 
-	// ! Display file content!!!
-	// ! WARNING: THIS IS BLACK MAGIC
-	srand(file_inode.mod_time);
-	for (int i = 0; i < file_inode.size; i++)
-		cout << (rand() % 10);
-	cout << endl;
+	WriteLock target_lock = inode_write_lock(target_inode_num);
+	int target_type = inode_type(target_inode_num);
+	if (target_type == Inode::UNKNOWN)
+		return NOT_EXIST;
 
+	// Unlinked first, nothing below can be found by name while it is freed
+	if (dir_entry_remove(path_inode_num, name.c_str()) != SUCCESS)
+		return FAILED;
+	dentry_insert(path_inode_num, name, 0);
+	unlock(path_lock);
+	if (target_type == Inode::DIRECTORY)
+		dir_mark_removed(target_inode_num);
+	if (target_type == Inode::FILE) {
+		timer.add(0, inode_view(target_inode_num)->size());
+		blocks_free_all(target_inode_num);
+		inode_free(target_inode_num);
+		unlock(target_lock);
+		journal_end(disk_lock);
+		return SUCCESS;
+	}
+	unlock(target_lock);
+
+	// Files are freed when visited, a directory once its entries are read. A directory is
+	// marked when visited, before its entries are read, so a create that found it by a path
+	// from before the unlink adds nothing the walk would miss.
+	uint64_t bytes = 0;
+	TreeEntry root;
+	root.inode = target_inode_num;
+	root.file_type = Inode::DIRECTORY;
+	tree_walk(root, [&](TreeEntry& entry) {
+		if (entry.file_type != Inode::FILE) {
+			WriteLock inode_lock = inode_write_lock(entry.inode);
+			if (inode_type(entry.inode) == Inode::DIRECTORY)
+				dir_mark_removed(entry.inode);
+			return true;
+		}
+		WriteLock inode_lock = inode_write_lock(entry.inode);
+		if (inode_type(entry.inode) == Inode::FILE) {
+			atomic_add64(&bytes, (uint64_t) inode_view(entry.inode)->size());
+			blocks_free_all(entry.inode);
+			inode_free(entry.inode);
+		}
+		return false;
+	}, [&](const TreeEntry& dir) {
+		WriteLock inode_lock = inode_write_lock(dir.inode);
+		if (inode_type(dir.inode) != Inode::DIRECTORY)
+			return;
+		blocks_free_all(dir.inode);
+		inode_free(dir.inode);
+		unlock(inode_lock);
+		dentry_invalidate_dir(dir.inode);
+	}, tree_parallel(false));
+	timer.add(0, bytes);
+
+	journal_end(disk_lock);
 	return SUCCESS;
 }
 
-int FileSystem::file_copy(string source, string dest_dir, string dest_name) {
+int FileSystem::tree_copy(string source, string dest_dir, string dest_name) {
+	StatsTimer timer(*stats, Stats::TREE_COPY);
+	ReadLock disk_lock = disk_read_lock();
 	int source_inode_num = inode_of(source);
 	if (source_inode_num == 0)
 		return NOT_EXIST;
-
 	int dest_inode_num = inode_of(dest_dir);
 	if (dest_inode_num == 0)
 		return NOT_EXIST;
 
-	int new_inode_num = inode_of(dest_name, dest_inode_num);
-	if (new_inode_num != 0)
-		return ALREADY_EXIST;
+	ReadLock source_lock = inode_read_lock(source_inode_num);
+	int source_type = inode_type(source_inode_num);
+	unlock(source_lock);
+	if (source_type == Inode::UNKNOWN)
+		return NOT_EXIST;
 
-	Inode source_inode;
-	object_read(sb.inode_table * sb.block_size + source_inode_num * sizeof(Inode), &source_inode);
-	new_inode_num = bit_unused(sb.inode_bitmap * sb.block_size, sb.inodes_count);
-	bit_write(sb.inode_bitmap * sb.block_size, new_inode_num, USED);
-	object_write(sb.inode_table * sb.block_size + new_inode_num * sizeof(Inode), source_inode);
+	uint64_t bytes = 0;
+	int result = SUCCESS;
+	if (source_type == Inode::FILE) {
+		long long size = 0;
+		result = file_copy_at(source_inode_num, dest_inode_num, dest_name, &size);
+		bytes = (uint64_t) size;
+	} else if (dir_contains(source_inode_num, dest_inode_num)) {
+		// A copy inside the source would be walked while it grows
+		result = FAILED;
+	} else {
+		TreeEntry root;
+		root.inode = source_inode_num;
+		root.file_type = Inode::DIRECTORY;
+		result = dir_create_at(dest_inode_num, dest_name, &root.context);
+		if (result == SUCCESS) {
+			// The context of an entry is the directory it is copied into
+			int failed = 0;
+			tree_walk(root, [&](TreeEntry& entry) {
+				if (entry.file_type == Inode::DIRECTORY) {
+					int dir_inode_num = 0;
+					if (dir_create_at(entry.context, entry.name, &dir_inode_num) != SUCCESS) {
+						atomic_store32(&failed, 1);
+						return false;
+					}
+					entry.context = dir_inode_num;
+					return true;
+				}
+				long long size = 0;
+				if (entry.file_type == Inode::FILE && file_copy_at(entry.inode, entry.context, entry.name, &size) != SUCCESS)
+					atomic_store32(&failed, 1);
+				atomic_add64(&bytes, (uint64_t) size);
+				return false;
+			}, NULL, tree_parallel(false));
+			if (atomic_load32(&failed) != 0)
+				result = FAILED;
+		}
+	}
+	timer.add((bytes + sb.block_size - 1) / sb.block_size, bytes);
+
+	// Whatever was copied before a failure stays
+	journal_end(disk_lock);
+	return result;
+}
+
+int FileSystem::tree_usage(string fullpath) {
+	StatsTimer timer(*stats, Stats::TREE_USAGE);
+	ReadLock disk_lock = disk_read_lock();
+	int inode_num = inode_of(fullpath);
+	if (inode_num == 0)
+		return NOT_EXIST;
+
+	// Blocks shared by reflinked copies count once for every file
+	uint64_t counts[4] = {0};   // Files, directories, bytes, blocks
+	auto count_inode = [&](int entry_inode_num) {
+		ReadLock inode_lock = inode_read_lock(entry_inode_num);
+		Inode inode;
+		object_read(inode_offset(entry_inode_num), &inode);
+		if (inode.file_type == Inode::UNKNOWN)
+			return;
+		vector<Extent> extents;
+		vector<int> tree_blocks;
+		inode_extents(inode, extents, &tree_blocks);
+		uint64_t blocks = tree_blocks.size();
+		for (size_t i = 0; i < extents.size(); i++)
+			blocks += extents[i].length;
+		atomic_add64(&counts[inode.file_type == Inode::FILE ? 0 : 1], 1);
+		if (inode.file_type == Inode::FILE)
+			atomic_add64(&counts[2], (uint64_t) inode.size());
+		atomic_add64(&counts[3], blocks);
+	};
+	count_inode(inode_num);
+	if (counts[0] + counts[1] == 0)
+		return NOT_EXIST;
+
+	if (counts[1] > 0) {
+		TreeEntry root;
+		root.inode = inode_num;
+		root.file_type = Inode::DIRECTORY;
+		tree_walk(root, [&](TreeEntry& entry) {
+			count_inode(entry.inode);
+			return true;
+		}, NULL, tree_parallel(true));
+	}
+	timer.add(counts[3], counts[2]);
+
+	cout << "Files: " << counts[0] << "\n";
+	cout << "Directories: " << counts[1] << "\n";
+	cout << "Size: " << counts[2] << "\n";
+	cout << "Blocks: " << counts[3] << " (" << counts[3] * sb.block_size << " bytes)\n";
+	return SUCCESS;
+}
+
+// Shell wildcards, * matches any run of characters and ? any one character
+static bool name_match(const char* pattern, const char* name) {
+	const char* star = NULL;
+	const char* resume = NULL;
+	while (*name != '\0') {
+		if (*pattern == '*') {
+			star = pattern++;
+			resume = name;
+		} else if (*pattern == '?' || *pattern == *name) {
+			pattern++;
+			name++;
+		} else if (star != NULL) {
+			pattern = star + 1;
+			name = ++resume;
+		} else {
+			return false;
+		}
+	}
+	while (*pattern == '*')
+		pattern++;
+	return *pattern == '\0';
+}
+
+int FileSystem::tree_find(string fullpath, string pattern, int file_type) {
+	StatsTimer timer(*stats, Stats::TREE_FIND);
+	ReadLock disk_lock = disk_read_lock();
+	int inode_num = inode_of(fullpath);
+	if (inode_num == 0)
+		return NOT_EXIST;
+
+	ReadLock inode_lock = inode_read_lock(inode_num);
+	int root_type = inode_type(inode_num);
+	unlock(inode_lock);
+	if (root_type == Inode::UNKNOWN)
+		return NOT_EXIST;
+	if (root_type != Inode::DIRECTORY)
+		return NOT_DIR;
+
+	// Workers finish in any order, matches are sorted before they are printed
+	mutex matches_lock;
+	vector<string> matches;
+	TreeEntry root;
+	root.inode = inode_num;
+	root.file_type = Inode::DIRECTORY;
+	tree_walk(root, [&](TreeEntry& entry) {
+		if ((file_type == Inode::UNKNOWN || entry.file_type == file_type) && name_match(pattern.c_str(), entry.name.c_str())) {
+			lock_guard<mutex> guard(matches_lock);
+			matches.push_back(entry.path);
+		}
+		return true;
+	}, NULL, tree_parallel(true));
+
+	sort(matches.begin(), matches.end());
+	string prefix = fullpath == "/" ? "/" : fullpath + "/";
+	for (size_t i = 0; i < matches.size(); i++)
+		cout << prefix << matches[i] << "\n";
+	return SUCCESS;
+}
+
+// Findings of one range of the inode table or one batch of directories, merged after each pass
+struct FileSystem::CheckScan {
+	uint64_t inodes = 0;
+	uint64_t blocks = 0;   // Every owner of a block counts
+	uint64_t entries = 0;
+	vector<int> dirs;
+	vector<int> bad_types;
+	vector<int> bad_blocks;   // Inodes mapping blocks outside the data area
+	vector<pair<int, int>> shared;   // Block and inode, for every owner after the first
+	vector<pair<int, int>> links;   // Inode and directory of every entry
+	vector<pair<int, string>> dangling;   // Directory and name of entries to free inodes
+	vector<pair<int, int>> dotdots;   // Directory and the inode of its "..", -1 if missing
+	vector<int> bad_dots;
+	vector<Extent> runs;
+};
+
+// Bitmaps of the check are in the order of the disk, the first block is the highest bit
+static inline uint64_t check_bit(int bit) {
+	return 1ULL << (63 - bit % 64);
+}
+
+// Blocks of an inode are owned only if all of them, the blocks of its mapping included,
+// are in the data area. Blocks already owned by another inode are recorded as shared.
+bool FileSystem::check_inode(int inode_num, vector<uint64_t>& owned, CheckScan& scan) {
+	const Inode& inode = *inode_view(inode_num);
+	int first_data_block = data_block_first();
+	vector<Extent>& runs = scan.runs;
+	runs.clear();
+	bool valid = true;
+	if (inode.flags & Inode::EXTENTS) {
+		const ExtentHeader* header = inode.extent_header();
+		valid = header->depth >= 0 && header->depth <= extent_depth_max && header->entries >= 0 && header->entries <= Inode::root_extents_count;
+		// Nodes below the root with the depth their parent gives them. A tree that names
+		// more blocks than the disk has points to some of them more than once.
+		vector<pair<int, int>> nodes;
+		for (int i = 0; valid && i < header->entries; i++) {
+			const Extent& entry = inode.extents()[i];
+			if (header->depth == 0)
+				runs.push_back(entry);
+			else
+				nodes.push_back(make_pair(entry.physical, header->depth - 1));
+		}
+		while (valid && !nodes.empty()) {
+			int block_num = nodes.back().first;
+			int depth = nodes.back().second;
+			nodes.pop_back();
+			valid = block_num >= first_data_block && block_num < sb.blocks_count && runs.size() < (size_t) sb.blocks_count;
+			if (!valid)
+				break;
+			runs.push_back(Extent(0, block_num, 1));
+			const ExtentHeader* node = (const ExtentHeader*) disk_at(block_offset(block_num), sb.block_size);
+			valid = node->depth == depth && node->entries >= 0 && node->entries <= extent_leaf_max();
+			const Extent* node_entries = (const Extent*) (node + 1);
+			for (int j = 0; valid && j < node->entries; j++) {
+				if (depth == 0)
+					runs.push_back(node_entries[j]);
+				else
+					nodes.push_back(make_pair(node_entries[j].physical, depth - 1));
+			}
+		}
+	} else {
+		for (int i = 0; i < Inode::direct_blocks_count; i++) {
+			if (inode.direct_blocks[i] != 0)
+				runs.push_back(Extent(i, inode.direct_blocks[i], 1));
+		}
+		if (inode.indirect_block != 0) {
+			valid = inode.indirect_block >= first_data_block && inode.indirect_block < sb.blocks_count;
+			if (valid) {
+				runs.push_back(Extent(0, inode.indirect_block, 1));
+				const int* pointers = (const int*) disk_at(block_offset(inode.indirect_block), sb.block_size);
+				for (int i = 0; i < sb.block_size / (int) sizeof(int); i++) {
+					if (pointers[i] != 0)
+						runs.push_back(Extent(Inode::direct_blocks_count + i, pointers[i], 1));
+				}
+			}
+		}
+	}
+	for (size_t i = 0; valid && i < runs.size(); i++)
+		valid = runs[i].length > 0 && runs[i].physical >= first_data_block && (long long) runs[i].physical + runs[i].length <= sb.blocks_count;
+	if (!valid) {
+		scan.bad_blocks.push_back(inode_num);
+		return false;
+	}
+
+	// Runs are marked a word at a time, bits that were set already have another owner
+	for (size_t i = 0; i < runs.size(); i++) {
+		long long block_num = runs[i].physical;
+		long long end = block_num + runs[i].length;
+		while (block_num < end) {
+			int first = (int) (block_num % 64);
+			int last = (int) min<long long>(64, first + end - block_num);
+			uint64_t bits = (~0ULL >> first) & (last == 64 ? ~0ULL : ~(~0ULL >> last));
+			uint64_t twice = atomic_or64(&owned[block_num / 64], bits) & bits;
+			while (twice != 0) {
+				int bit = clz64(twice);
+				scan.shared.push_back(make_pair((int) (block_num - first + bit), inode_num));
+				twice &= ~(1ULL << (63 - bit));
+			}
+			block_num += last - first;
+		}
+		scan.blocks += runs[i].length;
+	}
+	return true;
+}
+
+// Entries of a directory. "." and ".." are the first two slots of its first block.
+void FileSystem::check_dir(int inode_num, const vector<uint64_t>& in_use, CheckScan& scan) {
+	DirSpan span = dir_block_view(block_of(*inode_view(inode_num), 0));
+	if (span.count < 2 || strcmp(span.entries[0].name, ".") != 0 || span.entries[0].inode != inode_num)
+		scan.bad_dots.push_back(inode_num);
+	int dotdot = span.count >= 2 && strcmp(span.entries[1].name, "..") == 0 ? span.entries[1].inode : -1;
+	scan.dotdots.push_back(make_pair(inode_num, dotdot));
+
+	vector<DirEntry> entries;
+	dir_entries(inode_num, &entries);
+	for (size_t i = 0; i < entries.size(); i++) {
+		int target = entries[i].inode;
+		if (target <= 0 || target >= sb.inodes_count || !(in_use[target / 64] & check_bit(target)))
+			scan.dangling.push_back(make_pair(inode_num, string(entries[i].name, strnlen(entries[i].name, sizeof(entries[i].name)))));
+		else
+			scan.links.push_back(make_pair(target, inode_num));
+	}
+	scan.entries += entries.size();
+}
+
+// Copy of a block for one of the inodes that map it, on disks without reference counts
+int FileSystem::block_clone(int inode_num, int block_num) {
+	Inode inode;
+	object_read(inode_offset(inode_num), &inode);
+	vector<Extent> extents;
+	inode_extents(inode, extents);
+	for (size_t i = 0; i < extents.size(); i++) {
+		if (block_num < extents[i].physical || block_num >= extents[i].physical + extents[i].length)
+			continue;
+		// Only directories are journaled, the copy of file data is not
+		bool journaled = inode.file_type == Inode::DIRECTORY;
+		int new_block_num = block_alloc(block_goal(inode_num), journaled);
+		if (new_block_num == 0)
+			return FAILED;
+		if (journaled)
+			block_write(new_block_num, disk_at(block_offset(block_num), sb.block_size));
+		else
+			data_write(block_offset(new_block_num), disk_at(block_offset(block_num), sb.block_size), sb.block_size);
+		if (block_set(inode_num, inode, extents[i].logical + block_num - extents[i].physical, new_block_num) != SUCCESS) {
+			blocks_free_run(new_block_num, 1);
+			return FAILED;
+		}
+		return SUCCESS;
+	}
+	// Blocks of the mapping itself are not copied
+	return FAILED;
+}
+
+int FileSystem::check(bool repair, int* problems_found) {
+	StatsTimer timer(*stats, Stats::CHECK);
+	WriteLock disk_lock = write_lock(locks->disk);
+	int first_data_block = data_block_first();
+	int problems = 0;
+	int unrepaired = 0;
+	if (problems_found != NULL)
+		*problems_found = 0;
+	if (inode_type(inode_root) != Inode::DIRECTORY) {
+		cout << "Root directory is missing\n";
+		if (problems_found != NULL)
+			*problems_found = 1;
+		return INCONSISTENT;
+	}
+
+	// Ranges and batches run on the pool when the frames read on demand are locked
+	ThreadPool* check_pool = tree_parallel(true) ? &thread_pool() : NULL;
+	auto run = [&](int count, const function<void(int)>& body) {
+		if (check_pool != NULL) {
+			check_pool->for_each(count, body);
+			return;
+		}
+		for (int i = 0; i < count; i++)
+			body(i);
+	};
+
+	// Pass 1: inodes in use and the blocks they own. Ranges are whole words of in_use,
+	// blocks are shared by all of them.
+	vector<uint64_t> owned((sb.blocks_count + 63) / 64, 0);
+	vector<uint64_t> in_use((sb.inodes_count + 63) / 64, 0);
+	vector<CheckScan> ranges((sb.inodes_count + check_range - 1) / check_range);
+	run((int) ranges.size(), [&](int r) {
+		CheckScan& scan = ranges[r];
+		int last = min(sb.inodes_count, (r + 1) * check_range);
+		for (int inode_num = r * check_range; inode_num < last; inode_num++) {
+			int file_type = inode_view(inode_num)->file_type;
+			if (file_type == Inode::UNKNOWN)
+				continue;
+			if (file_type != Inode::FILE && file_type != Inode::DIRECTORY) {
+				scan.bad_types.push_back(inode_num);
+				continue;
+			}
+			if (!check_inode(inode_num, owned, scan))
+				continue;
+			in_use[inode_num / 64] |= check_bit(inode_num);
+			scan.inodes++;
+			if (file_type == Inode::DIRECTORY)
+				scan.dirs.push_back(inode_num);
+		}
+	});
+	CheckScan inodes;
+	for (size_t i = 0; i < ranges.size(); i++) {
+		inodes.inodes += ranges[i].inodes;
+		inodes.blocks += ranges[i].blocks;
+		inodes.dirs.insert(inodes.dirs.end(), ranges[i].dirs.begin(), ranges[i].dirs.end());
+		inodes.bad_types.insert(inodes.bad_types.end(), ranges[i].bad_types.begin(), ranges[i].bad_types.end());
+		inodes.bad_blocks.insert(inodes.bad_blocks.end(), ranges[i].bad_blocks.begin(), ranges[i].bad_blocks.end());
+		inodes.shared.insert(inodes.shared.end(), ranges[i].shared.begin(), ranges[i].shared.end());
+	}
+	ranges.clear();
+	if (!(in_use[inode_root / 64] & check_bit(inode_root))) {
+		cout << "Root directory has blocks outside the data area\n";
+		if (problems_found != NULL)
+			*problems_found = 1;
+		return INCONSISTENT;
+	}
+
+	// Pass 2: entries of every directory in use, reachable or not
+	vector<CheckScan> batches((inodes.dirs.size() + check_batch - 1) / check_batch);
+	run((int) batches.size(), [&](int b) {
+		size_t last = min(inodes.dirs.size(), (size_t) (b + 1) * check_batch);
+		for (size_t i = (size_t) b * check_batch; i < last; i++)
+			check_dir(inodes.dirs[i], in_use, batches[b]);
+	});
+	CheckScan dirs;
+	for (size_t i = 0; i < batches.size(); i++) {
+		dirs.entries += batches[i].entries;
+		dirs.links.insert(dirs.links.end(), batches[i].links.begin(), batches[i].links.end());
+		dirs.dangling.insert(dirs.dangling.end(), batches[i].dangling.begin(), batches[i].dangling.end());
+		dirs.dotdots.insert(dirs.dotdots.end(), batches[i].dotdots.begin(), batches[i].dotdots.end());
+		dirs.bad_dots.insert(dirs.bad_dots.end(), batches[i].bad_dots.begin(), batches[i].bad_dots.end());
+	}
+	batches.clear();
+
+	// An inode keeps its entry in the lowest directory, its other entries are extra links.
+	// The root has no entry but its own.
+	sort(dirs.links.begin(), dirs.links.end());
+	vector<int> parent(sb.inodes_count, 0);
+	vector<pair<int, int>> extra_links;   // Directory and inode
+	for (size_t i = 0; i < dirs.links.size(); i++) {
+		int target = dirs.links[i].first;
+		if (target != inode_root && (i == 0 || dirs.links[i - 1].first != target))
+			parent[target] = dirs.links[i].second;
+		else
+			extra_links.push_back(make_pair(dirs.links[i].second, target));
+	}
+	parent[inode_root] = inode_root;
+
+	// Directories reachable from the root. Inodes without an entry are orphans, directories
+	// only linked from each other are cut out of their cycle and become orphans as well.
+	vector<pair<int, int>> children;
+	for (size_t i = 0; i < inodes.dirs.size(); i++) {
+		int inode_num = inodes.dirs[i];
+		if (inode_num != inode_root && parent[inode_num] != 0)
+			children.push_back(make_pair(parent[inode_num], inode_num));
+	}
+	sort(children.begin(), children.end());
+	vector<uint64_t> reached(in_use.size(), 0);
+	auto reach = [&](int dir) {
+		vector<int> stack(1, dir);
+		reached[dir / 64] |= check_bit(dir);
+		while (!stack.empty()) {
+			int inode_num = stack.back();
+			stack.pop_back();
+			auto child = lower_bound(children.begin(), children.end(), make_pair(inode_num, 0));
+			for (; child != children.end() && child->first == inode_num; ++child) {
+				if (reached[child->second / 64] & check_bit(child->second))
+					continue;
+				reached[child->second / 64] |= check_bit(child->second);
+				stack.push_back(child->second);
+			}
+		}
+	};
+	reach(inode_root);
+	vector<int> orphans;
+	int orphan_dirs = 0;
+	for (int inode_num = sb.first_inode; inode_num < sb.inodes_count; inode_num++) {
+		if (!(in_use[inode_num / 64] & check_bit(inode_num)) || parent[inode_num] != 0)
+			continue;
+		orphans.push_back(inode_num);
+		if (inode_type(inode_num) == Inode::DIRECTORY) {
+			orphan_dirs++;
+			reach(inode_num);
+		}
+	}
+	int cycles = 0;
+	for (size_t i = 0; i < inodes.dirs.size(); i++) {
+		int inode_num = inodes.dirs[i];
+		if (reached[inode_num / 64] & check_bit(inode_num))
+			continue;
+		extra_links.push_back(make_pair(parent[inode_num], inode_num));
+		parent[inode_num] = 0;
+		orphans.push_back(inode_num);
+		cycles++;
+		reach(inode_num);
+	}
+
+	// ".." names the parent, orphans get theirs when they are reconnected
+	vector<int> bad_dotdots;
+	for (size_t i = 0; i < dirs.dotdots.size(); i++) {
+		int inode_num = dirs.dotdots[i].first;
+		if (parent[inode_num] != 0 && dirs.dotdots[i].second != parent[inode_num])
+			bad_dotdots.push_back(inode_num);
+	}
+
+	// Blocks the bitmap should have: the metadata before the data area and every owned block.
+	// Bits past the last block are left as they are.
+	for (int block_num = 0; block_num < first_data_block; block_num++)
+		owned[block_num / 64] |= check_bit(block_num);
+	for (int inode_num = 0; inode_num < sb.first_inode; inode_num++)
+		in_use[inode_num / 64] |= check_bit(inode_num);
+	int leaked_blocks = 0, leaked_dir_blocks = 0, unmarked_blocks = 0;
+	int leaked_inodes = 0, unmarked_inodes = 0;
+	auto compare = [&](const vector<uint64_t>& expected, long long bitmap_offset, int bits_count, int* leaked, int* unmarked, bool is_blocks) {
+		for (size_t i = 0; i < expected.size(); i++) {
+			uint64_t word = 0;
+			object_read(bitmap_offset + (long long) i * sizeof(uint64_t), &word);
+			word = bswap64(word);
+			int valid_bits = (int) min<long long>(64, bits_count - (long long) i * 64);
+			uint64_t valid = valid_bits == 64 ? ~0ULL : ~(~0ULL >> valid_bits);
+			uint64_t extra = word & ~expected[i] & valid;
+			uint64_t missing = expected[i] & ~word & valid;
+			*unmarked += popcount64(missing);
+			*leaked += popcount64(extra);
+			// Blocks starting with "." and ".." were left by a removed directory
+			while (is_blocks && extra != 0) {
+				int bit = clz64(extra);
+				extra &= ~(1ULL << (63 - bit));
+				DirSpan span = dir_block_view((int) i * 64 + bit);
+				if (span.count >= 2 && strcmp(span.entries[0].name, ".") == 0 && strcmp(span.entries[1].name, "..") == 0)
+					leaked_dir_blocks++;
+			}
+		}
+	};
+	compare(owned, block_offset(sb.block_bitmap), sb.blocks_count, &leaked_blocks, &unmarked_blocks, true);
+	compare(in_use, block_offset(sb.inode_bitmap), sb.inodes_count, &leaked_inodes, &unmarked_inodes, false);
+
+	// Blocks with more than one owner need as many references, otherwise they are cross-linked:
+	// a write through one owner changes the file of the other
+	sort(inodes.shared.begin(), inodes.shared.end());
+	vector<pair<int, int>> refs_fixes;   // Block and its count
+	int cross_linked = 0, refs_wrong = 0;
+	for (size_t i = 0; i < inodes.shared.size(); ) {
+		int block_num = inodes.shared[i].first;
+		size_t next = i;
+		while (next < inodes.shared.size() && inodes.shared[next].first == block_num)
+			next++;
+		int refs = (int) min<size_t>(next - i, 0xFFFF);
+		if (block_refs(block_num) < refs)
+			cross_linked++;
+		else if (block_refs(block_num) > refs)
+			refs_wrong++;
+		if (block_refs(block_num) != refs && sb.refcount_blocks > 0)
+			refs_fixes.push_back(make_pair(block_num, refs));
+		i = next;
+	}
+	// Blocks with one owner or none have no references
+	int refs_per_block = sb.block_size / (int) sizeof(uint16_t);
+	for (int i = 0; i < sb.refcount_blocks; i++) {
+		const char* data = disk_at(block_offset(sb.refcount_table + i), sb.block_size);
+		if (is_zeros(data, sb.block_size))
+			continue;
+		for (int j = 0; j < refs_per_block && i * refs_per_block + j < sb.blocks_count; j++) {
+			int block_num = i * refs_per_block + j;
+			if (((const uint16_t*) data)[j] == 0)
+				continue;
+			auto owner = lower_bound(inodes.shared.begin(), inodes.shared.end(), make_pair(block_num, 0));
+			if (owner != inodes.shared.end() && owner->first == block_num)
+				continue;
+			refs_wrong++;
+			refs_fixes.push_back(make_pair(block_num, 0));
+		}
+	}
+
+	// Free counts are compared with the bitmaps rebuilt, not with the ones on disk
+	auto bits_count = [](const vector<uint64_t>& bits, int first, int last) {
+		int count = 0;
+		for (int base = first - first % 64; base < last; base += 64) {
+			uint64_t word = bits[base / 64];
+			if (base < first)
+				word &= ~0ULL >> (first - base);
+			if (last - base < 64)
+				word &= ~(~0ULL >> (last - base));
+			count += popcount64(word);
+		}
+		return count;
+	};
+	int free_blocks_count = sb.blocks_count - bits_count(owned, 0, sb.blocks_count);
+	int free_inodes_count = sb.inodes_count - bits_count(in_use, 0, sb.inodes_count);
+	int drifted_groups = 0;
+	for (int i = 0, dir = 0; sb.group_table != 0 && i < sb.groups_count; i++) {
+		int first_block = i * sb.blocks_per_group;
+		int last_block = min(first_block + sb.blocks_per_group, sb.blocks_count);
+		int first_inode = i * sb.inodes_per_group;
+		int last_inode = min(first_inode + sb.inodes_per_group, sb.inodes_count);
+		GroupDesc desc;
+		object_read(block_offset(sb.group_table) + i * sizeof(GroupDesc), &desc);
+		int used_dirs_count = 0;
+		for (; dir < (int) inodes.dirs.size() && inodes.dirs[dir] < last_inode; dir++)
+			used_dirs_count++;
+		if (desc.free_blocks_count != last_block - first_block - bits_count(owned, first_block, last_block)
+			|| desc.free_inodes_count != last_inode - first_inode - bits_count(in_use, first_inode, last_inode)
+			|| desc.used_dirs_count != used_dirs_count)
+			drifted_groups++;
+	}
+	bool counts_drifted = free_blocks_count != sb.free_blocks_count || free_inodes_count != sb.free_inodes_count || drifted_groups > 0;
+	timer.add(inodes.blocks, 0);
+
+	cout << "Inodes: " << inodes.inodes << " in use, " << inodes.dirs.size() << " directories with " << dirs.entries << " entries\n";
+	cout << "Blocks: " << inodes.blocks << " owned, " << inodes.shared.size() << " of them shared\n";
+	cout << "\n";
+
+	// Repairs go in this order: bitmaps first, so the blocks and inodes taken by the
+	// later repairs are really free
+	const char* fixed = repair ? ", corrected\n" : "\n";
+	if (!inodes.bad_types.empty()) {
+		cout << "Inodes of unknown type: " << inodes.bad_types.size() << (repair ? ", cleared\n" : "\n");
+		problems += (int) inodes.bad_types.size();
+	}
+	if (!inodes.bad_blocks.empty()) {
+		cout << "Inodes with blocks outside the data area: " << inodes.bad_blocks.size() << (repair ? ", cleared\n" : "\n");
+		problems += (int) inodes.bad_blocks.size();
+	}
+	if (repair) {
+		for (size_t i = 0; i < inodes.bad_types.size(); i++)
+			object_write(inode_offset(inodes.bad_types[i]), Inode(Inode::UNKNOWN));
+		for (size_t i = 0; i < inodes.bad_blocks.size(); i++)
+			object_write(inode_offset(inodes.bad_blocks[i]), Inode(Inode::UNKNOWN));
+	}
+
+	if (leaked_blocks > 0) {
+		cout << "Blocks marked used but not owned: " << leaked_blocks;
+		if (leaked_dir_blocks > 0)
+			cout << " (" << leaked_dir_blocks << " of removed directories)";
+		cout << (repair ? ", freed\n" : "\n");
+	}
+	if (unmarked_blocks > 0)
+		cout << "Blocks owned but marked free: " << unmarked_blocks << fixed;
+	if (leaked_inodes > 0)
+		cout << "Inodes marked used but not in use: " << leaked_inodes << (repair ? ", freed\n" : "\n");
+	if (unmarked_inodes > 0)
+		cout << "Inodes in use but marked free: " << unmarked_inodes << fixed;
+	problems += leaked_blocks + unmarked_blocks + leaked_inodes + unmarked_inodes;
+	if (repair) {
+		auto write_bitmap = [&](const vector<uint64_t>& expected, long long bitmap_offset, int bits_count) {
+			for (size_t i = 0; i < expected.size(); i++) {
+				long long word_offset = bitmap_offset + (long long) i * sizeof(uint64_t);
+				uint64_t word = 0;
+				object_read(word_offset, &word);
+				word = bswap64(word);
+				int valid_bits = (int) min<long long>(64, bits_count - (long long) i * 64);
+				uint64_t valid = valid_bits == 64 ? ~0ULL : ~(~0ULL >> valid_bits);
+				if ((word & valid) != (expected[i] & valid))
+					object_write(word_offset, bswap64((word & ~valid) | (expected[i] & valid)));
+			}
+		};
+		write_bitmap(owned, block_offset(sb.block_bitmap), sb.blocks_count);
+		write_bitmap(in_use, block_offset(sb.inode_bitmap), sb.inodes_count);
+	}
+
+	if (cross_linked > 0) {
+		cout << "Cross-linked blocks: " << cross_linked;
+		if (repair)
+			cout << (sb.refcount_blocks > 0 ? ", shared\n" : ", copied\n");
+		else
+			cout << "\n";
+	}
+	if (refs_wrong > 0)
+		cout << "Blocks with more references than owners: " << refs_wrong << fixed;
+	problems += cross_linked + refs_wrong;
+	if (repair) {
+		for (size_t i = 0; i < refs_fixes.size(); i++)
+			object_write(block_offset(sb.refcount_table) + refs_fixes[i].first * sizeof(uint16_t), (uint16_t) refs_fixes[i].second);
+	}
+
+	// Free counts follow the bitmaps before anything is allocated
+	if (counts_drifted)
+		cout << "Free counts drifted: " << sb.free_blocks_count << " blocks and " << sb.free_inodes_count << " inodes (counted "
+			<< free_blocks_count << " and " << free_inodes_count << "), " << drifted_groups << " groups" << fixed;
+	problems += counts_drifted ? 1 : 0;
+	auto recount = [&]() {
+		group_recount();
+		sb.free_blocks_count = sb.blocks_count - bit_count(block_offset(sb.block_bitmap), 0, sb.blocks_count);
+		sb.free_inodes_count = sb.inodes_count - bit_count(block_offset(sb.inode_bitmap), 0, sb.inodes_count);
+	};
+	if (repair)
+		recount();
+
+	// Without reference counts every owner after the first gets its own copy
+	if (repair && sb.refcount_blocks == 0) {
+		for (size_t i = 0; i < inodes.shared.size(); i++) {
+			if (block_clone(inodes.shared[i].second, inodes.shared[i].first) != SUCCESS)
+				unrepaired++;
+		}
+	}
+
+	if (!dirs.dangling.empty())
+		cout << "Entries of free inodes: " << dirs.dangling.size() << (repair ? ", removed\n" : "\n");
+	if (!extra_links.empty())
+		cout << "Extra links: " << extra_links.size() << (repair ? ", removed\n" : "\n");
+	problems += (int) (dirs.dangling.size() + extra_links.size());
+	if (repair) {
+		for (size_t i = 0; i < dirs.dangling.size(); i++)
+			dir_entry_remove(dirs.dangling[i].first, dirs.dangling[i].second.c_str());
+		for (size_t i = 0; i < extra_links.size(); i++) {
+			vector<DirEntry> entries;
+			dir_entries(extra_links[i].first, &entries);
+			for (size_t j = 0; j < entries.size(); j++) {
+				if (entries[j].inode == extra_links[i].second) {
+					dir_entry_remove(extra_links[i].first, entries[j].name);
+					break;
+				}
+			}
+		}
+	}
+
+	// "." and ".." are corrected in place, a directory without them is left alone
+	if (!dirs.bad_dots.empty() || !bad_dotdots.empty())
+		cout << "Directories with a wrong \".\" or \"..\": " << dirs.bad_dots.size() + bad_dotdots.size() << fixed;
+	problems += (int) (dirs.bad_dots.size() + bad_dotdots.size());
+	auto dots_write = [&](int inode_num, int slot, int target) {
+		DirSpan span = dir_block_view(block_of(*inode_view(inode_num), 0));
+		const char* name = slot == 0 ? "." : "..";
+		if (span.count < 2 || (span.entries[slot].name[0] != '\0' && strcmp(span.entries[slot].name, name) != 0))
+			return false;
+		object_write(block_offset(block_of(*inode_view(inode_num), 0)) + slot * sizeof(DirEntry), DirEntry(target, name));
+		return true;
+	};
+	if (repair) {
+		for (size_t i = 0; i < dirs.bad_dots.size(); i++)
+			unrepaired += dots_write(dirs.bad_dots[i], 0, dirs.bad_dots[i]) ? 0 : 1;
+		for (size_t i = 0; i < bad_dotdots.size(); i++)
+			unrepaired += dots_write(bad_dotdots[i], 1, parent[bad_dotdots[i]]) ? 0 : 1;
+	}
+
+	// Orphans are reconnected in /lost+found by inode number
+	if (!orphans.empty()) {
+		cout << "Orphans: " << orphans.size() << " (" << orphan_dirs + cycles << " directories";
+		if (cycles > 0)
+			cout << ", " << cycles << " of them in cycles";
+		cout << ")" << (repair ? ", moved to /lost+found\n" : "\n");
+	}
+	problems += (int) orphans.size();
+	if (repair && !orphans.empty()) {
+		int lost_found = dir_lookup(inode_root, "lost+found");
+		if (lost_found == 0)
+			dir_create_at(inode_root, "lost+found", &lost_found);
+		if (lost_found == 0 || inode_type(lost_found) != Inode::DIRECTORY) {
+			unrepaired += (int) orphans.size();
+		} else {
+			for (size_t i = 0; i < orphans.size(); i++) {
+				string name = "#" + to_string(orphans[i]);
+				if (dir_entry_add(lost_found, DirEntry(orphans[i], name.c_str())) != SUCCESS) {
+					unrepaired++;
+					continue;
+				}
+				if (inode_type(orphans[i]) != Inode::DIRECTORY)
+					continue;
+				// Left over from an interrupted rm -r
+				Inode orphan;
+				object_read(inode_offset(orphans[i]), &orphan);
+				if (orphan.flags & Inode::REMOVED) {
+					orphan.flags &= ~Inode::REMOVED;
+					object_write(inode_offset(orphans[i]), orphan);
+				}
+				if (!dots_write(orphans[i], 1, lost_found))
+					unrepaired++;
+			}
+		}
+	}
+
+	if (repair) {
+		recount();
+		dentry_clear();
+		if (journal_active() && journal_commit() != SUCCESS)
+			checkpoint();
+	}
+	if (problems_found != NULL)
+		*problems_found = problems;
+	if (problems == 0) {
+		cout << "File system is clean\n";
+		return SUCCESS;
+	}
+	cout << "\n" << problems << " problems found";
+	if (repair && unrepaired > 0)
+		cout << ", " << unrepaired << " could not be repaired";
+	else if (repair)
+		cout << ", repaired";
+	cout << "\n";
+	return repair && unrepaired == 0 ? SUCCESS : INCONSISTENT;
+}
+
+FileSystem::Fragmentation FileSystem::fragmentation() {
+	Fragmentation state;
+	vector<Extent> extents;
+	long long inode_bitmap = block_offset(sb.inode_bitmap);
+	for (int inode_num = bit_scan(inode_bitmap, 0, sb.inodes_count, USED); inode_num != -1;
+		inode_num = bit_scan(inode_bitmap, inode_num + 1, sb.inodes_count, USED)) {
+		const Inode* inode = inode_view(inode_num);
+		if (inode->file_type == Inode::UNKNOWN)
+			continue;
+		inode_extents(*inode, extents);
+		if (extents.empty())
+			continue;
+		uint64_t runs = 1;
+		for (size_t i = 1; i < extents.size(); i++) {
+			if (extents[i].physical != extents[i - 1].physical + extents[i - 1].length)
+				runs++;
+		}
+		state.inodes++;
+		state.runs += runs;
+		state.fragmented += runs > 1 ? 1 : 0;
+	}
+
+	long long block_bitmap = block_offset(sb.block_bitmap);
+	state.used_end = sb.blocks_count;
+	int first = bit_scan(block_bitmap, data_block_first(), sb.blocks_count, UNUSED);
+	while (first != -1) {
+		int last = bit_scan(block_bitmap, first, sb.blocks_count, USED);
+		if (last == -1) {
+			last = sb.blocks_count;
+			state.used_end = first;
+		}
+		state.free_blocks += last - first;
+		state.free_runs++;
+		state.free_largest = max(state.free_largest, last - first);
+		first = last < sb.blocks_count ? bit_scan(block_bitmap, last, sb.blocks_count, UNUSED) : -1;
+	}
+	return state;
+}
+
+void FileSystem::fragmentation_print(const Fragmentation& state) {
+	cout << "Files and directories: " << state.inodes << " in " << state.runs << " runs, " << state.fragmented << " fragmented\n";
+	cout << "Free space: " << state.free_blocks << " blocks in " << state.free_runs << " runs, largest " << state.free_largest
+		<< ", " << state.free_blocks - (sb.blocks_count - state.used_end) << " before block " << state.used_end << "\n";
+}
+
+int FileSystem::display_fragmentation() {
+	WriteLock disk_lock = write_lock(locks->disk);
+	fragmentation_print(fragmentation());
+	return SUCCESS;
+}
+
+// Inodes with blocks, the one reaching furthest into the disk first
+vector<int> FileSystem::defrag_plan() {
+	vector<pair<int, int>> ends;   // End of the blocks and inode
+	vector<Extent> extents;
+	long long inode_bitmap = block_offset(sb.inode_bitmap);
+	for (int inode_num = bit_scan(inode_bitmap, 0, sb.inodes_count, USED); inode_num != -1;
+		inode_num = bit_scan(inode_bitmap, inode_num + 1, sb.inodes_count, USED)) {
+		const Inode* inode = inode_view(inode_num);
+		if (inode->file_type == Inode::UNKNOWN)
+			continue;
+		inode_extents(*inode, extents);
+		int end = 0;
+		for (size_t i = 0; i < extents.size(); i++)
+			end = max(end, extents[i].physical + extents[i].length);
+		if (end > 0)
+			ends.push_back(make_pair(end, inode_num));
+	}
+	sort(ends.rbegin(), ends.rend());
+	vector<int> plan(ends.size());
+	for (size_t i = 0; i < ends.size(); i++)
+		plan[i] = ends[i].second;
+	return plan;
+}
+
+// Moves the blocks of an inode into the lowest free run that holds them and the block of
+// the mapping, in logical order. A file in one run only moves down. Returns NOT_EXIST if
+// there is nothing to do, INCOMPATIBLE if the blocks are shared or cannot be mapped.
+int FileSystem::inode_defrag(int inode_num, int* moved_blocks) {
+	*moved_blocks = 0;
+	Inode inode;
+	object_read(inode_offset(inode_num), &inode);
+	if (inode.file_type == Inode::UNKNOWN)
+		return NOT_EXIST;
+	vector<Extent> extents;
+	vector<int> tree_blocks;
+	inode_extents(inode, extents, &tree_blocks);
+	if (extents.empty())
+		return NOT_EXIST;
+
+	int count = 0;
+	int runs = 1;
+	int mapped_count = 1;   // Extents of the new mapping, logical gaps stay
+	for (size_t i = 0; i < extents.size(); i++) {
+		count += extents[i].length;
+		if (i > 0 && extents[i].physical != extents[i - 1].physical + extents[i - 1].length)
+			runs++;
+		if (i > 0 && extents[i].logical != extents[i - 1].logical + extents[i - 1].length)
+			mapped_count++;
+	}
+	int tree_count = (inode.flags & Inode::EXTENTS) ? extent_tree_size(mapped_count) : (inode.indirect_block != 0 ? 1 : 0);
+	int needed = count + tree_count;
+
+	// Moving a shared block would give the copies their own blocks
+	for (size_t i = 0; i < extents.size(); i++) {
+		if (block_unshared(extents[i].physical, extents[i].length) < extents[i].length)
+			return INCOMPATIBLE;
+	}
+	long long block_bitmap = block_offset(sb.block_bitmap);
+	int target = bit_unused_run(block_bitmap, data_block_first(), runs == 1 ? extents[0].physical : sb.blocks_count, needed);
+	if (target == -1)
+		return NOT_EXIST;
+	for (int i = 0; i < needed; i++)
+		bit_write(block_bitmap, target + i, USED);
+
+	// Blocks of directories are journaled like the rest of the metadata
+	int chunk_max = max(1, 0x1000000 / sb.block_size);
+	vector<Extent> mapped;
+	int position = target;
+	for (size_t i = 0; i < extents.size(); i++) {
+		const Extent& extent = extents[i];
+		for (int done = 0; done < extent.length; ) {
+			int chunk = min(chunk_max, extent.length - done);
+			if (inode.file_type == Inode::DIRECTORY) {
+				for (int j = 0; j < chunk; j++)
+					block_write(position + done + j, disk_at(block_offset(extent.physical + done + j), sb.block_size));
+			} else {
+				int length = chunk * sb.block_size;
+				data_write(block_offset(position + done), disk_at(block_offset(extent.physical + done), length), length);
+			}
+			done += chunk;
+		}
+		if (!mapped.empty() && mapped.back().logical + mapped.back().length == extent.logical)
+			mapped.back().length += extent.length;
+		else
+			mapped.push_back(Extent(extent.logical, position, extent.length));
+		position += extent.length;
+	}
+
+	// Blocks of the mapping follow the data
+	int tree_block = target + count;
+	memset(inode.direct_blocks, 0, sizeof(inode.direct_blocks));
+	inode.indirect_block = 0;
+	if (inode.flags & Inode::EXTENTS) {
+		extent_tree_build(inode, mapped, tree_block);
+	} else {
+		vector<char> tree(sb.block_size, 0);
+		int* pointers = (int*) tree.data();
+		for (size_t i = 0; i < mapped.size(); i++) {
+			for (int j = 0; j < mapped[i].length; j++) {
+				int logical = mapped[i].logical + j;
+				if (logical < Inode::direct_blocks_count)
+					inode.direct_blocks[logical] = mapped[i].physical + j;
+				else
+					pointers[logical - Inode::direct_blocks_count] = mapped[i].physical + j;
+			}
+		}
+		if (tree_count > 0) {
+			inode.indirect_block = tree_block;
+			block_write(tree_block, tree.data());
+		}
+	}
+	object_write(inode_offset(inode_num), inode);
+
+	for (size_t i = 0; i < extents.size(); i++)
+		blocks_free_run(extents[i].physical, extents[i].length);
+	for (size_t i = 0; i < tree_blocks.size(); i++)
+		blocks_free_run(tree_blocks[i], 1);
+	*moved_blocks = needed;
+	return SUCCESS;
+}
+
+int FileSystem::defrag() {
+	StatsTimer timer(*stats, Stats::DEFRAG);
+	WriteLock disk_lock = write_lock(locks->disk);
+	Fragmentation before = fragmentation();
+
+	// Passes repeat while they move anything, files moved down leave room for the next pass
+	uint64_t moved_inodes = 0, moved_blocks = 0;
+	int passes = 0;
+	int shared = 0;
+	while (true) {
+		vector<int> plan = defrag_plan();
+		uint64_t pass_blocks = 0;
+		for (size_t i = 0; i < plan.size(); i++) {
+			int blocks = 0;
+			int result = inode_defrag(plan[i], &blocks);
+			if (result == SUCCESS) {
+				moved_inodes++;
+				pass_blocks += blocks;
+			} else if (result == INCOMPATIBLE && passes == 0) {
+				shared++;
+			}
+		}
+		if (pass_blocks == 0)
+			break;
+		moved_blocks += pass_blocks;
+		passes++;
+	}
+	defrag_pass = DefragPass();
+	if (moved_blocks > 0 && journal_active() && journal_commit() != SUCCESS)
+		checkpoint();
+	timer.add(moved_blocks, moved_blocks * sb.block_size);
+
+	cout << "Before\n";
+	fragmentation_print(before);
+	cout << "\n";
+	cout << "After\n";
+	fragmentation_print(fragmentation());
+	cout << "\n";
+	cout << "Moves: " << moved_inodes << " of files and directories, " << moved_blocks << " blocks in " << passes << " passes\n";
+	if (shared > 0)
+		cout << shared << " left in place, they share blocks with copies\n";
+	return SUCCESS;
+}
+
+int FileSystem::defrag_step(int budget) {
+	StatsTimer timer(*stats, Stats::DEFRAG);
+	WriteLock disk_lock = write_lock(locks->disk);
+	if (defrag_pass.next >= defrag_pass.inodes.size()) {
+		// A pass that moved nothing leaves the disk as compact as it gets
+		bool finished = !defrag_pass.inodes.empty() && defrag_pass.moved == 0;
+		defrag_pass = DefragPass();
+		if (finished)
+			return -1;
+		defrag_pass.inodes = defrag_plan();
+		if (defrag_pass.inodes.empty())
+			return -1;
+	}
+
+	// Every inode looked at counts as a block, so a step without moves ends as well
+	int moved = 0;
+	int looked_at = 0;
+	while (moved + looked_at < budget && defrag_pass.next < defrag_pass.inodes.size()) {
+		int blocks = 0;
+		if (inode_defrag(defrag_pass.inodes[defrag_pass.next++], &blocks) == SUCCESS)
+			moved += blocks;
+		looked_at++;
+	}
+	defrag_pass.moved += moved;
+	if (moved > 0 && journal_active() && journal_commit() != SUCCESS)
+		checkpoint();
+	timer.add(moved, (uint64_t) moved * sb.block_size);
+	return moved;
+}
+
+int FileSystem::file_read(int inode_num, long long offset, int length, char* buffer) {
+	StatsTimer timer(*stats, Stats::FILE_READ);
+	ReadLock disk_lock = disk_read_lock();
+	ReadLock inode_lock = inode_read_lock(inode_num);
+	int done = inode_read(inode_num, offset, length, buffer);
+	if (done > 0)
+		timer.add((offset + done - 1) / sb.block_size - offset / sb.block_size + 1, done);
+	return done;
+}
+
+int FileSystem::file_write(int inode_num, long long offset, int length, const char* buffer) {
+	StatsTimer timer(*stats, Stats::FILE_WRITE);
+	ReadLock disk_lock = disk_read_lock();
+	WriteLock inode_lock = inode_write_lock(inode_num);
+	int done = inode_write(inode_num, offset, length, buffer);
+	if (done > 0)
+		timer.add((offset + done - 1) / sb.block_size - offset / sb.block_size + 1, done);
+	return done;
+}
+
+int FileSystem::display_stats() {
+	stats->print(cout);
+	if (on_demand) {
+		cout << "\nCache: " << frames_count * frame_size / 1024 << " KB resident";
+		if (cache_limit > 0)
+			cout << " of " << cache_limit / 1024 << " KB";
+		cout << ", " << cache_counters.hits << " hits, " << cache_counters.misses << " misses, "
+			<< cache_counters.evictions << " evicted, " << cache_counters.written_back << " blocks written back\n";
+	}
+	return SUCCESS;
+}
+
+void FileSystem::reset_stats() {
+	stats->reset();
+	cache_counters = CacheCounters();
+}
+
+int FileSystem::file_truncate(int inode_num, long long size) {
+	ReadLock disk_lock = disk_read_lock();
+	WriteLock inode_lock = inode_write_lock(inode_num);
+	return inode_truncate(inode_num, size);
+}
+
+int FileSystem::inode_read(int inode_num, long long offset, int length, char* buffer) {
+	const Inode* inode_ref = inode_view(inode_num);
+	if (inode_ref == NULL || inode_ref->file_type != Inode::FILE || offset < 0 || length < 0)
+		return -1;
+	const Inode& inode = *inode_ref;
+	if (offset >= inode.size())
+		return 0;
+	length = (int) min<long long>(length, inode.size() - offset);
+	if (on_demand) {
+		MutexLock readahead_lock = mutex_lock(locks->readahead);
+		Readahead& state = readaheads[inode_num % readahead_slots];
+		if (state.inode != inode_num) {
+			state = Readahead();
+			state.inode = inode_num;
+		}
+		file_readahead(inode, state, offset, length);
+	}
+
+	int done = 0;
+	while (done < length) {
+		long long position = offset + done;
+		int within = (int) (position % sb.block_size);
+		int count = 0;
+		int block_num = block_run(inode, (int) (position / sb.block_size), &count, (int) (((long long) within + length - done - 1) / sb.block_size + 1));
+		int chunk = (int) min<long long>(length - done, (long long) max(count, 1) * sb.block_size - within);
+		if (block_num == 0)
+			memset(buffer + done, 0, chunk);
+		else
+			data_read(block_offset(block_num) + within, buffer + done, chunk);
+		done += chunk;
+	}
+	return done;
+}
+
+int FileSystem::inode_write(int inode_num, long long offset, int length, const char* buffer) {
+	Inode inode;
+	object_read(inode_offset(inode_num), &inode);
+	if (inode.file_type != Inode::FILE || offset < 0 || length < 0)
+		return -1;
+
+	int done = 0;
+	while (done < length) {
+		long long position = offset + done;
+		int within = (int) (position % sb.block_size);
+		int logical = (int) (position / sb.block_size);
+		int count = 0;
+		int block_num = block_run(inode, logical, &count, (int) (((long long) within + length - done - 1) / sb.block_size + 1));
+		if (block_num != 0)
+			count = block_unshared(block_num, count);
+		if (block_num != 0 && count == 0) {
+			// Copy on write, the block is shared with a reflinked copy
+			int new_block_num = block_alloc(block_of(inode, logical - 1) + 1, false);
+			if (new_block_num == 0)
+				break;
+			if (within != 0 || length - done < sb.block_size)
+				data_write(block_offset(new_block_num), disk_at(block_offset(block_num), sb.block_size), sb.block_size);
+			if (block_set(inode_num, inode, logical, new_block_num) != SUCCESS) {
+				blocks_free_run(new_block_num, 1);
+				break;
+			}
+
+			// Drops this reference, or the block itself if the other owners are gone meanwhile
+			blocks_free_run(block_num, 1);
+			block_num = new_block_num;
+			count = 1;
+		}
+		if (block_num == 0) {
+			block_num = block_map(inode_num, inode, logical, false);
+			if (block_num == 0)
+				break;
+			count = 1;
+		}
+		int chunk = (int) min<long long>(length - done, (long long) count * sb.block_size - within);
+		data_write(block_offset(block_num) + within, buffer + done, chunk);
+		done += chunk;
+	}
+
+	if (offset + done > inode.size())
+		inode.size_set(offset + done);
+	inode.mod_time = (int) time(0);
+	object_write(inode_offset(inode_num), inode);
+	return done;
+}
 
-	dir_entry_add(dest_inode_num, DirEntry(new_inode_num, dest_name.c_str()));
+int FileSystem::inode_reflink(int source_inode_num, int inode_num) {
+	Inode inode;
+	object_read(inode_offset(source_inode_num), &inode);
+	vector<Extent> extents;
+	vector<int> tree_blocks;
+	inode_extents(inode, extents, &tree_blocks);
+
+	// Blocks of the mapping itself are not shared, the copy gets its own
+	vector<int> new_tree_blocks;
+	for (size_t i = 0; i < tree_blocks.size(); i++) {
+		int block_num = block_alloc(tree_blocks[i]);
+		if (block_num == 0) {
+			for (size_t j = 0; j < new_tree_blocks.size(); j++)
+				blocks_free_run(new_tree_blocks[j], 1);
+			return FAILED;
+		}
+		block_write(block_num, disk_at(block_offset(tree_blocks[i]), sb.block_size));
+		new_tree_blocks.push_back(block_num);
+	}
+	if (inode.flags & Inode::EXTENTS) {
+		extent_tree_relink(inode, tree_blocks, new_tree_blocks);
+	} else if (inode.indirect_block != 0) {
+		inode.indirect_block = new_tree_blocks[0];
+	}
 
-	// ! Copy file contents
+	// Counts are checked and taken at once, so a full count is not passed
+	MutexLock refs_lock = mutex_lock(locks->refcounts);
+	for (size_t i = 0; i < extents.size(); i++) {
+		for (int j = 0; j < extents[i].length; j++) {
+			if (block_refs(extents[i].physical + j) < 0xFFFF)
+				continue;
+			unlock(refs_lock);
+			for (size_t k = 0; k < new_tree_blocks.size(); k++)
+				blocks_free_run(new_tree_blocks[k], 1);
+			return FAILED;
+		}
+	}
+	for (size_t i = 0; i < extents.size(); i++) {
+		for (int j = 0; j < extents[i].length; j++)
+			block_refs_add(extents[i].physical + j, 1);
+	}
+	unlock(refs_lock);
+	inode.mod_time = (int) time(0);
+	object_write(inode_offset(inode_num), inode);
+	return SUCCESS;
+}
 
+int FileSystem::inode_truncate(int inode_num, long long size) {
+	// Only grows the file, the tail reads as zeros
+	Inode inode;
+	object_read(inode_offset(inode_num), &inode);
+	if (inode.file_type != Inode::FILE)
+		return NOT_FILE;
+	if (size > inode.size()) {
+		inode.size_set(size);
+		object_write(inode_offset(inode_num), inode);
+	}
 	return SUCCESS;
 }
@@ -3,8 +3,22 @@
 #define FILE_SYSTEM_H
 
 #include <string>
+#include <cstring>
+#include <climits>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+#include "BlockDevice.h"
+#include "ChunkedImage.h"
 #include "Inode.h"
+#include "MappedFile.h"
+#include "RawFile.h"
+#include "Stats.h"
+#include "ThreadPool.h"
+#include "WorkQueues.h"
 using std::string;
 
 
@@ -19,34 +33,153 @@ struct Superblock {
 	int inode_bitmap;
 	int inode_table;
     
-	int disk_size;
+	long long disk_size;   // 64-bit since revision 5
+
+	int free_blocks_count;
+	int free_inodes_count;
+
+	int features;
+
+	int journal_block;
+	int journal_blocks;
+	int journal_sequence;   // First transaction to replay
+
+	int refcount_table;
+	int refcount_blocks;
+
+	int blocks_per_group;
+	int inodes_per_group;
+	int groups_count;
+	int group_table;   // Block of the group descriptors, 0 if the disk is one group
 
 	//char reserved[8] = { 0 };
 };
 
 
+// Superblock of revisions 3 and 4, converted at mount. Revision 3 ends after disk_size,
+// the fields after it were zeros.
+struct SuperblockRev4 {
+	int inodes_count;
+	int blocks_count;
+	int block_size;
+	int rev_level;
+	int first_inode;
+	int block_bitmap;
+	int inode_bitmap;
+	int inode_table;
+	int disk_size;
+	int free_blocks_count;
+	int free_inodes_count;
+	int features;
+	int journal_block;
+	int journal_blocks;
+	int journal_sequence;
+	int refcount_table;
+	int refcount_blocks;
+	int blocks_per_group;
+	int inodes_per_group;
+	int groups_count;
+	int group_table;
+};
+
+
+// Block group descriptor. Bitmaps and inode tables of the groups are packed together
+// like ext4 flex_bg: group g owns block g of the block bitmap and the g-th slices of
+// the inode bitmap and the inode table.
+struct GroupDesc {
+	int free_blocks_count;
+	int free_inodes_count;
+	int used_dirs_count;
+	int flags;
+};
+
+
+// Journal transaction: descriptor block, copies of the blocks, commit block
+struct JournalHeader {
+	static const uint32_t MAGIC = 0x4A524E4C;
+	static const int DESCRIPTOR = 0x1;   // Followed by numbers of the logged blocks
+	static const int COMMIT = 0x2;   // Followed by checksum of the logged blocks
+
+	uint32_t magic = MAGIC;
+	int type = 0;
+	int sequence = 0;
+	int count = 0;
+};
+
+
 class FileSystem {
 public:
     // Constants
-	static const int REV_LEVEL = 3;
+	static const int REV_LEVEL = 5;
+
+	// Features
+	static const int FEATURE_DIR_INDEX = 0x1;   // Hashed index for directories larger than a block
+	static const int FEATURE_EXTENTS = 0x2;   // New inodes map blocks by extents
+	static const int FEATURE_JOURNAL = 0x4;   // Metadata changes are logged before written in place
+	static const int FEATURE_REFLINK = 0x8;   // Copies share blocks until written
+	static const int FEATURE_BLOCK_GROUPS = 0x10;   // Allocation is split into groups with their own counts
+	static const int FEATURES_SUPPORTED = FEATURE_DIR_INDEX | FEATURE_EXTENTS | FEATURE_JOURNAL | FEATURE_REFLINK | FEATURE_BLOCK_GROUPS;
+	static const int FEATURES_DEFAULT = FEATURE_DIR_INDEX | FEATURE_EXTENTS | FEATURE_JOURNAL | FEATURE_REFLINK | FEATURE_BLOCK_GROUPS;
 
     // Functions
-	int init(int disk_size, int block_size);
-    int display_properties();
+	int init(long long disk_size, int block_size, int features = FEATURES_DEFAULT);
+    int display_properties(bool verify = false);
+	int display_stats();
+	void reset_stats();
 	std::string path_abspath(std::string fullpath);
 	int type_of(std::string fullpath);
 
-	int save(std::string filepath);
-	int load(std::string filepath);
+	// Flags of load()
+	static const int LOAD_ON_DEMAND = 0x1;   // Blocks are read from the image when first used
+	static const int LOAD_DIRECT = 0x2;   // Image I/O bypasses the page cache where aligned
+	static const int LOAD_NO_URING = 0x4;   // pread/pwrite instead of io_uring
+
+	int save(std::string filepath, bool compressed = false);
+	int load(std::string filepath, int flags = 0);
+	int map(std::string filepath);
+	int sync();
+
+	// Operations may be called from several threads once enabled, no operation may be running while switching
+	void set_concurrent(bool enabled);
+
+	// Bytes of an image loaded on demand that stay in memory, 0 keeps everything that was read.
+	// Kept across images.
+	void set_cache_limit(long long bytes);
 
 	int dir_list(std::string fullpath);
 	int dir_create(std::string path, std::string name);
-	int dir_remove(std::string path, std::string name); // !
+	int dir_remove(std::string path, std::string name);   // Only empty directories
 
-	int file_create(std::string path, std::string name, int size); // !
+	int file_create(std::string path, std::string name, long long size);
 	int file_remove(std::string path, std::string name);
-	int file_display(std::string fullpath); // !
-	int file_copy(std::string source_file, std::string dest_dir, string dest_name); // !
+	int file_display(std::string fullpath);
+	int file_copy(std::string source_file, std::string dest_dir, string dest_name);
+
+	// File data by inode, return number of bytes read or written, -1 if not a file
+	int file_read(int inode_num, long long offset, int length, char* buffer);
+	int file_write(int inode_num, long long offset, int length, const char* buffer);
+	int file_truncate(int inode_num, long long size);
+
+	// Whole trees, walked by inode. Walks run on the thread pool when they only read
+	// or operations are concurrent.
+	int tree_remove(std::string path, std::string name);
+	int tree_copy(std::string source, std::string dest_dir, std::string dest_name);
+	int tree_usage(std::string fullpath);
+	int tree_find(std::string fullpath, std::string pattern, int file_type = Inode::UNKNOWN);
+
+	// Consistency check of the whole disk. Bitmaps and reference counts are rebuilt from the
+	// inodes and directories and compared with the disk, repair writes what was rebuilt.
+	// Returns INCONSISTENT if problems are left, problems_found counts the repaired ones too.
+	int check(bool repair = false, int* problems_found = NULL);
+
+	// Defragmentation moves the blocks of each file and directory into one run, the lowest
+	// free one that holds them, so the free space gathers at the end of the disk. Blocks
+	// shared with reflinked copies stay in place. defrag() runs whole passes and prints the
+	// fragmentation before and after. defrag_step() moves about budget blocks and goes on
+	// from there on the next call, it returns the blocks moved or -1 once nothing is left.
+	int defrag();
+	int defrag_step(int budget);
+	int display_fragmentation();
 
 	// Return codes
 	static const int SUCCESS = 0x0;
@@ -56,62 +189,381 @@ public:
 	static const int INCOMPATIBLE = 0x4;
 	static const int NOT_FILE = 0x5;
 	static const int NOT_DIR = 0x6;
+	static const int NOT_EMPTY = 0x7;
+	static const int INCONSISTENT = 0x8;
 	
 private:
 	// Constants
 	static const int inode_root = 2;
 	static const int inode_first = 11;
+	static const int blocks_max = INT_MAX - 63;   // Block numbers stay 32-bit, bitmaps are scanned by words
+	static const int inodes_max = 1 << 22;   // Bounds the inode table and the inode locks of large disks
+	static const int extent_depth_max = 5;   // Levels of index blocks below the root, enough for blocks_max extents
+
+	static const int dentry_cache_limit = 0x10000;
+	static const int dentry_shards_count = 64;
+	static const int journal_batch = 32;   // Operations per group commit
 
     // Flags
     static const bool USED = true;
     static const bool UNUSED = false;
 
 	// Variables
-	std::unique_ptr<char[]> disk;
+	std::unique_ptr<BlockDevice> device;   // Memory of the disk or its image file, none if mapped
+	ZeroBuffer disk_buffer;   // Blocks of an image file device
+	std::unique_ptr<MappedFile> disk_map;
+	char* disk = NULL;
+	int device_flags = 0;   // For the image files opened later
+
+	// Disks loaded on demand read frames of at least a page into disk_buffer when first used.
+	// Beyond the cache limit frames are evicted by CLOCK: a frame used since the last sweep
+	// is kept, a frame of the inode table for one more sweep. Frames before the inode table
+	// are never evicted.
+	bool on_demand = false;
+	long long frame_size = 0;
+	long long cache_limit = 0;
+	std::vector<uint64_t> frames_resident;
+	std::vector<uint64_t> frames_referenced;
+	std::vector<uint64_t> frames_hot;
+	uint64_t frames_count = 0;   // Resident frames
+	long long frames_hand = 0;   // Next frame of the clock
+
+	struct CacheCounters {
+		uint64_t hits = 0;   // Uses of the disk with every frame resident
+		uint64_t misses = 0;   // Uses that read frames
+		uint64_t evictions = 0;
+		uint64_t written_back = 0;   // Dirty blocks written in place to evict their frames
+	};
+	CacheCounters cache_counters;
+
+	// Files read in order have a window of blocks ahead of the reader fetched in the same
+	// batch as the read. The window doubles while the reads stay sequential.
+	static const int readahead_min = 0x20000;
+	static const int readahead_max = 0x200000;
+	static const int readahead_slots = 64;
+	struct Readahead {
+		int inode = 0;
+		long long next = 0;   // Offset where a sequential read continues
+		long long ahead = 0;   // End of the blocks fetched
+		long long window = 0;
+	};
+	std::vector<Readahead> readaheads = std::vector<Readahead>(readahead_slots);   // By inode number of file_read()
 	Superblock sb;
+	std::vector<int> block_hints;   // Next-fit position in each group
+	std::vector<int> inode_hints;
+
+	// Blocks written since the disk was last in sync with image_path
+	std::string image_path;
+	std::vector<uint64_t> dirty_blocks;
+
+	// Blocks written since the last journal commit
+	std::vector<uint64_t> journal_dirty;
+	int journal_dirty_count = 0;
+	int journal_ops = 0;
+	int journal_head = 0;   // Next free block in the journal
+	int journal_next = 0;   // Sequence of the next transaction
 
-	// Read/write operations
-	template<typename T> bool object_write(int byte_offset, T data);
-	template<typename T> bool object_read(int byte_offset, T* data);
-	template<typename T> bool block_write(int block_offset, T data);
-	template<typename T> bool block_read(int block_offset, T* data);
+	// Directory entry cache: parent inode -> name -> inode (0 if not exist), sharded by both
+	struct DentryShard {
+		std::shared_mutex lock;
+		std::unordered_map<int, std::unordered_map<std::string, int>> dirs;
+		int size = 0;
+	};
+	std::unique_ptr<DentryShard[]> dentry_shards = std::make_unique<DentryShard[]>(dentry_shards_count);
+
+	// Locks are held by pointer so the file system stays movable. Operations hold the
+	// disk lock shared, commits and image changes hold it exclusively. Inodes are locked
+	// directories before files and parents before children.
+	typedef std::shared_lock<std::shared_mutex> ReadLock;
+	typedef std::unique_lock<std::shared_mutex> WriteLock;
+	typedef std::unique_lock<std::mutex> MutexLock;
+	struct Locks {
+		std::shared_mutex disk;
+		std::mutex refcounts;   // Reference counts, taken before a group
+		std::mutex fetch;   // Frames read on demand
+		std::mutex readahead;   // Windows of file_read(), taken before fetch
+		std::unique_ptr<std::mutex[]> block_groups;   // Block bitmap and free counts of a group
+		std::unique_ptr<std::mutex[]> inode_groups;   // Inode bitmap and free counts of a group
+		std::unique_ptr<std::shared_mutex[]> inodes;
+	};
+	std::unique_ptr<Locks> locks = std::make_unique<Locks>();
+	bool concurrent = false;
+
+	// Counters and latencies of operations, kept across images
+	std::unique_ptr<Stats> stats = std::make_unique<Stats>();
+
+	// Workers for whole image work, started when first needed
+	std::unique_ptr<ThreadPool> pool;
+	ThreadPool& thread_pool();
+
+	ReadLock read_lock(std::shared_mutex& mutex);
+	ReadLock disk_read_lock();
+	WriteLock write_lock(std::shared_mutex& mutex);
+	ReadLock inode_read_lock(int inode_num);
+	WriteLock inode_write_lock(int inode_num);
+	MutexLock mutex_lock(std::mutex& mutex);
+	MutexLock group_lock(std::unique_ptr<std::mutex[]>& group_locks, int group);
+	template<typename Lock> static void unlock(Lock& lock) { if (lock.owns_lock()) lock.unlock(); }
+	void locks_reset();
+
+	int mount();
+	void frames_reset(bool enabled);
+	bool device_read(BlockDevice& source, const std::vector<BlockDevice::Request>& requests);
+	bool device_write(BlockDevice& target, const std::vector<BlockDevice::Request>& requests);
+	int superblock_read();
+	bool superblock_rev3_valid(const SuperblockRev4& old, long long disk_size);
+	int image_write(std::string filepath);
+	int image_write_chunked(std::string filepath);
+	int data_block_first();
+	void dirty_clear();
+	int dirty_next(const std::vector<uint64_t>& blocks, int block_num, int* count);
+	inline void dirty_mark(long long byte_offset, int length, bool journaled = true);
+	int data_flush();
+
+	// Journal
+	bool journal_active();
+	int journal_threshold();
+	int journal_end(ReadLock& disk_lock);
+	int journal_commit();
+	int journal_replay();
+	int checkpoint();
+
+	// Read/write operations. Memory of the disk is addressed through disk_at().
+	char* disk_at(long long byte_offset, long long length);
+	void frames_fetch(long long byte_offset, long long length);
+	uint64_t frames_read(const std::vector<std::pair<long long, long long>>& ranges);
+	void file_readahead(const Inode& inode, Readahead& state, long long offset, long long length);
+	bool frames_over_limit();
+	void frames_trim();
+	template<typename T> bool object_write(long long byte_offset, T data);
+	template<typename T> bool object_read(long long byte_offset, T* data);
+
+	// Byte offsets are 64-bit, block and inode numbers are not
+	long long block_offset(int block_num) { return (long long) block_num * sb.block_size; }
+	long long inode_offset(int inode_num) { return block_offset(sb.inode_table) + (long long) inode_num * sizeof(Inode); }
+
+	// In-place views, NULL when out of range. Nothing is copied, a view is valid
+	// while the disk stays loaded and the caller holds the lock of the object.
+	template<typename T> const T* object_view(long long byte_offset);
+	const Inode* inode_view(int inode_num);
+	int inode_type(int inode_num);
+	bool dir_open(int inode_num);
+	DirSpan dir_block_view(int block_num);
+	template<typename T> bool block_write(int block_num, T data);
+	template<typename T> bool block_read(int block_num, T* data);
+	bool data_write(long long byte_offset, const char* data, int length);
+	bool data_read(long long byte_offset, char* data, int length);
 
 	// Bitmap functions
-	bool bit_read(int byte_offset, int bit_offset);
-	bool bit_write(int byte_offset, int bit_offset, bool is_used);
-	int bit_unused(int byte_offset, int size);
+	bool bit_read(long long byte_offset, int bit_offset);
+	bool bit_write(long long byte_offset, int bit_offset, bool is_used);
+	int bit_unused(long long byte_offset, int first, int last, int start);
+	int bit_scan(long long byte_offset, int first, int last, bool is_used = UNUSED);
+	int bit_count(long long byte_offset, int first, int last);
+	int bit_unused_run(long long byte_offset, int first, int last, int count);
+
+	// Block groups
+	void groups_single();
+	int group_read(int group, int field);
+	void group_add(int group, int field, int delta);
+	int group_recount();
+	int group_of_inode(int file_type, int parent_inode);
+	int block_goal(int inode_num);
     
     // Blocks operations
-    // ! Implement generator function
-	int dir_entry_find(int inode_num, const char* name, int indirect = 0); // ! Implement indirect block support
+	int block_alloc(int goal = 0, bool journaled = true);   // File data is zeroed outside the journal
+	int block_of(const Inode& inode, int logical);
+	int block_run(const Inode& inode, int logical, int* count, int limit = INT_MAX);   // Only block pointers stop at limit
+	int block_map(int inode_num, Inode& inode, int logical, bool journaled = true);
+	int block_set(int inode_num, Inode& inode, int logical, int block_num);
+	int block_refs(int block_num);
+	void block_refs_add(int block_num, int delta);
+	int block_unshared(int block_num, int count);
+	int inode_extents(const Inode& inode, std::vector<Extent>& extents, std::vector<int>* tree_blocks = NULL);   // tree_blocks gets the blocks of the mapping
+	int blocks_free_all(int inode_num);
+	int blocks_free_run(int block_num, int count);
+	Inode inode_init(int file_type);
+	int inode_alloc(const Inode& inode, int parent_inode);
+	void inode_free(int inode_num);
+	void dir_mark_removed(int inode_num);
+
+	// File data by inode, the caller holds the inode lock
+	int inode_read(int inode_num, long long offset, int length, char* buffer);
+	int inode_write(int inode_num, long long offset, int length, const char* buffer);
+	int inode_truncate(int inode_num, long long size);
+	int inode_reflink(int source_inode_num, int inode_num);
+
+	// Extent tree
+	int extent_leaf_max();
+	void extent_node_read(int block_num, ExtentHeader* header, std::vector<Extent>& entries);
+	void extent_node_write(int block_num, ExtentHeader header, const std::vector<Extent>& entries);
+	void extent_node_collect(int block_num, int depth, std::vector<Extent>& extents, std::vector<int>* tree_blocks);
+	int extent_search(const Extent* entries, int count, int logical);
+	int extent_tree_size(int count);   // Blocks of a tree for count extents
+	void extent_tree_build(Inode& inode, std::vector<Extent> entries, int first_block);
+	void extent_tree_relink(Inode& inode, const std::vector<int>& old_blocks, const std::vector<int>& new_blocks);
+	int extent_find(const Inode& inode, int logical, Extent* extent);
+	int extent_insert(Inode& inode, int logical, int physical);
+	int extent_merge(std::vector<Extent>& extents, int logical, int physical);
+
+	// Directory operations
+	long long dir_entry_find(int inode_num, const char* name, int* slot = NULL);
 	int dir_entry_add(int inode_num, DirEntry entry);
+	int dir_entry_remove(int inode_num, const char* name);
+	uint32_t dir_hash(const char* name);
+	int dir_index_limit();
+	int dir_index_search(long long root_offset, uint32_t hash);
+	int dir_index_create(int inode_num, Inode& dir_inode);
+	int dir_index_add(int inode_num, Inode& dir_inode, DirEntry entry);
+	int dir_lookup(int parent_inode, const std::string& name);
+	int dir_entries(int inode_num, std::vector<DirEntry>* entries, int limit = INT_MAX);
+	bool dir_contains(int dir_inode_num, int inode_num);
+	int dir_create_at(int path_inode_num, const std::string& name, int* new_inode_num = NULL);
+	int file_copy_at(int source_inode_num, int dest_inode_num, const std::string& dest_name, long long* size_copied = NULL);
 	int inode_of(std::string fullpath, int parent_inode = 0);
-	int blocks_free_all(int inode_num, int indirect = 0);
+
+	// Tree walk: the entries of a directory are visited, then the directory is left and
+	// its subdirectories are walked. Nothing is locked while a visit runs.
+	struct TreeEntry {
+		int inode = 0;
+		int file_type = Inode::UNKNOWN;
+		int depth = 0;   // 1 for the entries of the first directory
+		int context = 0;   // Taken from the parent, a visit may change it for the children
+		std::string name;
+		std::string path;   // Relative to the first directory
+	};
+	typedef std::function<bool(TreeEntry& entry)> TreeVisit;   // false skips the children of a directory
+	typedef std::function<void(const TreeEntry& dir)> TreeLeave;
+	int tree_walk(const TreeEntry& root, const TreeVisit& visit, const TreeLeave& leave, bool parallel);
+	bool tree_parallel(bool read_only);
+
+	// Consistency check, inodes are scanned in ranges and directories in batches
+	static const int check_range = 0x1000;
+	static const int check_batch = 64;
+	struct CheckScan;
+	bool check_inode(int inode_num, std::vector<uint64_t>& owned, CheckScan& scan);
+	void check_dir(int inode_num, const std::vector<uint64_t>& in_use, CheckScan& scan);
+	int block_clone(int inode_num, int block_num);
+
+	// Defragmentation. A pass takes the inodes from the end of the disk to the start.
+	struct DefragPass {
+		std::vector<int> inodes;
+		size_t next = 0;
+		uint64_t moved = 0;   // Blocks moved by the pass
+	};
+	DefragPass defrag_pass;
+	struct Fragmentation {
+		uint64_t inodes = 0;   // Files and directories with blocks
+		uint64_t runs = 0;   // Runs of their blocks on disk
+		uint64_t fragmented = 0;   // Inodes in more than one run
+		int free_blocks = 0;
+		int free_runs = 0;
+		int free_largest = 0;
+		int used_end = 0;   // Block after the last one in use
+	};
+	Fragmentation fragmentation();
+	void fragmentation_print(const Fragmentation& state);
+	std::vector<int> defrag_plan();
+	int inode_defrag(int inode_num, int* moved_blocks);
+
+	// Directory entry cache
+	DentryShard& dentry_shard(int parent_inode, const std::string& name);
+	void dentry_clear();
+	int dentry_lookup(int parent_inode, const std::string& name);
+	void dentry_insert(int parent_inode, const std::string& name, int inode_num);
+	void dentry_invalidate_dir(int inode_num);
 };
 
 
+inline void FileSystem::dirty_mark(long long byte_offset, int length, bool journaled) {
+	int last = (int) ((byte_offset + length - 1) / sb.block_size);
+	for (int block_num = (int) (byte_offset / sb.block_size); block_num <= last; block_num++) {
+		// Words are shared by neighbouring blocks, set bits atomically
+		uint64_t bit = 1ULL << (block_num % 64);
+		uint64_t* word = &dirty_blocks[block_num / 64];
+		if (!(atomic_load64(word) & bit))
+			atomic_or64(word, bit);
+		word = &journal_dirty[block_num / 64];
+		if (journaled && !(atomic_load64(word) & bit) && !(atomic_or64(word, bit) & bit))
+			atomic_add32(&journal_dirty_count, 1);
+	}
+}
+
+inline char* FileSystem::disk_at(long long byte_offset, long long length) {
+	if (on_demand)
+		frames_fetch(byte_offset, length);
+	return disk + byte_offset;
+}
+
 template<typename T>
-bool FileSystem::object_write(int byte_offset, T data) {
-	*((T*)(disk.get() + byte_offset)) = data;
+bool FileSystem::object_write(long long byte_offset, T data) {
+	*((T*) disk_at(byte_offset, sizeof(T))) = data;
+	dirty_mark(byte_offset, sizeof(T));
 	return true;
 }
 
 template<typename T>
-bool FileSystem::object_read(int byte_offset, T* data) {
-	*data = *((T*)(disk.get() + byte_offset));
+bool FileSystem::object_read(long long byte_offset, T* data) {
+	*data = *((const T*) disk_at(byte_offset, sizeof(T)));
 	return true;
 }
 
 template<typename T>
-bool FileSystem::block_write(int block_offset, T data) {
-	memcpy(disk.get() + block_offset * sb.block_size, data, sb.block_size);
+bool FileSystem::block_write(int block_num, T data) {
+	memcpy(disk_at(block_offset(block_num), sb.block_size), data, sb.block_size);
+	dirty_mark(block_offset(block_num), sb.block_size);
 	return true;
 }
 
 template<typename T>
-bool FileSystem::block_read(int block_offset, T* data) {
-	memcpy(data, disk.get() + block_offset * sb.block_size, sb.block_size);
+const T* FileSystem::object_view(long long byte_offset) {
+	if (byte_offset < 0 || byte_offset + (long long) sizeof(T) > sb.disk_size)
+		return NULL;
+	return (const T*) disk_at(byte_offset, sizeof(T));
+}
+
+template<typename T>
+bool FileSystem::block_read(int block_num, T* data) {
+	memcpy(data, disk_at(block_offset(block_num), sb.block_size), sb.block_size);
 	return true;
 }
 
+// File data is not journaled
+inline bool FileSystem::data_write(long long byte_offset, const char* data, int length) {
+	memcpy(disk_at(byte_offset, length), data, length);
+	dirty_mark(byte_offset, length, false);
+	return true;
+}
+
+inline bool FileSystem::data_read(long long byte_offset, char* data, int length) {
+	memcpy(data, disk_at(byte_offset, length), length);
+	return true;
+}
+
+inline const Inode* FileSystem::inode_view(int inode_num) {
+	if (inode_num < 0 || inode_num >= sb.inodes_count)
+		return NULL;
+	return object_view<Inode>(inode_offset(inode_num));
+}
+
+inline int FileSystem::inode_type(int inode_num) {
+	const Inode* inode = inode_view(inode_num);
+	return inode != NULL ? inode->file_type : Inode::UNKNOWN;
+}
+
+inline bool FileSystem::dir_open(int inode_num) {
+	const Inode* inode = inode_view(inode_num);
+	return inode != NULL && inode->file_type == Inode::DIRECTORY && !(inode->flags & Inode::REMOVED);
+}
+
+inline DirSpan FileSystem::dir_block_view(int block_num) {
+	DirSpan span;
+	if (block_num <= 0 || block_num >= sb.blocks_count)
+		return span;
+	// The whole block is fetched, it may span several frames of a disk on demand
+	span.entries = (const DirEntry*) disk_at(block_offset(block_num), sb.block_size);
+	span.count = sb.block_size / sizeof(DirEntry);
+	return span;
+}
+
 #endif
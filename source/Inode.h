@@ -3,6 +3,7 @@
 #define INODE_H
 
 #include <ctime>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include "Support.h"
@@ -21,28 +22,124 @@ struct DirEntry {
 };
 
 
+// Entries of one directory block, read in place
+struct DirSpan {
+	const DirEntry* entries = NULL;
+	int count = 0;
+
+	// Slot of the name or -1. The first 8 bytes of every name are compared as one
+	// word before the whole name, bytes after the terminator are left out.
+	int find(const char* name) const {
+		size_t length = strlen(name);
+		if (length >= sizeof(DirEntry::name))
+			return -1;
+		size_t prefix = length + 1 < sizeof(uint64_t) ? length + 1 : sizeof(uint64_t);
+		uint64_t key = 0;
+		uint64_t mask = 0;
+		memcpy(&key, name, prefix);
+		memset(&mask, 0xFF, prefix);
+		for (int i = 0; i < count; i++) {
+			uint64_t word;
+			memcpy(&word, entries[i].name, sizeof(word));
+			if ((word & mask) == key && memcmp(entries[i].name, name, length + 1) == 0)
+				return i;
+		}
+		return -1;
+	}
+};
+
+
+// Hashed directory index, placed after "." and ".." in the first block
+struct DirIndexRoot {
+	int count = 0;
+	int limit = 0;
+};
+
+struct DirIndexEntry {
+	uint32_t hash = 0;   // Lowest hash stored in the leaf
+	int block = 0;   // Logical block of the leaf
+
+	DirIndexEntry() {}
+
+	DirIndexEntry(uint32_t hash, int block) {
+		this->hash = hash;
+		this->block = block;
+	}
+};
+
+
+// Extent tree, stored in place of the block pointers of an inode
+struct ExtentHeader {
+	short entries = 0;
+	short max = 0;
+	short depth = 0;   // 0 if entries are extents, otherwise levels of index blocks down to the leaves
+	short reserved = 0;
+};
+
+struct Extent {
+	int logical = 0;   // First logical block
+	int physical = 0;   // First physical block, or leaf block in the root of a tree
+	int length = 0;   // Number of contiguous blocks
+
+	Extent() {}
+
+	Extent(int logical, int physical, int length) {
+		this->logical = logical;
+		this->physical = physical;
+		this->length = length;
+	}
+};
+
+
 struct Inode {
 	// Constants
 	static const int direct_blocks_count = 10;
+	static const int root_extents_count = 3;
 
 	// Flags
 	static const int UNKNOWN = 0x0;   // Unknown
 	static const int FILE = 0x1;   // Regular file
 	static const int DIRECTORY = 0x2;   // Directory
 
+	static const int INDEXED = 0x1;   // Directory entries are hashed
+	static const int EXTENTS = 0x2;   // Blocks are mapped by extents
+	static const int REMOVED = 0x4;   // Directory freed by a removal of its tree, takes no new entries
+
 	int file_type = 0;
-	int size = 0;
+	uint32_t size_low = 0;
 	int mod_time = (int) time(0);
 	int direct_blocks[direct_blocks_count] = {0};
 	int indirect_block = 0;
-	char reserved[8] = { 0 };
+	int flags = 0;
+	union {
+		int slot_hint = 0;   // Directory slots before this are in use
+		uint32_t size_high;   // Files since revision 5, directories stay below 4 GB
+	};
     
 	Inode() {}
     
-	Inode(int file_type, int size = 0) {
+	Inode(int file_type, long long size = 0) {
 		this->file_type = file_type;
-		this->size = size;
+		size_set(size);
+	}
+
+	long long size() const {
+		if (file_type != FILE)
+			return size_low;
+		return (long long) ((uint64_t) size_high << 32 | size_low);
 	}
+
+	void size_set(long long size) {
+		size_low = (uint32_t) size;
+		if (file_type == FILE)
+			size_high = (uint32_t) ((uint64_t) size >> 32);
+	}
+    
+	// Extent tree root, overlays direct_blocks and indirect_block
+	ExtentHeader* extent_header() { return (ExtentHeader*) direct_blocks; }
+	const ExtentHeader* extent_header() const { return (const ExtentHeader*) direct_blocks; }
+	Extent* extents() { return (Extent*) (extent_header() + 1); }
+	const Extent* extents() const { return (const Extent*) (extent_header() + 1); }
     
 	static std::string strof_file_type(int file_type) {
         switch(file_type) {
@@ -54,4 +151,8 @@ struct Inode {
 	}
 };
 
+static_assert(sizeof(ExtentHeader) + Inode::root_extents_count * sizeof(Extent)
+	== Inode::direct_blocks_count * sizeof(int) + sizeof(int), "Extent root must fit in block pointers");
+static_assert(sizeof(Inode) == 64, "Inode layout is part of the disk format");
+
 #endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include "MappedFile.h"
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+
+MappedFile::~MappedFile() {
+	close();
+}
+
+#if defined(_WIN32)
+
+bool MappedFile::open(string filepath) {
+	close();
+	HANDLE file = CreateFileA(filepath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+		NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+		CloseHandle(file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, 0, NULL);
+	if (mapping == NULL) {
+		CloseHandle(file);
+		return false;
+	}
+	void* data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	if (data == NULL) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+
+	file_handle = file;
+	mapping_handle = mapping;
+	map_data = (char*) data;
+	map_size = (size_t) file_size.QuadPart;
+	map_path = filepath;
+	return true;
+}
+
+bool MappedFile::sync(size_t offset, size_t length) {
+	if (map_data == NULL)
+		return false;
+	if (!FlushViewOfFile(map_data + offset, length))
+		return false;
+	return FlushFileBuffers((HANDLE) file_handle) != 0;
+}
+
+void MappedFile::close() {
+	if (map_data != NULL)
+		UnmapViewOfFile(map_data);
+	if (mapping_handle != NULL)
+		CloseHandle((HANDLE) mapping_handle);
+	if (file_handle != NULL)
+		CloseHandle((HANDLE) file_handle);
+	map_data = NULL;
+	mapping_handle = NULL;
+	file_handle = NULL;
+	map_size = 0;
+	map_path = "";
+}
+
+#else
+
+bool MappedFile::open(string filepath) {
+	close();
+	int file = ::open(filepath.c_str(), O_RDWR);
+	if (file == -1)
+		return false;
+
+	struct stat file_stat;
+	if (fstat(file, &file_stat) != 0 || file_stat.st_size == 0) {
+		::close(file);
+		return false;
+	}
+	void* data = mmap(NULL, file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	if (data == MAP_FAILED) {
+		::close(file);
+		return false;
+	}
+
+	fd = file;
+	map_data = (char*) data;
+	map_size = (size_t) file_stat.st_size;
+	map_path = filepath;
+	return true;
+}
+
+bool MappedFile::sync(size_t offset, size_t length) {
+	if (map_data == NULL)
+		return false;
+
+	// msync() needs a page aligned address
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	size_t start = offset - offset % page_size;
+	if (offset + length > map_size)
+		length = map_size - offset;
+	return msync(map_data + start, offset + length - start, MS_SYNC) == 0;
+}
+
+void MappedFile::close() {
+	if (map_data != NULL)
+		munmap(map_data, map_size);
+	if (fd != -1)
+		::close(fd);
+	map_data = NULL;
+	fd = -1;
+	map_size = 0;
+	map_path = "";
+}
+
+#endif
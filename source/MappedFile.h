@@ -0,0 +1,39 @@
+#pragma once
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+
+// File mapped into memory, writes to the mapping go to the file in place
+class MappedFile {
+public:
+	MappedFile() {}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile();
+
+	bool open(std::string filepath);
+	bool sync(size_t offset, size_t length);
+	void close();
+
+	bool is_open() const { return map_data != NULL; }
+	char* data() const { return map_data; }
+	size_t size() const { return map_size; }
+	const std::string& path() const { return map_path; }
+
+private:
+	char* map_data = NULL;
+	size_t map_size = 0;
+	std::string map_path;
+
+#if defined(_WIN32)
+	void* file_handle = NULL;
+	void* mapping_handle = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+#endif
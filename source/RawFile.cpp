@@ -0,0 +1,211 @@
+#include "RawFile.h"
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+using namespace std;
+
+
+RawFile::~RawFile() {
+	close();
+}
+
+#if defined(_WIN32)
+
+bool RawFile::open(string filepath, bool create, bool direct) {
+	close();
+	// Shared for writing, a device may hold a direct and a buffered handle of one image
+	HANDLE file = CreateFileA(filepath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+		NULL, create ? OPEN_ALWAYS : OPEN_EXISTING, direct ? FILE_FLAG_NO_BUFFERING : FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	file_handle = file;
+	return true;
+}
+
+bool RawFile::read_at(long long offset, char* data, size_t length) {
+	while (length > 0) {
+		OVERLAPPED position = {};
+		position.Offset = (DWORD) offset;
+		position.OffsetHigh = (DWORD) (offset >> 32);
+		DWORD chunk = length > 0x40000000 ? 0x40000000 : (DWORD) length;
+		DWORD done = 0;
+		if (!ReadFile((HANDLE) file_handle, data, chunk, &done, &position) || done == 0)
+			return false;
+		offset += done;
+		data += done;
+		length -= done;
+	}
+	return true;
+}
+
+bool RawFile::write_at(long long offset, const char* data, size_t length) {
+	while (length > 0) {
+		OVERLAPPED position = {};
+		position.Offset = (DWORD) offset;
+		position.OffsetHigh = (DWORD) (offset >> 32);
+		DWORD chunk = length > 0x40000000 ? 0x40000000 : (DWORD) length;
+		DWORD done = 0;
+		if (!WriteFile((HANDLE) file_handle, data, chunk, &done, &position) || done == 0)
+			return false;
+		offset += done;
+		data += done;
+		length -= done;
+	}
+	return true;
+}
+
+bool RawFile::sync() {
+	return FlushFileBuffers((HANDLE) file_handle) != 0;
+}
+
+long long RawFile::size() {
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx((HANDLE) file_handle, &file_size))
+		return -1;
+	return file_size.QuadPart;
+}
+
+bool RawFile::resize(long long size) {
+	// Marked sparse so the parts never written take no space
+	DWORD done = 0;
+	DeviceIoControl((HANDLE) file_handle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &done, NULL);
+	LARGE_INTEGER position;
+	position.QuadPart = size;
+	return SetFilePointerEx((HANDLE) file_handle, position, NULL, FILE_BEGIN) && SetEndOfFile((HANDLE) file_handle);
+}
+
+long long RawFile::data_next(long long offset) {
+	long long file_size = size();
+	if (offset >= file_size)
+		return -1;
+	FILE_ALLOCATED_RANGE_BUFFER query, range;
+	query.FileOffset.QuadPart = offset;
+	query.Length.QuadPart = file_size - offset;
+	DWORD done = 0;
+	if (!DeviceIoControl((HANDLE) file_handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), &range, sizeof(range), &done, NULL)
+		&& GetLastError() != ERROR_MORE_DATA)
+		return offset;
+	if (done == 0)
+		return -1;
+	return range.FileOffset.QuadPart > offset ? range.FileOffset.QuadPart : offset;
+}
+
+long long RawFile::hole_next(long long offset) {
+	long long file_size = size();
+	FILE_ALLOCATED_RANGE_BUFFER query, range;
+	query.FileOffset.QuadPart = offset;
+	query.Length.QuadPart = file_size - offset;
+	DWORD done = 0;
+	if (!DeviceIoControl((HANDLE) file_handle, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), &range, sizeof(range), &done, NULL)
+		&& GetLastError() != ERROR_MORE_DATA)
+		return file_size;
+	if (done == 0 || range.FileOffset.QuadPart > offset)
+		return offset;
+	return range.FileOffset.QuadPart + range.Length.QuadPart;
+}
+
+void RawFile::close() {
+	if (file_handle != NULL)
+		CloseHandle((HANDLE) file_handle);
+	file_handle = NULL;
+}
+
+bool RawFile::is_open() const {
+	return file_handle != NULL;
+}
+
+#else
+
+bool RawFile::open(string filepath, bool create, bool direct) {
+	close();
+	int flags = O_RDWR;
+	if (create)
+		flags |= O_CREAT;
+#if defined(O_DIRECT)
+	if (direct)
+		flags |= O_DIRECT;
+#endif
+	fd = ::open(filepath.c_str(), flags, 0644);
+#if defined(F_NOCACHE)
+	if (fd != -1 && direct)
+		fcntl(fd, F_NOCACHE, 1);
+#endif
+	return fd != -1;
+}
+
+bool RawFile::read_at(long long offset, char* data, size_t length) {
+	while (length > 0) {
+		ssize_t done = pread(fd, data, length, (off_t) offset);
+		if (done <= 0)
+			return false;
+		offset += done;
+		data += done;
+		length -= done;
+	}
+	return true;
+}
+
+bool RawFile::write_at(long long offset, const char* data, size_t length) {
+	while (length > 0) {
+		ssize_t done = pwrite(fd, data, length, (off_t) offset);
+		if (done <= 0)
+			return false;
+		offset += done;
+		data += done;
+		length -= done;
+	}
+	return true;
+}
+
+bool RawFile::sync() {
+	return fsync(fd) == 0;
+}
+
+long long RawFile::size() {
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0)
+		return -1;
+	return (long long) file_stat.st_size;
+}
+
+bool RawFile::resize(long long size) {
+	return ftruncate(fd, (off_t) size) == 0;
+}
+
+// Without SEEK_DATA the whole file is data
+long long RawFile::data_next(long long offset) {
+#if defined(SEEK_DATA)
+	off_t next = lseek(fd, (off_t) offset, SEEK_DATA);
+	if (next != -1)
+		return (long long) next;
+	if (errno == ENXIO)
+		return -1;
+#endif
+	return offset < size() ? offset : -1;
+}
+
+long long RawFile::hole_next(long long offset) {
+#if defined(SEEK_HOLE)
+	off_t next = lseek(fd, (off_t) offset, SEEK_HOLE);
+	if (next != -1)
+		return (long long) next;
+#endif
+	return size();
+}
+
+void RawFile::close() {
+	if (fd != -1)
+		::close(fd);
+	fd = -1;
+}
+
+bool RawFile::is_open() const {
+	return fd != -1;
+}
+
+#endif
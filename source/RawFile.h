@@ -0,0 +1,43 @@
+#pragma once
+#ifndef RAW_FILE_H
+#define RAW_FILE_H
+
+#include <string>
+#include <cstddef>
+
+
+// Unbuffered file with positioned reads and writes
+class RawFile {
+public:
+	RawFile() {}
+	RawFile(const RawFile&) = delete;
+	RawFile& operator=(const RawFile&) = delete;
+	~RawFile();
+
+	// Direct files bypass the page cache, offsets, lengths and buffers must be aligned
+	bool open(std::string filepath, bool create = false, bool direct = false);
+	bool read_at(long long offset, char* data, size_t length);
+	bool write_at(long long offset, const char* data, size_t length);
+	bool sync();
+	long long size();
+	bool resize(long long size);
+
+	// Sparse files: next data at or after offset (-1 if only holes follow), next hole
+	long long data_next(long long offset);
+	long long hole_next(long long offset);
+	void close();
+
+	bool is_open() const;
+#if !defined(_WIN32)
+	int descriptor() const { return fd; }
+#endif
+
+private:
+#if defined(_WIN32)
+	void* file_handle = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+#endif
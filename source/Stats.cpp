@@ -0,0 +1,130 @@
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include "Stats.h"
+using namespace std;
+
+
+const char* const Stats::NAMES[Stats::OPERATIONS_COUNT] = {
+	"init", "save", "load", "map", "sync", "journal_commit", "checkpoint", "device_read", "device_write",
+	"inode_of", "dir_entry_find", "dir_entry_add", "bit_unused", "block_alloc",
+	"dir_list", "dir_create", "dir_remove",
+	"file_create", "file_remove", "file_display", "file_copy", "file_read", "file_write",
+	"tree_remove", "tree_copy", "tree_usage", "tree_find", "check", "defrag",
+};
+
+
+int LatencyHistogram::index_of(uint64_t value) {
+	if (value < (uint64_t) sub_count)
+		return (int) value;
+	// Keep the sub_bits highest bits, the shift selects the bucket
+	int shift = 63 - clz64(value) - sub_bits + 1;
+	return shift * half_count + (int) (value >> shift);
+}
+
+uint64_t LatencyHistogram::value_of(int index) {
+	// Middle of the range counted by the sub-bucket
+	if (index < sub_count)
+		return (uint64_t) index;
+	int shift = index / half_count - 1;
+	uint64_t lowest = (uint64_t) (index - shift * half_count) << shift;
+	return lowest + ((1ULL << shift) - 1) / 2;
+}
+
+void LatencyHistogram::reset() {
+	memset(counts, 0, sizeof(counts));
+}
+
+uint64_t LatencyHistogram::count() const {
+	uint64_t total = 0;
+	for (int i = 0; i < buckets_count; i++)
+		total += counts[i];
+	return total;
+}
+
+uint64_t LatencyHistogram::percentile(double fraction) const {
+	uint64_t total = count();
+	if (total == 0)
+		return 0;
+	uint64_t rank = (uint64_t) (fraction * total);
+	if (rank >= total)
+		rank = total - 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < buckets_count; i++) {
+		seen += counts[i];
+		if (seen > rank)
+			return value_of(i);
+	}
+	return value_of(buckets_count - 1);
+}
+
+
+void Stats::record(Operation operation, uint64_t nanoseconds, uint64_t blocks, uint64_t bytes) {
+	Counters& op = counters[operation];
+	op.latency.record(nanoseconds, shared);
+	if (!shared) {
+		op.calls++;
+		op.blocks += blocks;
+		op.bytes += bytes;
+		op.nanoseconds += nanoseconds;
+		return;
+	}
+	atomic_add64(&op.calls, 1);
+	if (blocks != 0)
+		atomic_add64(&op.blocks, blocks);
+	if (bytes != 0)
+		atomic_add64(&op.bytes, bytes);
+	atomic_add64(&op.nanoseconds, nanoseconds);
+}
+
+void Stats::reset() {
+	for (int i = 0; i < OPERATIONS_COUNT; i++) {
+		counters[i].calls = 0;
+		counters[i].blocks = 0;
+		counters[i].bytes = 0;
+		counters[i].nanoseconds = 0;
+		counters[i].latency.reset();
+	}
+}
+
+static string duration_str(uint64_t nanoseconds) {
+	ostringstream out;
+	out << fixed << setprecision(1);
+	if (nanoseconds < 1000)
+		out << nanoseconds << "ns";
+	else if (nanoseconds < 1000000)
+		out << nanoseconds / 1e3 << "us";
+	else if (nanoseconds < 1000000000)
+		out << nanoseconds / 1e6 << "ms";
+	else
+		out << nanoseconds / 1e9 << "s";
+	return out.str();
+}
+
+void Stats::print(ostream& out) const {
+	out << left << setw(16) << "Operation"
+		<< right << setw(10) << "Calls"
+		<< setw(10) << "Blocks"
+		<< setw(12) << "Bytes"
+		<< setw(10) << "Mean"
+		<< setw(10) << "p50"
+		<< setw(10) << "p90"
+		<< setw(10) << "p99"
+		<< setw(10) << "p99.9"
+		<< "\n";
+	for (int i = 0; i < OPERATIONS_COUNT; i++) {
+		const Counters& op = counters[i];
+		if (op.calls == 0)
+			continue;
+		out << left << setw(16) << NAMES[i]
+			<< right << setw(10) << op.calls
+			<< setw(10) << op.blocks
+			<< setw(12) << op.bytes
+			<< setw(10) << duration_str(op.nanoseconds / op.calls)
+			<< setw(10) << duration_str(op.latency.percentile(0.5))
+			<< setw(10) << duration_str(op.latency.percentile(0.9))
+			<< setw(10) << duration_str(op.latency.percentile(0.99))
+			<< setw(10) << duration_str(op.latency.percentile(0.999))
+			<< "\n";
+	}
+}
@@ -0,0 +1,98 @@
+#pragma once
+#ifndef STATS_H
+#define STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include "Support.h"
+
+
+// Latency histogram in the style of HdrHistogram: buckets double in width, each is split
+// into half_count linear sub-buckets. Values below sub_count are exact, larger ones within
+// 1/half_count.
+class LatencyHistogram {
+public:
+	static const int sub_bits = 5;
+	static const int sub_count = 1 << sub_bits;
+	static const int half_count = sub_count / 2;
+	static const int buckets_count = (64 - sub_bits + 1) * half_count + half_count;
+
+	void record(uint64_t value, bool shared) {
+		if (shared)
+			atomic_add64(&counts[index_of(value)], 1);
+		else
+			counts[index_of(value)]++;
+	}
+	void reset();
+	uint64_t count() const;
+	uint64_t percentile(double fraction) const;
+
+	static int index_of(uint64_t value);
+	static uint64_t value_of(int index);
+
+private:
+	uint64_t counts[buckets_count] = {0};
+};
+
+
+// Call counts, blocks and bytes touched and latency of instrumented operations
+class Stats {
+public:
+	enum Operation {
+		INIT, SAVE, LOAD, MAP, SYNC, JOURNAL_COMMIT, CHECKPOINT, DEVICE_READ, DEVICE_WRITE,
+		INODE_OF, DIR_ENTRY_FIND, DIR_ENTRY_ADD, BIT_UNUSED, BLOCK_ALLOC,
+		DIR_LIST, DIR_CREATE, DIR_REMOVE,
+		FILE_CREATE, FILE_REMOVE, FILE_DISPLAY, FILE_COPY, FILE_READ, FILE_WRITE,
+		TREE_REMOVE, TREE_COPY, TREE_USAGE, TREE_FIND, CHECK, DEFRAG,
+		OPERATIONS_COUNT
+	};
+	static const char* const NAMES[OPERATIONS_COUNT];
+
+	struct Counters {
+		uint64_t calls = 0;
+		uint64_t blocks = 0;
+		uint64_t bytes = 0;
+		uint64_t nanoseconds = 0;
+		LatencyHistogram latency;
+	};
+
+	void record(Operation operation, uint64_t nanoseconds, uint64_t blocks, uint64_t bytes);
+	void reset();
+	void print(std::ostream& out) const;
+
+	// Counters are updated atomically when operations run on several threads
+	bool shared = false;
+
+private:
+	Counters counters[OPERATIONS_COUNT];
+};
+
+
+// Measures one call from construction to destruction
+class StatsTimer {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	StatsTimer(Stats& stats, Stats::Operation operation) : stats(stats), operation(operation), start(Clock::now()) {}
+	StatsTimer(const StatsTimer&) = delete;
+	StatsTimer& operator=(const StatsTimer&) = delete;
+	~StatsTimer() {
+		uint64_t nanoseconds = (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+		stats.record(operation, nanoseconds, blocks, bytes);
+	}
+
+	void add(uint64_t blocks, uint64_t bytes) {
+		this->blocks += blocks;
+		this->bytes += bytes;
+	}
+
+private:
+	Stats& stats;
+	Stats::Operation operation;
+	Clock::time_point start;
+	uint64_t blocks = 0;
+	uint64_t bytes = 0;
+};
+
+#endif
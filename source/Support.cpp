@@ -1,5 +1,9 @@
 #include <cstring>
 #include "Support.h"
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
 
@@ -9,3 +13,41 @@ void strcpy_s(char dst[], const char* src) {
 	strcpy(dst, src);
 }
 #endif
+
+void ZeroDelete::operator()(char* data) const {
+#if !defined(_WIN32)
+	if (mapped != 0) {
+		munmap(data, mapped);
+		return;
+	}
+#endif
+	free(data);
+}
+
+ZeroBuffer zero_buffer(size_t size, bool releasable) {
+#if !defined(_WIN32)
+	static const size_t map_threshold = 0x4000000;
+	if (size >= map_threshold || (releasable && size > 0)) {
+		void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (data == MAP_FAILED)
+			return ZeroBuffer();
+		ZeroDelete deleter;
+		deleter.mapped = size;
+		return ZeroBuffer((char*) data, deleter);
+	}
+#endif
+	return ZeroBuffer((char*) calloc(size, 1));
+}
+
+void zero_release(ZeroBuffer& buffer, size_t offset, size_t length) {
+#if !defined(_WIN32)
+	if (buffer.get_deleter().mapped == 0)
+		return;
+	// Only whole pages inside the range
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t first = (offset + page - 1) / page * page;
+	size_t last = (offset + length) / page * page;
+	if (first < last)
+		madvise(buffer.get() + first, last - first, MADV_DONTNEED);
+#endif
+}
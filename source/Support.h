@@ -2,10 +2,172 @@
 #ifndef SUPPORT_H
 #define SUPPORT_H
 
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <stdlib.h>
+#endif
+
 
 // Allow GNU compiler to understand strcpy_s() of MSVC
 #if !defined(_MSC_VER)
 void strcpy_s(char dst[], const char* src);
 #endif
 
+// Zero-filled memory the system fills lazily. Large sizes are mapped without reserving
+// swap, so a sparse disk may be larger than the memory as long as it is not filled.
+struct ZeroDelete {
+	size_t mapped = 0;   // Length of the mapping, 0 if from calloc
+	void operator()(char* data) const;
+};
+typedef std::unique_ptr<char[], ZeroDelete> ZeroBuffer;
+
+// Releasable buffers are mapped whatever their size, so zero_release() can free their pages
+ZeroBuffer zero_buffer(size_t size, bool releasable = false);
+
+// Give pages of a mapped buffer back to the system, they read as zeros again.
+// Memory from calloc is kept.
+void zero_release(ZeroBuffer& buffer, size_t offset, size_t length);
+inline bool zero_releasable(const ZeroBuffer& buffer) { return buffer && buffer.get_deleter().mapped != 0; }
+
+// True if every byte is 0, checked a word at a time
+inline bool is_zeros(const char* data, size_t length) {
+	uint64_t bits = 0;
+	size_t i = 0;
+	for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		bits |= word;
+		if (bits != 0)
+			return false;
+	}
+	for (; i < length; i++)
+		bits |= (uint8_t) data[i];
+	return bits == 0;
+}
+
+// Bit manipulation intrinsics of GNU and MSVC compilers
+// Count leading zeros, value must not be 0
+inline int clz64(uint64_t value) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse64(&index, value);
+	return 63 - (int) index;
+#else
+	return __builtin_clzll(value);
+#endif
+}
+
+// Count trailing zeros, value must not be 0
+inline int ctz64(uint64_t value) {
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return (int) index;
+#else
+	return __builtin_ctzll(value);
+#endif
+}
+
+// Count bits that are set
+inline int popcount64(uint64_t value) {
+#if defined(_MSC_VER)
+	return (int) __popcnt64(value);
+#else
+	return __builtin_popcountll(value);
+#endif
+}
+
+// FNV-1a hash of a byte string
+inline uint32_t fnv1a32(const void* data, size_t length, uint32_t hash = 2166136261u) {
+	const unsigned char* bytes = (const unsigned char*) data;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Reverse byte order, so first byte in memory becomes the most significant byte
+inline uint64_t bswap64(uint64_t value) {
+#if defined(_MSC_VER)
+	return _byteswap_uint64(value);
+#else
+	return __builtin_bswap64(value);
+#endif
+}
+
+// Atomic operations of GNU and MSVC compilers on words shared between threads
+inline uint64_t atomic_load64(const uint64_t* word) {
+#if defined(_MSC_VER)
+	return *(const volatile uint64_t*) word;
+#else
+	return __atomic_load_n(word, __ATOMIC_RELAXED);
+#endif
+}
+
+// Set bits of a word, return the previous value
+inline uint64_t atomic_or64(uint64_t* word, uint64_t bits) {
+#if defined(_MSC_VER)
+	return (uint64_t) _InterlockedOr64((volatile long long*) word, (long long) bits);
+#else
+	return __atomic_fetch_or(word, bits, __ATOMIC_RELAXED);
+#endif
+}
+
+// Publish memory written before the bits are set, to threads that see them with atomic_acquire64()
+inline uint64_t atomic_or_release64(uint64_t* word, uint64_t bits) {
+#if defined(_MSC_VER)
+	return (uint64_t) _InterlockedOr64((volatile long long*) word, (long long) bits);
+#else
+	return __atomic_fetch_or(word, bits, __ATOMIC_RELEASE);
+#endif
+}
+
+inline uint64_t atomic_acquire64(const uint64_t* word) {
+#if defined(_MSC_VER)
+	return *(const volatile uint64_t*) word;
+#else
+	return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+#endif
+}
+
+// Add to a counter, return the previous value
+inline uint64_t atomic_add64(uint64_t* value, uint64_t delta) {
+#if defined(_MSC_VER)
+	return (uint64_t) _InterlockedExchangeAdd64((volatile long long*) value, (long long) delta);
+#else
+	return __atomic_fetch_add(value, delta, __ATOMIC_RELAXED);
+#endif
+}
+
+inline int atomic_load32(const int* value) {
+#if defined(_MSC_VER)
+	return *(const volatile int*) value;
+#else
+	return __atomic_load_n(value, __ATOMIC_RELAXED);
+#endif
+}
+
+inline void atomic_store32(int* value, int new_value) {
+#if defined(_MSC_VER)
+	_InterlockedExchange((volatile long*) value, (long) new_value);
+#else
+	__atomic_store_n(value, new_value, __ATOMIC_RELAXED);
+#endif
+}
+
+// Add to a counter, return the previous value
+inline int atomic_add32(int* value, int delta) {
+#if defined(_MSC_VER)
+	return (int) _InterlockedExchangeAdd((volatile long*) value, (long) delta);
+#else
+	return __atomic_fetch_add(value, delta, __ATOMIC_RELAXED);
+#endif
+}
+
 #endif
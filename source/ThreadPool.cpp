@@ -0,0 +1,64 @@
+#include "ThreadPool.h"
+using namespace std;
+
+
+ThreadPool::ThreadPool(int threads) {
+	if (threads <= 0)
+		threads = (int) thread::hardware_concurrency();
+	for (int i = 1; i < threads; i++)
+		workers.emplace_back(&ThreadPool::worker, this);
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+	}
+	work_ready.notify_all();
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+}
+
+void ThreadPool::for_each(int count, const function<void(int)>& body) {
+	if (workers.empty() || count <= 1) {
+		for (int i = 0; i < count; i++)
+			body(i);
+		return;
+	}
+
+	lock_guard<mutex> loop_guard(loop_lock);
+	unique_lock<mutex> guard(lock);
+	loop_body = &body;
+	loop_count = count;
+	loop_next = 0;
+	active = (int) workers.size();
+	generation++;
+	guard.unlock();
+	work_ready.notify_all();
+
+	run_items();
+	guard.lock();
+	work_done.wait(guard, [this] { return active == 0; });
+	loop_body = NULL;
+}
+
+void ThreadPool::worker() {
+	uint64_t seen = 0;
+	unique_lock<mutex> guard(lock);
+	while (true) {
+		work_ready.wait(guard, [&] { return stopping || generation != seen; });
+		if (stopping)
+			return;
+		seen = generation;
+		guard.unlock();
+		run_items();
+		guard.lock();
+		if (--active == 0)
+			work_done.notify_all();
+	}
+}
+
+void ThreadPool::run_items() {
+	for (int i = loop_next++; i < loop_count; i = loop_next++)
+		(*loop_body)(i);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// Worker threads for indexed loops, the calling thread takes part in every loop
+class ThreadPool {
+public:
+	explicit ThreadPool(int threads = 0);   // 0 uses every hardware thread
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	~ThreadPool();
+
+	int size() const { return (int) workers.size() + 1; }
+
+	// Run body(i) for every i in [0, count) and return when all are done.
+	// Loops of different callers take turns, a body must not start another loop.
+	void for_each(int count, const std::function<void(int)>& body);
+
+private:
+	void worker();
+	void run_items();
+
+	std::vector<std::thread> workers;
+	std::mutex loop_lock;   // One loop at a time
+	std::mutex lock;
+	std::condition_variable work_ready;
+	std::condition_variable work_done;
+	const std::function<void(int)>* loop_body = NULL;
+	int loop_count = 0;
+	std::atomic<int> loop_next{0};
+	int active = 0;   // Workers still in the current loop
+	uint64_t generation = 0;
+	bool stopping = false;
+};
+
+#endif
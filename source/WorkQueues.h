@@ -0,0 +1,87 @@
+#pragma once
+#ifndef WORK_QUEUES_H
+#define WORK_QUEUES_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ThreadPool.h"
+
+
+// Work-stealing queues for tasks that make more tasks, like the directories of a tree walk.
+// A worker takes the newest task of its own queue, which keeps it depth first, and steals
+// the oldest task of another queue when its own is empty.
+template<typename T>
+class WorkQueues {
+public:
+	explicit WorkQueues(int workers) : queues(workers > 0 ? workers : 1) {}
+	WorkQueues(const WorkQueues&) = delete;
+	WorkQueues& operator=(const WorkQueues&) = delete;
+
+	int size() const { return (int) queues.size(); }
+
+	void push(int worker, T task) {
+		pending.fetch_add(1);
+		Queue& queue = queues[worker];
+		std::lock_guard<std::mutex> guard(queue.lock);
+		queue.tasks.push_back(std::move(task));
+	}
+
+	// Run process(worker, task) until every task is done, including the tasks pushed by
+	// process. Workers run as a loop of the pool, without a pool the caller runs them all.
+	void run(ThreadPool* pool, const std::function<void(int, T&)>& process) {
+		if (pool == NULL || size() == 1) {
+			for (int worker = 0; worker < size(); worker++)
+				work(worker, process);
+			return;
+		}
+		pool->for_each(size(), [&](int worker) { work(worker, process); });
+	}
+
+private:
+	struct Queue {
+		std::mutex lock;
+		std::deque<T> tasks;
+	};
+
+	bool take(int worker, T* task) {
+		int count = size();
+		for (int i = 0; i < count; i++) {
+			Queue& queue = queues[(worker + i) % count];
+			std::lock_guard<std::mutex> guard(queue.lock);
+			if (queue.tasks.empty())
+				continue;
+			if (i == 0) {
+				*task = std::move(queue.tasks.back());
+				queue.tasks.pop_back();
+			} else {
+				*task = std::move(queue.tasks.front());
+				queue.tasks.pop_front();
+			}
+			return true;
+		}
+		return false;
+	}
+
+	void work(int worker, const std::function<void(int, T&)>& process) {
+		// A task counts as pending until it is processed, so an idle worker keeps
+		// looking while another one may still push
+		T task;
+		while (pending.load() > 0) {
+			if (!take(worker, &task)) {
+				std::this_thread::yield();
+				continue;
+			}
+			process(worker, task);
+			pending.fetch_sub(1);
+		}
+	}
+
+	std::vector<Queue> queues;
+	std::atomic<int> pending{0};
+};
+
+#endif
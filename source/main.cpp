@@ -1,11 +1,40 @@
 #include <iostream>
+#include <fstream>
+#include <string>
 #include "ConsoleUI.h"
 using namespace std;
 
 
-int main() {
+int main(int argc, char** argv) {
+	string script_file;
+	string disk_file;
+	bool stop_on_error = false;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "-f" && i + 1 < argc)
+			script_file = argv[++i];
+		else if (arg == "-e")
+			stop_on_error = true;
+		else if (disk_file.empty() && arg[0] != '-')
+			disk_file = arg;
+		else {
+			cerr << "usage: " << argv[0] << " [-f <script>|-] [-e] [disk_image]\n";
+			return 2;
+		}
+	}
+	ios::sync_with_stdio(false);
+
 	ConsoleUI session;
-	session.main_loop();
+	if (script_file.empty())
+		return session.main_loop(disk_file);
 
-	return 0;
+	// Batch mode, "-" reads the script from standard input
+	if (script_file == "-")
+		return session.run_script(cin, disk_file, stop_on_error);
+	ifstream script(script_file);
+	if (!script) {
+		cerr << script_file << ": cannot open script\n";
+		return 2;
+	}
+	return session.run_script(script, disk_file, stop_on_error);
 }